@@ -0,0 +1,435 @@
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include "MergeKernels.h"
+
+
+// Runs shorter than this are extended with an insertion sort before they are merged.
+const int ADAPTIVE_MIN_MERGE = 32;
+
+// Number of times in a row one side of a merge must win before the merge starts galloping.
+const int ADAPTIVE_MIN_GALLOP = 7;
+
+
+// Returns the number of items at the front of a_items for which a_before(item) is true, where a_before is true
+// for a prefix of the array. Searches exponentially from the front so finding k items takes O(log k) comparisons.
+template<class T, class PREDICATE>
+inline size_t GallopFromFront(const T* a_items, size_t a_length, PREDICATE a_before)
+{
+    size_t low = 0;
+    size_t step = 1;
+    while(step <= a_length && a_before(a_items[step - 1]))
+    {
+        low = step;
+        step <<= 1;
+    }
+
+    // the answer is in [low, high]
+    size_t high = std::min(step - 1, a_length);
+    while(low < high)
+    {
+        size_t middle = (low + high) >> 1;
+        if(a_before(a_items[middle]))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+// The same as GallopFromFront() but counts the items at the back of a_items for which a_after(item) is true.
+template<class T, class PREDICATE>
+inline size_t GallopFromBack(const T* a_items, size_t a_length, PREDICATE a_after)
+{
+    size_t low = 0;
+    size_t step = 1;
+    while(step <= a_length && a_after(a_items[a_length - step]))
+    {
+        low = step;
+        step <<= 1;
+    }
+
+    size_t high = std::min(step - 1, a_length);
+    while(low < high)
+    {
+        size_t middle = (low + high) >> 1;
+        if(a_after(a_items[a_length - 1 - middle]))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+// Merges the neighbouring sorted runs [a_left, a_right) and [a_right, a_end) of a_items in place.
+// Items of the left run that are already smaller than the whole right run, and items of the right run that are
+// already larger than the whole left run, are found by galloping and never move. Only the overlap is merged, using
+// a_temp for a copy of the shorter side, so a_temp must hold (a_end - a_left) / 2 items.
+// When one side keeps winning the merge gallops through it and copies whole blocks. The merge is stable.
+template<class T>
+inline void MergeRunsGalloping(T* a_items, size_t a_left, size_t a_right, size_t a_end, T* a_temp)
+{
+    T* left = a_items + a_left;
+    T* right = a_items + a_right;
+
+    // skip the start of the left run which is not larger than the first item of the right run
+    const T& firstRight = *right;
+    size_t skip = GallopFromFront(left, a_right - a_left, [&](const T& a_item) { return !(firstRight < a_item); });
+    left += skip;
+    size_t leftLength = a_right - a_left - skip;
+    if(leftLength == 0)
+    {
+        return;
+    }
+
+    // skip the end of the right run which is not smaller than the last item of the left run
+    const T& lastLeft = left[leftLength - 1];
+    size_t rightLength = (a_end - a_right) - GallopFromBack(right, a_end - a_right, [&](const T& a_item) { return !(a_item < lastLeft); });
+    if(rightLength == 0)
+    {
+        return;
+    }
+
+    if(leftLength <= rightLength)
+    {
+        // copy the left run out of the way and merge forwards from the start
+        MoveItems(left, a_temp, leftLength);
+        T* source1 = a_temp;
+        T* end1 = a_temp + leftLength;
+        T* source2 = right;
+        T* end2 = right + rightLength;
+        T* destination = left;
+        int wins1 = 0;
+        int wins2 = 0;
+
+        while(source1 < end1 && source2 < end2)
+        {
+            if(*source2 < *source1)
+            {
+                *destination++ = std::move(*source2++);
+                wins1 = 0;
+                if(++wins2 >= ADAPTIVE_MIN_GALLOP)
+                {
+                    // The right run moves down over the space the left run came from, so they may overlap.
+                    const T& key = *source1;
+                    size_t count = GallopFromFront(source2, (size_t)(end2 - source2), [&](const T& a_item) { return a_item < key; });
+                    MoveItemsOverlapping(source2, destination, count);
+                    destination += count;
+                    source2 += count;
+                    wins2 = 0;
+                }
+            }
+            else
+            {
+                *destination++ = std::move(*source1++);
+                wins2 = 0;
+                if(++wins1 >= ADAPTIVE_MIN_GALLOP && source2 < end2)
+                {
+                    const T& key = *source2;
+                    size_t count = GallopFromFront(source1, (size_t)(end1 - source1), [&](const T& a_item) { return !(key < a_item); });
+                    MoveItems(source1, destination, count);
+                    destination += count;
+                    source1 += count;
+                    wins1 = 0;
+                }
+            }
+        }
+
+        // anything left of the right run is already in place
+        MoveItems(source1, destination, end1 - source1);
+    }
+    else
+    {
+        // copy the right run out of the way and merge backwards from the end
+        MoveItems(right, a_temp, rightLength);
+        T* start1 = left;
+        T* source1 = left + leftLength; // one past the next item to take
+        T* start2 = a_temp;
+        T* source2 = a_temp + rightLength;
+        T* destination = right + rightLength; // one past the next item to write
+        int wins1 = 0;
+        int wins2 = 0;
+
+        while(source1 > start1 && source2 > start2)
+        {
+            // take the larger item, and take the right one when they are equal so the merge stays stable
+            if(source2[-1] < source1[-1])
+            {
+                *--destination = std::move(*--source1);
+                wins2 = 0;
+                if(++wins1 >= ADAPTIVE_MIN_GALLOP && source1 > start1)
+                {
+                    // The left run moves up over the space the right run came from, so they may overlap.
+                    const T& key = source2[-1];
+                    size_t count = GallopFromBack(start1, (size_t)(source1 - start1), [&](const T& a_item) { return key < a_item; });
+                    destination -= count;
+                    source1 -= count;
+                    MoveItemsOverlapping(source1, destination, count);
+                    wins1 = 0;
+                }
+            }
+            else
+            {
+                *--destination = std::move(*--source2);
+                wins1 = 0;
+                if(++wins2 >= ADAPTIVE_MIN_GALLOP && source2 > start2)
+                {
+                    const T& key = source1[-1];
+                    size_t count = GallopFromBack(start2, (size_t)(source2 - start2), [&](const T& a_item) { return !(a_item < key); });
+                    destination -= count;
+                    source2 -= count;
+                    MoveItems(source2, destination, count);
+                    wins2 = 0;
+                }
+            }
+        }
+
+        // anything left of the left run is already in place
+        MoveItems(start2, destination - (source2 - start2), source2 - start2);
+    }
+}
+
+
+// Swaps the neighbouring blocks [a_first, a_middle) and [a_middle, a_last) of a_items. If the shorter block fits in
+// a_temp it is moved out of the way and back, which moves every item once, and otherwise std::rotate() swaps them.
+template<class T>
+inline void RotateBuffered(T* a_first, T* a_middle, T* a_last, T* a_temp, size_t a_tempLength)
+{
+    size_t firstLength = a_middle - a_first;
+    size_t secondLength = a_last - a_middle;
+    if(firstLength == 0 || secondLength == 0)
+    {
+        return;
+    }
+    if(firstLength <= secondLength && firstLength <= a_tempLength)
+    {
+        MoveItems(a_first, a_temp, firstLength);
+        MoveItemsOverlapping(a_middle, a_first, secondLength);
+        MoveItems(a_temp, a_first + secondLength, firstLength);
+    }
+    else if(secondLength <= a_tempLength)
+    {
+        MoveItems(a_middle, a_temp, secondLength);
+        MoveItemsOverlapping(a_first, a_first + secondLength, firstLength);
+        MoveItems(a_temp, a_first, secondLength);
+    }
+    else
+    {
+        std::rotate(a_first, a_middle, a_last);
+    }
+}
+
+
+// Merges like MergeRunsGalloping(), but a_temp only has to hold a_tempLength items. While both runs are longer than
+// that, the longer run is cut in half, the other run is cut where that middle item belongs, and the two inner parts
+// are swapped. That leaves two smaller merges side by side, the same as std::inplace_merge() does when it can't get
+// enough memory. The merge stays stable, and with a buffer of sqrt(n) items only a few levels are ever needed.
+template<class T>
+inline void MergeRunsBuffered(T* a_items, size_t a_left, size_t a_right, size_t a_end, T* a_temp, size_t a_tempLength)
+{
+    assert(a_tempLength > 0);
+    while(a_left < a_right && a_right < a_end)
+    {
+        size_t leftLength = a_right - a_left;
+        size_t rightLength = a_end - a_right;
+        if(std::min(leftLength, rightLength) <= a_tempLength)
+        {
+            MergeRunsGalloping(a_items, a_left, a_right, a_end, a_temp);
+            return;
+        }
+
+        // equal items of the right run go after the left cut, and equal items of the left run go before the right cut
+        size_t leftCut;
+        size_t rightCut;
+        if(leftLength >= rightLength)
+        {
+            leftCut = a_left + (leftLength >> 1);
+            rightCut = std::lower_bound(a_items + a_right, a_items + a_end, a_items[leftCut]) - a_items;
+        }
+        else
+        {
+            rightCut = a_right + (rightLength >> 1);
+            leftCut = std::upper_bound(a_items + a_left, a_items + a_right, a_items[rightCut]) - a_items;
+        }
+        RotateBuffered(a_items + leftCut, a_items + a_right, a_items + rightCut, a_temp, a_tempLength);
+        size_t middle = leftCut + (rightCut - a_right);
+
+        // recurse into the first merge and loop for the second
+        MergeRunsBuffered(a_items, a_left, leftCut, middle, a_temp, a_tempLength);
+        a_left = middle;
+        a_right = rightCut;
+    }
+}
+
+
+// Returns the length of the run that starts at the beginning of a_items, which is at least 1.
+// A strictly descending run is reversed so that every run is ascending (strictly, so the sort stays stable).
+template<class T>
+inline size_t FindRunAndMakeAscending(T* a_items, size_t a_length)
+{
+    size_t end = 1;
+    if(end == a_length)
+    {
+        return end;
+    }
+
+    if(a_items[end] < a_items[0])
+    {
+        while(end < a_length && a_items[end] < a_items[end - 1])
+        {
+            ++end;
+        }
+        std::reverse(a_items, a_items + end);
+    }
+    else
+    {
+        while(end < a_length && !(a_items[end] < a_items[end - 1]))
+        {
+            ++end;
+        }
+    }
+    return end;
+}
+
+
+// Sorts a_items with a binary insertion sort, given that the first a_sorted items are already sorted.
+template<class T>
+inline void BinaryInsertionSort(T* a_items, size_t a_length, size_t a_sorted)
+{
+    for(size_t i = std::max<size_t>(a_sorted, 1); i < a_length; ++i)
+    {
+        T item = std::move(a_items[i]);
+        T* position = std::upper_bound(a_items, a_items + i, item);
+        MoveItemsOverlapping(position, position + 1, a_items + i - position);
+        *position = std::move(item);
+    }
+}
+
+
+// Chooses a minimum run length between ADAPTIVE_MIN_MERGE / 2 and ADAPTIVE_MIN_MERGE so that a_length divided by it
+// is a power of 2 or a little less, which keeps the merges balanced.
+inline size_t AdaptiveMinRunLength(size_t a_length)
+{
+    size_t remainder = 0;
+    while(a_length >= ADAPTIVE_MIN_MERGE)
+    {
+        remainder |= (a_length & 1);
+        a_length >>= 1;
+    }
+    return a_length + remainder;
+}
+
+
+// Returns a small temp length for SortRunsAdaptive() that still keeps it fast, which is about sqrt(a_length).
+inline size_t LowMemoryTempLength(size_t a_length)
+{
+    return std::max<size_t>(ADAPTIVE_MIN_MERGE, (size_t)sqrt((double)a_length));
+}
+
+
+// Sorts a_items by finding the runs that are already sorted and merging neighbouring runs with
+// MergeRunsGalloping(). Runs are kept on a stack and merged so that their lengths grow at least as fast as the
+// Fibonacci numbers, which keeps the merges balanced. Input that is already sorted only takes a single pass.
+// a_temp holds a_tempLength items. With a_length / 2 items every merge is a single pass, and with less the merges
+// are split up with MergeRunsBuffered(), which is slower but works down to LowMemoryTempLength() and even below.
+template<class T>
+inline void SortRunsAdaptive(T* a_items, size_t a_length, T* a_temp, size_t a_tempLength)
+{
+    if(a_length < 2)
+    {
+        return;
+    }
+
+    size_t minRunLength = AdaptiveMinRunLength(a_length);
+
+    // the stack can't grow past this when the run lengths grow like the Fibonacci numbers
+    const int maxRuns = 64;
+    size_t runStart[maxRuns];
+    size_t runLength[maxRuns];
+    int numRuns = 0;
+
+    for(size_t start = 0; start < a_length; )
+    {
+        // find the next run, and extend it if it is too short
+        size_t length = FindRunAndMakeAscending(a_items + start, a_length - start);
+        if(length < minRunLength)
+        {
+            size_t extended = std::min(minRunLength, a_length - start);
+            BinaryInsertionSort(a_items + start, extended, length);
+            length = extended;
+        }
+
+        assert(numRuns < maxRuns);
+        runStart[numRuns] = start;
+        runLength[numRuns] = length;
+        numRuns++;
+        start += length;
+
+        // merge runs on the stack until the lengths of the top runs shrink fast enough
+        while(numRuns > 1)
+        {
+            int n = numRuns - 2;
+            if((n > 0 && runLength[n - 1] <= runLength[n] + runLength[n + 1])
+                || (n > 1 && runLength[n - 2] <= runLength[n - 1] + runLength[n]))
+            {
+                if(runLength[n - 1] < runLength[n + 1])
+                {
+                    --n;
+                }
+            }
+            else if(runLength[n] > runLength[n + 1])
+            {
+                break;
+            }
+
+            MergeRunsBuffered(a_items, runStart[n], runStart[n + 1], runStart[n + 1] + runLength[n + 1], a_temp, a_tempLength);
+            runLength[n] += runLength[n + 1];
+            for(int i = n + 1; i < numRuns - 1; ++i)
+            {
+                runStart[i] = runStart[i + 1];
+                runLength[i] = runLength[i + 1];
+            }
+            numRuns--;
+        }
+    }
+
+    // merge whatever is left on the stack from the top down
+    while(numRuns > 1)
+    {
+        int n = numRuns - 2;
+        if(n > 0 && runLength[n - 1] < runLength[n + 1])
+        {
+            --n;
+        }
+        MergeRunsBuffered(a_items, runStart[n], runStart[n + 1], runStart[n + 1] + runLength[n + 1], a_temp, a_tempLength);
+        runLength[n] += runLength[n + 1];
+        for(int i = n + 1; i < numRuns - 1; ++i)
+        {
+            runStart[i] = runStart[i + 1];
+            runLength[i] = runLength[i + 1];
+        }
+        numRuns--;
+    }
+}
+
+
+// a_temp must hold a_length / 2 items.
+template<class T>
+inline void SortRunsAdaptive(T* a_items, size_t a_length, T* a_temp)
+{
+    SortRunsAdaptive(a_items, a_length, a_temp, a_length / 2);
+}
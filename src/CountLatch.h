@@ -1,3 +1,5 @@
+#pragma once
+
 #include <condition_variable>
 #include <mutex>
 
@@ -35,6 +37,13 @@ public:
 		}
 	}
 
+	// returns true if Wait(a_count) would return straight away
+	bool TryWait(int a_count)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_count >= a_count;
+	}
+
 private:
 	int m_count;
 	std::condition_variable m_condition;
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <memory>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "JobQueue.h"
+#include "MergeSort.h"
+
+
+// Opens a file like fopen(), but with fopen_s() where the compiler would otherwise warn that fopen() is unsafe.
+// On failure errno says why, as it does for fopen().
+inline FILE* ExternalSortOpenFile(const char* a_path, const char* a_mode)
+{
+#if defined(_MSC_VER)
+    FILE* file = 0;
+    errno_t error = fopen_s(&file, a_path, a_mode);
+    if(error != 0)
+    {
+        errno = error;
+        return 0;
+    }
+    return file;
+#else
+    return fopen(a_path, a_mode);
+#endif
+}
+
+
+// Returns the id of this process, which keeps the names of temporary files apart from other processes' names.
+inline unsigned long ExternalSortProcessId()
+{
+#if defined(_MSC_VER)
+    return (unsigned long)_getpid();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+
+// Reads up to a_maxCount records. Returns false if the file couldn't be read, or ends part of the way through
+// a record, rather than treating either as the end of the records.
+template<class T>
+inline bool ExternalSortReadRecords(FILE* a_file, T* a_buffer, size_t a_maxCount, size_t& a_count)
+{
+    size_t bytes = fread(a_buffer, 1, sizeof(T) * a_maxCount, a_file);
+    a_count = bytes / sizeof(T);
+    return !ferror(a_file) && (bytes % sizeof(T)) == 0;
+}
+
+
+// Sorts a binary file of T records that may be much larger than memory.
+// The input is cut into runs that fit in the memory budget, each run is sorted with MergeSort::SortMT() and written to
+// a temporary file, and then the runs are streamed through a k-way merge into the output file.
+// While one run is being sorted, the previous run is written and the next run is read on another thread.
+// T must be safe to copy with memcpy, and is compared with operator<.
+template<class T>
+class ExternalSort
+{
+    static_assert(std::is_trivially_copyable<T>::value, "records are read and written as raw bytes");
+
+public:
+    // a_memoryBudget is the number of bytes of buffers to use in total.
+    // Temporary run files are created in a_tempDirectory, which may be empty for the current directory.
+    ExternalSort(size_t a_memoryBudget, const std::string& a_tempDirectory);
+
+    ~ExternalSort();
+
+    // Sorts the records in the file at a_inputPath into a new file at a_outputPath.
+    // Returns false if a file couldn't be read or written, the input size isn't a whole number of records, or memory
+    // couldn't be allocated.
+    bool Sort(const char* a_inputPath, const char* a_outputPath, JobQueue& a_jobQueue);
+
+private:
+
+    // Reads a run file sequentially through a buffer.
+    struct RunReader
+    {
+        FILE* m_file;
+        T* m_buffer;
+        size_t m_bufferLength; // number of T items the buffer can contain
+        size_t m_count; // number of T items in the buffer
+        size_t m_position; // index of the next item in the buffer
+        bool m_failed; // set if the file couldn't be read
+
+        // Returns false when the file has no more items, or couldn't be read.
+        bool Refill()
+        {
+            m_failed = !ExternalSortReadRecords(m_file, m_buffer, m_bufferLength, m_count);
+            m_position = 0;
+            return m_count > 0 && !m_failed;
+        }
+    };
+
+    // An item at the head of a run in the merge heap.
+    struct HeapItem
+    {
+        T m_value;
+        size_t m_run;
+
+        // The heap keeps the largest item at the top, so this is reversed. Ties go to the earlier run.
+        bool operator<(const HeapItem& a_other) const
+        {
+            if(a_other.m_value < m_value)
+            {
+                return true;
+            }
+            if(m_value < a_other.m_value)
+            {
+                return false;
+            }
+            return m_run > a_other.m_run;
+        }
+    };
+
+    // Cuts the input into sorted run files. Returns false on failure.
+    bool CreateRuns(FILE* a_input, JobQueue& a_jobQueue);
+
+    // Merges the given run files into a_output. Returns false on failure.
+    bool MergeRuns(const std::vector<std::string>& a_runs, FILE* a_output);
+
+    // Creates a new run file for writing in the temp directory, and adds it to m_runs so that it is deleted at the
+    // end. The file must not already exist, so that a sort never writes over another sort's files. Returns 0 on
+    // failure.
+    FILE* CreateRunFile();
+
+    // Deletes all temporary run files.
+    void DeleteRuns();
+
+    size_t m_memoryBudget;
+    std::string m_tempDirectory;
+    std::vector<std::string> m_runs;
+    unsigned long long m_tempFileTag; // random, so that names from different sorts and processes differ
+    uint32_t m_tempFileCount;
+};
+
+
+template<class T>
+ExternalSort<T>::ExternalSort(size_t a_memoryBudget, const std::string& a_tempDirectory)
+    : m_memoryBudget(a_memoryBudget)
+    , m_tempDirectory(a_tempDirectory)
+    , m_tempFileCount(0)
+{
+    // the time is mixed in for the platforms where random_device isn't random
+    std::random_device random;
+    m_tempFileTag = ((unsigned long long)random() << 32) ^ random() ^
+        (unsigned long long)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+}
+
+
+template<class T>
+ExternalSort<T>::~ExternalSort()
+{
+    DeleteRuns();
+}
+
+
+template<class T>
+bool ExternalSort<T>::Sort(const char* a_inputPath, const char* a_outputPath, JobQueue& a_jobQueue)
+{
+    FILE* input = ExternalSortOpenFile(a_inputPath, "rb");
+    if(input == 0)
+    {
+        return false;
+    }
+    setvbuf(input, 0, _IONBF, 0); // we only do large reads, so don't buffer them again
+
+    bool success = CreateRuns(input, a_jobQueue);
+    fclose(input);
+
+    // Merge groups of runs until few enough are left to merge straight into the output. Every run needs a read
+    // buffer of at least this size so the reads stay large and sequential.
+    const size_t minRunBufferBytes = 1 << 20;
+    size_t maxRunsPerMerge = std::max<size_t>(3, m_memoryBudget / minRunBufferBytes) - 1; // one buffer is for output
+    while(success && m_runs.size() > maxRunsPerMerge)
+    {
+        std::vector<std::string> group(m_runs.begin(), m_runs.begin() + maxRunsPerMerge);
+        FILE* output = CreateRunFile();
+        if(output == 0)
+        {
+            success = false;
+            break;
+        }
+        setvbuf(output, 0, _IONBF, 0);
+        success = MergeRuns(group, output);
+        success = (fclose(output) == 0) && success;
+
+        // the merged run was added at the end of the list and replaces the group, so all runs get merged evenly
+        for(size_t i = 0; i < group.size(); ++i)
+        {
+            remove(group[i].c_str());
+        }
+        m_runs.erase(m_runs.begin(), m_runs.begin() + maxRunsPerMerge);
+    }
+
+    if(success)
+    {
+        FILE* output = ExternalSortOpenFile(a_outputPath, "wb");
+        if(output == 0)
+        {
+            success = false;
+        }
+        else
+        {
+            setvbuf(output, 0, _IONBF, 0);
+            success = MergeRuns(m_runs, output);
+            success = (fclose(output) == 0) && success;
+        }
+    }
+
+    DeleteRuns();
+    return success;
+}
+
+
+template<class T>
+bool ExternalSort<T>::CreateRuns(FILE* a_input, JobQueue& a_jobQueue)
+{
+    // One buffer is sorted (which needs the same again for scratch) while the other is written and then refilled.
+    size_t runLength = std::max<size_t>(1, m_memoryBudget / (3 * sizeof(T)));
+    std::unique_ptr<T[]> buffer1(new (std::nothrow) T[runLength]);
+    std::unique_ptr<T[]> buffer2(new (std::nothrow) T[runLength]);
+    MergeSort<T> sorter(runLength);
+    if(!buffer1 || !buffer2)
+    {
+        return false;
+    }
+
+    T* sortBuffer = buffer1.get();
+    T* ioBuffer = buffer2.get();
+    size_t sortLength = 0;
+    size_t ioLength = 0;
+    if(!ExternalSortReadRecords(a_input, sortBuffer, runLength, sortLength))
+    {
+        return false;
+    }
+    FILE* pendingRun = 0; // sorted run in ioBuffer that still has to be written
+    bool ioSuccess = true;
+
+    while(sortLength > 0)
+    {
+        // write the previous run and read the next one while this one is sorted
+        std::thread ioThread([&]()
+        {
+            if(pendingRun != 0)
+            {
+                ioSuccess = (fwrite(ioBuffer, sizeof(T), ioLength, pendingRun) == ioLength) && ioSuccess;
+                ioSuccess = (fclose(pendingRun) == 0) && ioSuccess;
+            }
+            ioSuccess = ExternalSortReadRecords(a_input, ioBuffer, runLength, ioLength) && ioSuccess;
+        });
+
+        bool sorted = sorter.SortMT(sortBuffer, sortLength, a_jobQueue);
+        ioThread.join();
+        if(!sorted || !ioSuccess)
+        {
+            return false;
+        }
+
+        pendingRun = CreateRunFile();
+        if(pendingRun == 0)
+        {
+            return false;
+        }
+        setvbuf(pendingRun, 0, _IONBF, 0);
+
+        // the sorted run becomes the one to write, and the one just read becomes the one to sort
+        std::swap(sortBuffer, ioBuffer);
+        std::swap(sortLength, ioLength);
+    }
+
+    // write the last run
+    if(pendingRun != 0)
+    {
+        ioSuccess = (fwrite(ioBuffer, sizeof(T), ioLength, pendingRun) == ioLength) && ioSuccess;
+        ioSuccess = (fclose(pendingRun) == 0) && ioSuccess;
+    }
+    return ioSuccess;
+}
+
+
+template<class T>
+bool ExternalSort<T>::MergeRuns(const std::vector<std::string>& a_runs, FILE* a_output)
+{
+    // split the budget evenly between a read buffer for each run and the output buffer
+    size_t bufferLength = std::max<size_t>(1, m_memoryBudget / ((a_runs.size() + 1) * sizeof(T)));
+    std::unique_ptr<T[]> buffers(new (std::nothrow) T[bufferLength * (a_runs.size() + 1)]);
+    if(!buffers)
+    {
+        return false;
+    }
+    T* output = buffers.get() + bufferLength * a_runs.size();
+    size_t outputCount = 0;
+    bool success = true;
+
+    std::vector<RunReader> readers(a_runs.size());
+    std::vector<HeapItem> heap;
+    for(size_t i = 0; i < a_runs.size(); ++i)
+    {
+        readers[i].m_file = ExternalSortOpenFile(a_runs[i].c_str(), "rb");
+        readers[i].m_buffer = buffers.get() + bufferLength * i;
+        readers[i].m_bufferLength = bufferLength;
+        readers[i].m_failed = false;
+        if(readers[i].m_file == 0)
+        {
+            success = false;
+            continue;
+        }
+        setvbuf(readers[i].m_file, 0, _IONBF, 0);
+        if(readers[i].Refill())
+        {
+            HeapItem item;
+            item.m_value = readers[i].m_buffer[readers[i].m_position++];
+            item.m_run = i;
+            heap.push_back(item);
+        }
+        success = !readers[i].m_failed && success;
+    }
+    std::make_heap(heap.begin(), heap.end());
+
+    while(success && !heap.empty())
+    {
+        // output the smallest head, and replace it with the next item from the same run
+        std::pop_heap(heap.begin(), heap.end());
+        HeapItem& item = heap.back();
+        output[outputCount++] = item.m_value;
+        if(outputCount == bufferLength)
+        {
+            success = (fwrite(output, sizeof(T), outputCount, a_output) == outputCount);
+            outputCount = 0;
+        }
+
+        RunReader& reader = readers[item.m_run];
+        if(reader.m_position < reader.m_count || reader.Refill())
+        {
+            item.m_value = reader.m_buffer[reader.m_position++];
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else
+        {
+            success = !reader.m_failed;
+            heap.pop_back();
+        }
+    }
+
+    if(success && outputCount > 0)
+    {
+        success = (fwrite(output, sizeof(T), outputCount, a_output) == outputCount);
+    }
+
+    for(size_t i = 0; i < readers.size(); ++i)
+    {
+        if(readers[i].m_file != 0)
+        {
+            fclose(readers[i].m_file);
+        }
+    }
+    return success;
+}
+
+
+template<class T>
+FILE* ExternalSort<T>::CreateRunFile()
+{
+    // The process id, the random tag and the count keep names apart, but another sort sharing the temp directory
+    // could still have the name, so the file is created exclusively ("x"), and a name that exists is skipped.
+    const int maxAttempts = 100;
+    for(int attempt = 0; attempt < maxAttempts; ++attempt)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "sortrun_%lu_%016llx_%u.tmp", ExternalSortProcessId(), m_tempFileTag, m_tempFileCount++);
+        std::string path = name;
+        if(!m_tempDirectory.empty())
+        {
+            char last = m_tempDirectory[m_tempDirectory.size() - 1];
+            path = (last == '/' || last == '\\') ? m_tempDirectory + name : m_tempDirectory + "/" + name;
+        }
+
+        errno = 0;
+        FILE* file = ExternalSortOpenFile(path.c_str(), "wbx");
+        if(file != 0)
+        {
+            m_runs.push_back(path);
+            return file;
+        }
+        if(errno != EEXIST)
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+template<class T>
+void ExternalSort<T>::DeleteRuns()
+{
+    for(size_t i = 0; i < m_runs.size(); ++i)
+    {
+        remove(m_runs[i].c_str());
+    }
+    m_runs.clear();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+
+#include "JobQueue.h"
+
+
+// The number of bytes a JobClosure has for the function object it holds, such as the captures of a lambda.
+const size_t JOB_CLOSURE_SIZE = 64;
+
+
+// A job that holds a function object, such as a lambda with its captures, in a buffer of its own instead of on the
+// heap. So a job needs no context struct and no allocation: the lambda captures what the job works on, and AsJob()
+// gives the Job to submit. The JobClosure must stay where it is, and not be given a new function, until the job
+// has run. The function is destroyed with the JobClosure, or when it is given another one.
+// Function objects bigger than JOB_CLOSURE_SIZE don't compile, so capture big things by reference or pointer.
+class JobClosure
+{
+public:
+    JobClosure()
+        : m_run(0)
+        , m_destroy(0)
+    {
+    }
+
+    template<class Function>
+    explicit JobClosure(const Function& a_function)
+        : m_run(0)
+        , m_destroy(0)
+    {
+        Set(a_function);
+    }
+
+    ~JobClosure()
+    {
+        Clear();
+    }
+
+    template<class Function>
+    void Set(const Function& a_function)
+    {
+        static_assert(sizeof(Function) <= JOB_CLOSURE_SIZE, "the function object is too big for a JobClosure");
+        static_assert(std::alignment_of<Function>::value <= std::alignment_of<Storage>::value, "the function object needs more alignment than a JobClosure has");
+
+        Clear();
+        new (&m_storage) Function(a_function);
+        m_run = &Run<Function>;
+        m_destroy = &Destroy<Function>;
+    }
+
+    // Destroys the function, if there is one.
+    void Clear()
+    {
+        if(m_destroy)
+        {
+            m_destroy(&m_storage);
+            m_run = 0;
+            m_destroy = 0;
+        }
+    }
+
+    // Returns a job that calls the function.
+    inline Job AsJob()
+    {
+        Job job;
+        job.m_data = this;
+        job.m_function = m_run;
+        return job;
+    }
+
+    // Calls the function on this thread.
+    inline void operator()()
+    {
+        m_run(this);
+    }
+
+private:
+    JobClosure(const JobClosure&);
+    JobClosure& operator=(const JobClosure&);
+
+    typedef std::aligned_storage<JOB_CLOSURE_SIZE>::type Storage;
+
+    template<class Function>
+    static void Run(void* a_closure)
+    {
+        JobClosure* closure = (JobClosure*) a_closure;
+        (*reinterpret_cast<Function*>(&closure->m_storage))();
+    }
+
+    template<class Function>
+    static void Destroy(void* a_storage)
+    {
+        reinterpret_cast<Function*>(a_storage)->~Function();
+    }
+
+    Storage m_storage;
+    void (*m_run)(void*);
+    void (*m_destroy)(void*);
+};
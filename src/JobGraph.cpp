@@ -0,0 +1,177 @@
+#include "stdafx.h"
+
+#include <assert.h>
+
+#include "JobGraph.h"
+
+
+JobGraph::JobGraph()
+    : m_jobQueue(0)
+    , m_numSinks(0)
+{
+}
+
+
+size_t JobGraph::AddJob(const Job& a_job)
+{
+    m_nodes.emplace_back();
+    Node& node = m_nodes.back();
+    node.m_job = a_job;
+    node.m_graph = this;
+    node.m_numWaitingFor.store(0, std::memory_order_relaxed);
+    node.m_numDependencies = 0;
+    return m_nodes.size() - 1;
+}
+
+
+void JobGraph::AddDependency(size_t a_before, size_t a_after)
+{
+    assert(a_before < m_nodes.size() && a_after < m_nodes.size() && a_before != a_after);
+    m_nodes[a_before].m_continuations.push_back(&m_nodes[a_after]);
+    m_nodes[a_after].m_numDependencies++;
+}
+
+
+void JobGraph::Start(JobQueue& a_jobQueue)
+{
+    Prepare(a_jobQueue);
+    SubmitRoots(0);
+}
+
+
+void JobGraph::Wait()
+{
+	m_latch.Wait(m_numSinks);
+}
+
+
+void JobGraph::Run(JobQueue& a_jobQueue)
+{
+    Node* last = Prepare(a_jobQueue);
+
+    // submit all but the last of the first jobs, which this thread does itself
+    SubmitRoots(last);
+    if(last)
+    {
+        RunNode(last);
+    }
+
+    Wait();
+}
+
+
+JobGraph::Node* JobGraph::Prepare(JobQueue& a_jobQueue)
+{
+    m_jobQueue = &a_jobQueue;
+    m_latch.Reset();
+
+    // everything has to be reset before the first job can finish
+    m_numSinks = 0;
+    Node* last = 0;
+    for(size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        Node& node = m_nodes[i];
+        node.m_numWaitingFor.store(node.m_numDependencies, std::memory_order_relaxed);
+        if(node.m_continuations.empty())
+        {
+            m_numSinks++;
+        }
+        if(node.m_numDependencies == 0)
+        {
+            last = &node;
+        }
+    }
+    return last;
+}
+
+
+void JobGraph::SubmitRoots(Node* a_except)
+{
+    if(m_jobQueue->NumThreads() == 0)
+    {
+        for(size_t i = 0; i < m_nodes.size(); ++i)
+        {
+            if(m_nodes[i].m_numDependencies == 0 && &m_nodes[i] != a_except)
+            {
+                RunNode(&m_nodes[i]);
+            }
+        }
+        return;
+    }
+
+    // in one batch, so that a graph with many first jobs only takes the lock once
+    std::vector<Job> jobs;
+    for(size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        Node* node = &m_nodes[i];
+        if(node->m_numDependencies == 0 && node != a_except)
+        {
+            Job job;
+            job.m_data = node;
+            job.m_function = &NodeJob;
+            jobs.push_back(job);
+        }
+    }
+    if(!jobs.empty())
+    {
+        m_jobQueue->SubmitJobs(&jobs[0], jobs.size());
+    }
+}
+
+
+void JobGraph::NodeJob(void* a_node)
+{
+    Node* node = (Node*) a_node;
+    node->m_graph->RunNode(node);
+}
+
+
+void JobGraph::RunNode(Node* a_node)
+{
+    while(a_node)
+    {
+        a_node->m_job.m_function(a_node->m_job.m_data);
+
+        if(a_node->m_continuations.empty())
+        {
+            // Nothing of the graph may be touched after this, because Wait() can return and the graph be destroyed.
+            m_latch.Notify();
+            return;
+        }
+
+        // The acquire and release makes everything the dependencies wrote visible to whichever thread runs the continuation.
+        // Once the last count is taken down the rest of the graph can finish, so the node must not be read after that.
+        size_t numContinuations = a_node->m_continuations.size();
+        Node* const* continuations = &a_node->m_continuations[0];
+        Node* next = 0;
+        for(size_t i = 0; i < numContinuations; ++i)
+        {
+            Node* continuation = continuations[i];
+            if(continuation->m_numWaitingFor.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                if(next)
+                {
+                    SubmitNode(next);
+                }
+                next = continuation;
+            }
+        }
+        a_node = next;
+    }
+}
+
+
+void JobGraph::SubmitNode(Node* a_node)
+{
+    if(m_jobQueue->NumThreads() == 0)
+    {
+        // nobody else would ever run it
+        RunNode(a_node);
+        return;
+    }
+
+    Job job;
+    job.m_data = a_node;
+    job.m_function = &NodeJob;
+    m_jobQueue->SubmitJob(job);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+
+
+// A set of jobs where each job can depend on other jobs, and only runs once they have all finished.
+// Each job has an atomic count of the jobs it is still waiting for. The job that takes the count to zero schedules
+// it as a continuation, so no thread has to block between the stages of a pipeline, and a later stage starts as
+// soon as its own inputs are ready instead of when the whole previous stage is done. Of the continuations a job makes
+// ready, the thread that ran it keeps one for itself and submits the rest. Only the jobs that nothing depends on
+// (the sinks) are counted, so Wait() blocks once for the whole graph.
+// The graph can be started again once Wait() has returned.
+class JobGraph
+{
+public:
+    JobGraph();
+
+    // Returns the index of the job, for AddDependency(). The job doesn't need to tell anyone that it has finished.
+    size_t AddJob(const Job& a_job);
+
+    // a_after only runs once a_before has finished. Dependencies must not form a cycle.
+    void AddDependency(size_t a_before, size_t a_after);
+
+    // Submits the jobs that don't depend on anything and returns straight away.
+    void Start(JobQueue& a_jobQueue);
+
+    // Waits until all the sinks, and so all the jobs, have finished.
+    void Wait();
+
+    // Like Start() then Wait(), except this thread runs the last job that doesn't depend on anything, and whichever
+    // continuations that makes ready, instead of only waiting.
+    void Run(JobQueue& a_jobQueue);
+
+    inline size_t NumJobs() const { return m_nodes.size(); }
+
+private:
+    JobGraph(const JobGraph&);
+    JobGraph& operator=(const JobGraph&);
+
+    struct Node
+    {
+        Job m_job;
+        JobGraph* m_graph;
+        std::atomic<int> m_numWaitingFor; // dependencies that haven't finished yet in this run of the graph
+        int m_numDependencies;
+        std::vector<Node*> m_continuations;
+    };
+
+    // Resets the counts for a new run of the graph. Returns the last job that doesn't depend on anything.
+    Node* Prepare(JobQueue& a_jobQueue);
+
+    // Submits the jobs that don't depend on anything, apart from a_except.
+    void SubmitRoots(Node* a_except);
+
+    // the Job that is submitted for a node
+    static void NodeJob(void* a_node);
+
+    // Runs the node's job, then the continuations it makes ready, until none are left for this thread.
+    void RunNode(Node* a_node);
+
+    void SubmitNode(Node* a_node);
+
+    std::deque<Node> m_nodes; // a deque, because nodes can't be moved once continuations point to them
+    JobQueue* m_jobQueue;
+    CountLatch m_latch; // notified by each sink
+    int m_numSinks;
+};
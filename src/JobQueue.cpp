@@ -2,15 +2,46 @@
 
 #include "JobQueue.h"
 
+#include "WorkStealingDeque.h"
 
-JobQueue::JobQueue(int a_numThreads)
-	: m_exit(false)
+
+// The number of times an idle worker looks at every other worker for a job to steal before it goes to sleep.
+static const int STEAL_ROUNDS = 2;
+
+
+struct JobQueue::Worker
+{
+	WorkStealingDeque m_deque;
+	uint32_t m_random; // state for choosing which worker to steal from
+};
+
+
+// The queue and worker index of this thread, if it is a worker, so that jobs it submits go on its own deque.
+static thread_local JobQueue* t_workerQueue = 0;
+static thread_local size_t t_workerIndex = 0;
+
+
+JobQueue::JobQueue(int a_numThreads, Backend a_backend, size_t a_ringBufferCapacity)
+	: m_queueLength(0)
+	, m_wakeEpoch(0)
+	, m_numSleeping(0)
+	, m_exit(false)
 {
+	if (a_backend == BACKEND_RING_BUFFER)
+	{
+		m_ringBuffer.reset(new MpmcRingBuffer<Job>(a_ringBufferCapacity));
+	}
+
 	// start all the threads
+	m_workers.reset(new Worker[a_numThreads]);
 	m_threads.resize(a_numThreads);
 	for (uint32_t i = 0; i < m_threads.size(); ++i)
     {
-		m_threads[i] = std::thread(&JobQueue::WorkerFunction, this);
+		m_workers[i].m_random = i * 2654435761u + 1;
+    }
+	for (uint32_t i = 0; i < m_threads.size(); ++i)
+    {
+		m_threads[i] = std::thread(&JobQueue::WorkerFunction, this, (size_t)i);
     }
 }
 
@@ -22,7 +53,11 @@ JobQueue::~JobQueue()
 	m_exit = true;
 
 	// notify all threads that they can wake up
-	m_condition.notify_all();
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wakeEpoch++;
+		m_condition.notify_all();
+	}
 
 	// wait for all threads to exit
 	for (uint32_t i = 0; i < m_threads.size(); ++i)
@@ -34,38 +69,208 @@ JobQueue::~JobQueue()
 
 void JobQueue::SubmitJob(const Job& a_job)
 {
-	std::unique_lock<std::mutex> lock(m_mutex);
-	m_queue.push(a_job);
-	m_condition.notify_one();
+	// Back off while the ring buffer is full. A full buffer doesn't mean the workers are awake, because each submit
+	// only wakes one of them, so wake them all to make space. With no workers nothing would ever make space, so the
+	// job runs on this thread instead.
+	while (!TrySubmitJob(a_job))
+	{
+		if (m_threads.empty())
+		{
+			a_job.m_function(a_job.m_data);
+			return;
+		}
+		WakeWorkers(m_threads.size());
+		std::this_thread::yield();
+	}
 }
 
 
-int JobQueue::WorkerFunction()
+bool JobQueue::TrySubmitJob(const Job& a_job)
 {
-	// keep the lock while testing the queue and not waiting
-	std::unique_lock<std::mutex> lock(m_mutex);
+	if (t_workerQueue == this)
+	{
+		m_workers[t_workerIndex].m_deque.Push(a_job);
+	}
+	else if (m_ringBuffer)
+	{
+		if (!m_ringBuffer->TryPush(a_job))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_queue.push(a_job);
+		m_queueLength.store(m_queue.size(), std::memory_order_relaxed);
+	}
+	WakeWorkers(1);
+	return true;
+}
 
-	while (!m_exit)
+
+void JobQueue::SubmitJobs(const Job* a_jobs, size_t a_numJobs)
+{
+	if (t_workerQueue == this)
 	{
-		if (m_queue.size() > 0)
+		WorkStealingDeque& deque = m_workers[t_workerIndex].m_deque;
+		for (size_t i = 0; i < a_numJobs; ++i)
 		{
-			// pop the next job
-			Job job = m_queue.front();
-			m_queue.pop();
+			deque.Push(a_jobs[i]);
+		}
+	}
+	else if (m_ringBuffer)
+	{
+		for (size_t i = 0; i < a_numJobs; ++i)
+		{
+			// the workers have to be awake to make space, because they may not know about the jobs pushed so far
+			while (!m_ringBuffer->TryPush(a_jobs[i]))
+			{
+				if (m_threads.empty())
+				{
+					a_jobs[i].m_function(a_jobs[i].m_data);
+					break;
+				}
+				WakeWorkers(m_threads.size());
+				std::this_thread::yield();
+			}
+		}
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < a_numJobs; ++i)
+		{
+			m_queue.push(a_jobs[i]);
+		}
+		m_queueLength.store(m_queue.size(), std::memory_order_relaxed);
+	}
+	WakeWorkers(a_numJobs);
+}
 
-			// run the job without a lock on the queue
-			lock.unlock();
-			job.m_function(job.m_data);
-			lock.lock();
+
+bool JobQueue::HasQueuedJobs() const
+{
+	if (t_workerQueue == this)
+	{
+		return !m_workers[t_workerIndex].m_deque.IsEmpty();
+	}
+	if (m_ringBuffer)
+	{
+		return !m_ringBuffer->IsEmpty();
+	}
+	return m_queueLength.load(std::memory_order_relaxed) > 0;
+}
+
+
+void JobQueue::WakeWorkers(size_t a_count)
+{
+	// A worker going to sleep says so and then looks for jobs one last time, and this has added jobs and now
+	// looks for sleeping workers. The fences make sure that at least one of them sees the other.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int numSleeping = m_numSleeping.load(std::memory_order_relaxed);
+	if (numSleeping > 0 && a_count > 0)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wakeEpoch.fetch_add(1, std::memory_order_relaxed);
+		if (a_count >= (size_t)numSleeping)
+		{
+			m_condition.notify_all();
 		}
 		else
 		{
-			// Wait (releases the lock) until signalled, or spuriously woken (either is OK, because we will simply wait again if there is no work).
-			m_condition.wait(lock);
+			for (size_t i = 0; i < a_count; ++i)
+			{
+				m_condition.notify_one();
+			}
 		}
 	}
+}
 
-	return 0;
+
+bool JobQueue::FindJob(Worker& a_worker, Job& a_job)
+{
+	if (a_worker.m_deque.Pop(a_job))
+	{
+		return true;
+	}
+
+	if (m_ringBuffer)
+	{
+		if (m_ringBuffer->TryPop(a_job))
+		{
+			return true;
+		}
+	}
+	else if (m_queueLength.load(std::memory_order_relaxed) > 0)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_queue.empty())
+		{
+			a_job = m_queue.front();
+			m_queue.pop();
+			m_queueLength.store(m_queue.size(), std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	// steal from the other workers, starting at a random one
+	size_t numWorkers = m_threads.size();
+	for (int round = 0; round < STEAL_ROUNDS; ++round)
+	{
+		a_worker.m_random ^= a_worker.m_random << 13;
+		a_worker.m_random ^= a_worker.m_random >> 17;
+		a_worker.m_random ^= a_worker.m_random << 5;
+		size_t first = a_worker.m_random % numWorkers;
+		for (size_t i = 0; i < numWorkers; ++i)
+		{
+			Worker& victim = m_workers[(first + i) % numWorkers];
+			if (&victim != &a_worker && !victim.m_deque.IsEmpty() && victim.m_deque.Steal(a_job))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
 }
 
 
+int JobQueue::WorkerFunction(size_t a_index)
+{
+	t_workerQueue = this;
+	t_workerIndex = a_index;
+	Worker& worker = m_workers[a_index];
+
+	while (!m_exit)
+	{
+		uint32_t epoch = m_wakeEpoch.load(std::memory_order_relaxed);
+		Job job;
+		if (FindJob(worker, job))
+		{
+			job.m_function(job.m_data);
+			continue;
+		}
+
+		// Say we are going to sleep, and look one last time, so that a job submitted now either is found or wakes us.
+		m_numSleeping.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (FindJob(worker, job))
+		{
+			m_numSleeping.fetch_sub(1, std::memory_order_relaxed);
+			job.m_function(job.m_data);
+			continue;
+		}
+
+		{
+			// Wait (releases the lock) until signalled, or spuriously woken (either is OK, because we will simply look again).
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_wakeEpoch.load(std::memory_order_relaxed) == epoch && !m_exit)
+			{
+				m_condition.wait(lock);
+			}
+		}
+		m_numSleeping.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	return 0;
+}
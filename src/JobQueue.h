@@ -1,10 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
+
+#include "MpmcRingBuffer.h"
 
 
 struct Job
@@ -14,33 +18,69 @@ struct Job
 };
 
 
-// A simple scheduler that creates a set of worker threads.
+// A work stealing scheduler that creates a set of worker threads.
 // Jobs are submitted to a queue (can be from multiple threads).
 // The threads do the work in the queue.
+// Each worker has its own deque of jobs. Jobs submitted by a worker (from inside another job) go on the worker's
+// own deque without a lock, and it runs the newest first, while they are still in the cache. Jobs submitted by
+// other threads go on a shared injection queue. A worker that runs out of jobs takes them from the injection queue,
+// or steals the oldest job of a random other worker, before going to sleep.
+// The injection queue is either a std::queue guarded by a mutex, or a lock-free ring buffer for when many threads
+// submit small jobs. The ring buffer has a fixed capacity, and submitters wait while it is full.
 class JobQueue
 {
 public:
+    enum Backend
+    {
+        BACKEND_LOCKED, // std::queue with a mutex, which grows as needed
+        BACKEND_RING_BUFFER, // MpmcRingBuffer of a_ringBufferCapacity jobs
+    };
+
     // Creates a_numThreads worker threads.
-    JobQueue(int a_numThreads);
+    JobQueue(int a_numThreads, Backend a_backend = BACKEND_LOCKED, size_t a_ringBufferCapacity = 4096);
 
     // Tells worker threads to exit once they have finished the current job
     ~JobQueue();
 
-    // Multiple threads may call this
+    // Multiple threads may call this. With the ring buffer backend this waits while the ring buffer is full, or runs
+    // the job on this thread if there are no workers to make space.
     void SubmitJob(const Job& a_job);
 
+    // Submits a_numJobs jobs at once: with the locked backend they are all added under one lock, and then as many
+    // sleeping workers are woken as there are jobs, rather than taking the lock and waking a worker for each job.
+    // With the ring buffer backend this waits for space in the same way as SubmitJob().
+    void SubmitJobs(const Job* a_jobs, size_t a_numJobs);
+
+    // The same as SubmitJob() but returns false instead of waiting if the ring buffer is full, so the caller can
+    // do something else in the meantime. Always succeeds with the locked backend or from a worker thread.
+    bool TrySubmitJob(const Job& a_job);
+
+    // Returns true if jobs submitted by this thread are still waiting to be taken: from its own deque if it is a
+    // worker, or else from the injection queue. Other threads may take them at the same time.
+    bool HasQueuedJobs() const;
+
     inline size_t NumThreads() const { return m_threads.size(); }
 
 private:
 
-	int WorkerFunction();
+	struct Worker;
 
-	std::mutex m_mutex;
-	std::condition_variable m_condition;
-	std::queue<Job> m_queue;
-	std::vector<std::thread> m_threads;
-	volatile bool m_exit;
-};
+	int WorkerFunction(size_t a_index);
 
+	// Takes a job from the worker's own deque, the injection queue or another worker, in that order.
+	bool FindJob(Worker& a_worker, Job& a_job);
 
+	// Wakes up to a_count sleeping workers, if there are any, after jobs were submitted.
+	void WakeWorkers(size_t a_count);
 
+	std::unique_ptr<Worker[]> m_workers;
+	std::mutex m_mutex; // guards the injection queue, and is held by workers going to sleep
+	std::condition_variable m_condition;
+	std::queue<Job> m_queue; // the injection queue, for jobs submitted by threads that aren't workers
+	std::atomic<size_t> m_queueLength; // so workers can see the injection queue is empty without taking the lock
+	std::unique_ptr<MpmcRingBuffer<Job>> m_ringBuffer; // the injection queue instead of m_queue, if there is one
+	std::atomic<uint32_t> m_wakeEpoch; // changed whenever a sleeping worker should wake up
+	std::atomic<int> m_numSleeping;
+	std::vector<std::thread> m_threads;
+	std::atomic<bool> m_exit;
+};
@@ -0,0 +1,101 @@
+#include "stdafx.h"
+
+#include "JobQueueBenchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "JobQueue.h"
+#include "Timer.h"
+
+
+static const int MAX_PRODUCERS = 64;
+
+// number of jobs a producer submits with each SubmitJobs() call, for the batched rows
+static const size_t JOB_BATCH_SIZE = 256;
+
+
+static void CountJob(void* a_context)
+{
+    std::atomic<size_t>* count = (std::atomic<size_t>*) a_context;
+    count->fetch_add(1, std::memory_order_relaxed);
+}
+
+
+// Returns the seconds it takes a_numProducers threads to submit a_jobsPerProducer jobs each, and the workers to run them.
+// The jobs are submitted a_batchSize at a time with SubmitJobs(), or one at a time with SubmitJob() if a_batchSize is 1.
+static float TimeProducers(JobQueue::Backend a_backend, int a_numThreads, int a_numProducers, size_t a_jobsPerProducer, size_t a_batchSize)
+{
+    JobQueue jobQueue(a_numThreads, a_backend);
+    std::atomic<size_t> count(0);
+    std::atomic<bool> start(false);
+
+    std::vector<std::thread> producers;
+    for(int i = 0; i < a_numProducers; ++i)
+    {
+        producers.push_back(std::thread([&]()
+        {
+            while(!start.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            Job job;
+            job.m_data = &count;
+            job.m_function = &CountJob;
+            if(a_batchSize == 1)
+            {
+                for(size_t j = 0; j < a_jobsPerProducer; ++j)
+                {
+                    jobQueue.SubmitJob(job);
+                }
+                return;
+            }
+
+            std::vector<Job> batch(a_batchSize, job);
+            for(size_t j = 0; j < a_jobsPerProducer; j += a_batchSize)
+            {
+                jobQueue.SubmitJobs(&batch[0], std::min(a_batchSize, a_jobsPerProducer - j));
+            }
+        }));
+    }
+
+    Timer timer;
+    timer.Reset();
+    start.store(true, std::memory_order_release);
+    for(size_t i = 0; i < producers.size(); ++i)
+    {
+        producers[i].join();
+    }
+    size_t total = a_numProducers * a_jobsPerProducer;
+    while(count.load(std::memory_order_relaxed) < total)
+    {
+        std::this_thread::yield();
+    }
+    return timer.Time();
+}
+
+
+void RunJobQueueBenchmarks(int a_numThreads, size_t a_jobsPerProducer)
+{
+    const char* const backendNames[] = { "locked", "ring buffer" };
+    const JobQueue::Backend backends[] = { JobQueue::BACKEND_LOCKED, JobQueue::BACKEND_RING_BUFFER };
+    const size_t batchSizes[] = { 1, JOB_BATCH_SIZE };
+
+    printf("JobQueue benchmarks (%d worker threads, %llu jobs per producer)\n", a_numThreads, (unsigned long long)a_jobsPerProducer);
+    printf("%-12s %9s %6s %12s %14s\n", "backend", "producers", "batch", "time ms", "M jobs/s");
+    for(int producers = 1; producers <= MAX_PRODUCERS; producers <<= 1)
+    {
+        for(int backend = 0; backend < 2; ++backend)
+        {
+            for(int batch = 0; batch < 2; ++batch)
+            {
+                size_t batchSize = batchSizes[batch];
+                float seconds = TimeProducers(backends[backend], a_numThreads, producers, a_jobsPerProducer, batchSize);
+                double jobsPerSecond = (seconds > 0.0f) ? (double)(producers * a_jobsPerProducer) / seconds : 0.0;
+                printf("%-12s %9d %6d %12.3f %14.2f\n", backendNames[backend], producers, (int)batchSize, 1000.0f * seconds, jobsPerSecond / 1000000.0);
+            }
+        }
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+
+
+// Times many threads submitting small jobs to a JobQueue, with each backend of the injection queue, for 1 to 64
+// producer threads. Each producer submits a_jobsPerProducer jobs that do almost nothing, so the time is the cost of
+// submitting and running them. The producers submit the jobs one at a time, and then in batches with SubmitJobs().
+// a_numThreads is the number of worker threads. Prints a row per backend, number of producers and batch size with the
+// total time and jobs per second.
+void RunJobQueueBenchmarks(int a_numThreads, size_t a_jobsPerProducer);
@@ -0,0 +1,497 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string.h>
+#include <type_traits>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+#include "MergeSort.h"
+#include "MultiwayMerge.h"
+
+
+// Runs of this many keys are sorted with an insertion sort before merging starts.
+const int KEY_VALUE_INSERTION_LENGTH = 16;
+
+
+// Sorts a short run of keys with an insertion sort, moving each value along with its key. Equal keys keep their order.
+template<class K, class V, class LESS>
+inline void KeyValueInsertionSort(K* a_keys, V* a_values, size_t a_length, const LESS& a_less)
+{
+    for(size_t i = 1; i < a_length; ++i)
+    {
+        K key = a_keys[i];
+        V value = a_values[i];
+        size_t j = i;
+        while(j > 0 && a_less(key, a_keys[j - 1]))
+        {
+            a_keys[j] = a_keys[j - 1];
+            a_values[j] = a_values[j - 1];
+            --j;
+        }
+        a_keys[j] = key;
+        a_values[j] = value;
+    }
+}
+
+
+// Merges the sorted ranges [a_left, a_endLeft) and [a_right, a_endRight) of a_keys into a_destinationKeys, moving
+// the value at the same offset of a_values along with each key. Either range may be empty. Equal keys are taken
+// from the left range first. Only the keys are compared, and the side to take from is picked without a branch.
+template<class K, class V, class LESS>
+inline void KeyValueMergeRanges(const K* a_keys, const V* a_values, size_t a_left, size_t a_endLeft, size_t a_right, size_t a_endRight, K* a_destinationKeys, V* a_destinationValues, const LESS& a_less)
+{
+    while(a_left < a_endLeft && a_right < a_endRight)
+    {
+        bool takeRight = a_less(a_keys[a_right], a_keys[a_left]);
+        size_t from = takeRight ? a_right : a_left;
+        *a_destinationKeys++ = a_keys[from];
+        *a_destinationValues++ = a_values[from];
+        a_right += takeRight;
+        a_left += !takeRight;
+    }
+
+    // copy whatever is left of either range
+    memcpy(a_destinationKeys, a_keys + a_left, sizeof(K) * (a_endLeft - a_left));
+    memcpy(a_destinationValues, a_values + a_left, sizeof(V) * (a_endLeft - a_left));
+    a_destinationKeys += a_endLeft - a_left;
+    a_destinationValues += a_endLeft - a_left;
+    memcpy(a_destinationKeys, a_keys + a_right, sizeof(K) * (a_endRight - a_right));
+    memcpy(a_destinationValues, a_values + a_right, sizeof(V) * (a_endRight - a_right));
+}
+
+
+// Returns the number of merge passes that KeyValueSortPasses() makes over a_length items.
+inline int KeyValueNumPasses(size_t a_length)
+{
+    int numPasses = 0;
+    for(size_t width = KEY_VALUE_INSERTION_LENGTH; width < a_length; width <<= 1)
+    {
+        numPasses++;
+    }
+    return numPasses;
+}
+
+
+// Sorts a_keys with a bottom-up merge sort, moving a_values along with them, using scratch arrays of the same length.
+// Each pass moves the items to the other pair of arrays. The sorted items end up in the scratch arrays if
+// a_toScratch is true, and otherwise in a_keys and a_values. When the passes would leave them in the other arrays,
+// each short run is copied across just before it is insertion sorted, while it is in the cache, rather than copying
+// everything at the end.
+template<class K, class V, class LESS>
+inline void KeyValueSortPasses(K* a_keys, V* a_values, K* a_scratchKeys, V* a_scratchValues, size_t a_length, bool a_toScratch, const LESS& a_less)
+{
+    // These pointers are swapped for each pass to avoid copying.
+    bool copyFirst = ((KeyValueNumPasses(a_length) & 1) == 1) != a_toScratch;
+    K* keys1 = copyFirst ? a_scratchKeys : a_keys;
+    V* values1 = copyFirst ? a_scratchValues : a_values;
+    K* keys2 = copyFirst ? a_keys : a_scratchKeys;
+    V* values2 = copyFirst ? a_values : a_scratchValues;
+
+    for(size_t i = 0; i < a_length; i += KEY_VALUE_INSERTION_LENGTH)
+    {
+        size_t length = std::min<size_t>(KEY_VALUE_INSERTION_LENGTH, a_length - i);
+        if(copyFirst)
+        {
+            memcpy(keys1 + i, a_keys + i, sizeof(K) * length);
+            memcpy(values1 + i, a_values + i, sizeof(V) * length);
+        }
+        KeyValueInsertionSort(keys1 + i, values1 + i, length, a_less);
+    }
+
+    for(size_t width = KEY_VALUE_INSERTION_LENGTH; width < a_length; width <<= 1)
+    {
+        for(size_t i = 0; i < a_length; i += (width << 1))
+        {
+            size_t right = std::min(i + width, a_length);
+            size_t end = std::min(i + (width << 1), a_length);
+            KeyValueMergeRanges(keys1, values1, i, right, right, end, keys2 + i, values2 + i, a_less);
+        }
+        std::swap(keys1, keys2);
+        std::swap(values1, values2);
+    }
+}
+
+
+// The part of a key/value sort that one thread sorts into the scratch arrays before the parts are merged.
+template<class K, class V, class LESS>
+struct KeyValueSortContext
+{
+    K* m_keys;
+    V* m_values;
+    K* m_scratchKeys; // the same part of the scratch arrays
+    V* m_scratchValues;
+    size_t m_length;
+    const LESS* m_less;
+	CountLatch* m_latch;
+};
+
+
+// One segment of a merge of all the sorted parts at once, as MultiwayMergeContext is for MergeSort. Only the keys
+// are searched and compared, and each value is moved along with its key.
+template<class K, class V, class LESS>
+struct KeyValueMultiwayMergeContext
+{
+    const K* m_sourceKeys; // source arrays holding all the runs
+    const V* m_sourceValues;
+    K* m_destinationKeys;
+    V* m_destinationValues;
+    const size_t* m_runStart; // offsets to the runs, followed by the offset to the end of the last run
+    int m_numRuns;
+    size_t m_segmentStart; // offset of the first item this segment writes to the dest arrays
+    size_t* m_splitStart; // number of items of each run that come before this segment
+    size_t* m_splitEnd; // number of items of each run that come before the end of this segment
+    const K** m_current; // m_numRuns pointers to the next key of each run that the merge moves on
+    const K** m_end; // m_numRuns pointers to the end of each run's part of the segment
+    const LESS* m_less;
+	CountLatch* m_latch;
+};
+
+
+template<class K, class V, class LESS>
+void KeyValueSortJob(void* a_context)
+{
+    KeyValueSortContext<K, V, LESS>* context = (KeyValueSortContext<K, V, LESS>*) a_context;
+
+    KeyValueSortPasses(context->m_keys, context->m_values, context->m_scratchKeys, context->m_scratchValues, context->m_length, true, *context->m_less);
+
+	context->m_latch->Notify();
+}
+
+
+template<class K, class V, class LESS>
+void KeyValueMultiwaySplitJob(void* a_context)
+{
+    KeyValueMultiwayMergeContext<K, V, LESS>* context = (KeyValueMultiwayMergeContext<K, V, LESS>*) a_context;
+
+    // find where this segment's part of each run starts
+    MultiwaySplit(context->m_sourceKeys, context->m_runStart, context->m_numRuns, context->m_segmentStart, context->m_splitStart, *context->m_less);
+
+	context->m_latch->Notify();
+}
+
+
+// Merges the parts of the runs that belong in one segment of the dest arrays, reading and writing each key and
+// value once. Equal keys are taken from the lower run first.
+template<class K, class V, class LESS>
+void KeyValueMultiwayMergeJob(void* a_context)
+{
+    KeyValueMultiwayMergeContext<K, V, LESS>* context = (KeyValueMultiwayMergeContext<K, V, LESS>*) a_context;
+    const K* keys = context->m_sourceKeys;
+    const V* values = context->m_sourceValues;
+    K* destinationKeys = context->m_destinationKeys + context->m_segmentStart;
+    V* destinationValues = context->m_destinationValues + context->m_segmentStart;
+    int numRuns = context->m_numRuns;
+
+    if(numRuns == 2)
+    {
+        const size_t* runStart = context->m_runStart;
+        KeyValueMergeRanges(keys, values, runStart[0] + context->m_splitStart[0], runStart[0] + context->m_splitEnd[0],
+            runStart[1] + context->m_splitStart[1], runStart[1] + context->m_splitEnd[1], destinationKeys, destinationValues, *context->m_less);
+    }
+    else
+    {
+        for(int i = 0; i < numRuns; ++i)
+        {
+            context->m_current[i] = keys + context->m_runStart[i] + context->m_splitStart[i];
+            context->m_end[i] = keys + context->m_runStart[i] + context->m_splitEnd[i];
+        }
+        LoserTree<const K, LESS> tree(context->m_current, context->m_end, numRuns, *context->m_less);
+        while(!tree.IsEmpty())
+        {
+            const K*& current = context->m_current[tree.Winner()];
+            *destinationKeys++ = *current;
+            *destinationValues++ = values[current - keys];
+            ++current;
+            tree.Replay();
+        }
+    }
+
+	context->m_latch->Notify();
+}
+
+
+// Sorts keys that are kept in a separate array from their values (structure of arrays), so a sort by a small key
+// doesn't have to move whole records through every merge pass. Only the keys are compared, and each value is moved
+// along with its key. The values can be the records themselves if they are small, or indices of the records.
+// The sort is stable. LESS compares two keys, and is a template parameter so the comparisons are inlined.
+// Keys and values are copied with memcpy. Owns its scratch arrays in the same way as MergeSort.
+template<class K, class V, class LESS = std::less<K>>
+class KeyValueSort
+{
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "keys and values are copied with memcpy");
+
+public:
+    // Automatically allocate scratch arrays as needed
+    KeyValueSort(const LESS& a_less = LESS());
+
+    // Pre-allocate scratch arrays for the given number of keys and values, and then auto allocate more if needed.
+    KeyValueSort(size_t a_scratchLength, const LESS& a_less = LESS());
+
+    ~KeyValueSort();
+
+    // Sorts a_keys and moves a_values along with them. Both arrays contain a_length items.
+    // Returns false if the scratch arrays could not be allocated.
+    bool Sort(K* a_keys, V* a_values, size_t a_length);
+
+    // The same as Sort() but is multithreaded. Each thread sorts part of the arrays into the scratch arrays, and then
+    // all the parts are merged back in a single pass, as in MergeSort::SortMT(), with each thread writing its own
+    // segment of the keys and values.
+    bool SortMT(K* a_keys, V* a_values, size_t a_length, JobQueue& a_jobQueue);
+
+private:
+    KeyValueSort(const KeyValueSort&);
+    KeyValueSort& operator=(const KeyValueSort&);
+
+    // Returns false if large enough arrays cannot be allocated.
+    bool EnsureBufferIsLargeEnough(size_t a_length);
+
+    void FreeScratch();
+
+    K* m_scratchKeys;
+    V* m_scratchValues;
+    size_t m_scratchLength; // number of keys and values that the scratch arrays can contain
+    LESS m_less;
+};
+
+
+template<class K, class V, class LESS>
+KeyValueSort<K, V, LESS>::KeyValueSort(const LESS& a_less)
+    : m_scratchKeys(0)
+    , m_scratchValues(0)
+    , m_scratchLength(0)
+    , m_less(a_less)
+{
+}
+
+
+template<class K, class V, class LESS>
+KeyValueSort<K, V, LESS>::KeyValueSort(size_t a_scratchLength, const LESS& a_less)
+    : m_scratchKeys(0)
+    , m_scratchValues(0)
+    , m_scratchLength(0)
+    , m_less(a_less)
+{
+    EnsureBufferIsLargeEnough(a_scratchLength);
+}
+
+
+template<class K, class V, class LESS>
+KeyValueSort<K, V, LESS>::~KeyValueSort()
+{
+    FreeScratch();
+}
+
+
+template<class K, class V, class LESS>
+bool KeyValueSort<K, V, LESS>::Sort(K* a_keys, V* a_values, size_t a_length)
+{
+    // skip the trivial case
+    if(a_length < 2)
+    {
+        return true;
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    KeyValueSortPasses(a_keys, a_values, m_scratchKeys, m_scratchValues, a_length, false, m_less);
+    return true;
+}
+
+
+template<class K, class V, class LESS>
+bool KeyValueSort<K, V, LESS>::SortMT(K* a_keys, V* a_values, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use a single thread for small sorts, or when there are no other threads
+    const size_t minItemsPerThread = 4096;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread || a_jobQueue.NumThreads() == 0)
+    {
+        return Sort(a_keys, a_values, a_length);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    // First divide the arrays into a part for each thread and sort the parts into the scratch arrays.
+    // runStart[i] is the offset of sorted part i, and runStart[numRuns] is the end of the data.
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<KeyValueSortContext<K, V, LESS>[]> sortContext(new KeyValueSortContext<K, V, LESS>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads + 1]);
+
+	CountLatch latch;
+
+    // Dispatch work to threads
+    size_t itemsDispatched = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+
+        KeyValueSortContext<K, V, LESS>& context = sortContext[i];
+        context.m_keys = a_keys + itemsDispatched;
+        context.m_values = a_values + itemsDispatched;
+        context.m_scratchKeys = m_scratchKeys + itemsDispatched;
+        context.m_scratchValues = m_scratchValues + itemsDispatched;
+        context.m_length = itemsForThread;
+        context.m_less = &m_less;
+		context.m_latch = &latch;
+        runStart[i] = itemsDispatched;
+        itemsDispatched += itemsForThread;
+
+        if(i < a_jobQueue.NumThreads())
+        {
+            Job job;
+            job.m_data = &context;
+            job.m_function = &KeyValueSortJob<K, V, LESS>;
+            a_jobQueue.SubmitJob(job);
+        }
+        else
+        {
+            KeyValueSortJob<K, V, LESS>(&context);
+        }
+    }
+    runStart[totalNumThreads] = a_length;
+
+    // wait for all sorting to be done
+	latch.Wait(totalNumThreads);
+
+    // Merge all the parts back into the input arrays in one pass. Each thread writes its own segment, and first
+    // searches the keys of the parts to find which of them belong in its segment.
+	latch.Reset();
+    std::unique_ptr<KeyValueMultiwayMergeContext<K, V, LESS>[]> mergeContext(new KeyValueMultiwayMergeContext<K, V, LESS>[totalNumThreads]);
+    std::unique_ptr<size_t[]> splits(new size_t[(totalNumThreads + 1) * totalNumThreads]);
+    std::unique_ptr<const K*[]> rangePointers(new const K*[2 * totalNumThreads * totalNumThreads]); // m_current and m_end of every segment
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        KeyValueMultiwayMergeContext<K, V, LESS>& context = mergeContext[i];
+        context.m_sourceKeys = m_scratchKeys;
+        context.m_sourceValues = m_scratchValues;
+        context.m_destinationKeys = a_keys;
+        context.m_destinationValues = a_values;
+        context.m_runStart = runStart.get();
+        context.m_numRuns = (int)totalNumThreads;
+        context.m_segmentStart = runStart[i];
+        context.m_splitStart = splits.get() + i * totalNumThreads;
+        context.m_splitEnd = splits.get() + (i + 1) * totalNumThreads;
+        context.m_current = rangePointers.get() + 2 * i * totalNumThreads;
+        context.m_end = context.m_current + totalNumThreads;
+        context.m_less = &m_less;
+		context.m_latch = &latch;
+    }
+
+    // the end of the last segment comes after everything
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        splits[totalNumThreads * totalNumThreads + i] = runStart[i + 1] - runStart[i];
+    }
+
+    // Submit all but the last segment, which this thread does itself, in one batch. The merge only reads the scratch
+    // arrays, but every split has to be found before the segments it ends are merged, so the searches finish first.
+    std::unique_ptr<Job[]> jobs(new Job[totalNumThreads]);
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+    {
+        jobs[i].m_data = &mergeContext[i];
+        jobs[i].m_function = &KeyValueMultiwaySplitJob<K, V, LESS>;
+    }
+    a_jobQueue.SubmitJobs(jobs.get(), totalNumThreads - 1);
+    KeyValueMultiwaySplitJob<K, V, LESS>(&mergeContext[totalNumThreads - 1]);
+	latch.Wait(totalNumThreads);
+
+	latch.Reset();
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+    {
+        jobs[i].m_function = &KeyValueMultiwayMergeJob<K, V, LESS>;
+    }
+    a_jobQueue.SubmitJobs(jobs.get(), totalNumThreads - 1);
+    KeyValueMultiwayMergeJob<K, V, LESS>(&mergeContext[totalNumThreads - 1]);
+
+    // wait for all merging to be done
+	latch.Wait(totalNumThreads);
+
+    return true;
+}
+
+
+template<class K, class V, class LESS>
+bool KeyValueSort<K, V, LESS>::EnsureBufferIsLargeEnough(size_t a_length)
+{
+    if(m_scratchLength < a_length)
+    {
+        FreeScratch();
+        K* keys = (K*)AllocateSortBuffer(sizeof(K) * a_length);
+        V* values = (V*)AllocateSortBuffer(sizeof(V) * a_length);
+        if(keys == 0 || values == 0)
+        {
+            // FreeSortBuffer() needs the size each one was allocated with, which isn't m_scratchLength
+            if(keys != 0)
+            {
+                FreeSortBuffer(keys, sizeof(K) * a_length);
+            }
+            if(values != 0)
+            {
+                FreeSortBuffer(values, sizeof(V) * a_length);
+            }
+            return false;
+        }
+        m_scratchKeys = keys;
+        m_scratchValues = values;
+        m_scratchLength = a_length;
+    }
+    return true;
+}
+
+
+template<class K, class V, class LESS>
+void KeyValueSort<K, V, LESS>::FreeScratch()
+{
+    if(m_scratchKeys != 0)
+    {
+        FreeSortBuffer(m_scratchKeys, sizeof(K) * m_scratchLength);
+    }
+    if(m_scratchValues != 0)
+    {
+        FreeSortBuffer(m_scratchValues, sizeof(V) * m_scratchLength);
+    }
+    m_scratchKeys = 0;
+    m_scratchValues = 0;
+    m_scratchLength = 0;
+}
+
+
+// Fills a_indices with the order of a_records sorted by the key a_projection(record), which is compared with
+// operator<. Records with equal keys keep their order. The keys are taken from the records once, and after that only
+// the keys and the indices move, however wide the records are. a_projection is a template parameter so it is inlined.
+// Returns false if memory could not be allocated, or if INDEX can't hold every index of a_records.
+template<class R, class INDEX, class PROJECTION>
+inline bool Argsort(const R* a_records, size_t a_length, INDEX* a_indices, PROJECTION a_projection, JobQueue& a_jobQueue)
+{
+    typedef typename std::decay<decltype(a_projection(*a_records))>::type Key;
+
+    static_assert(std::is_integral<INDEX>::value, "the indices must be integers");
+    if(a_length > 0 && (unsigned long long)(a_length - 1) > (unsigned long long)(std::numeric_limits<INDEX>::max)())
+    {
+        return false;
+    }
+
+    std::unique_ptr<Key[]> keys(new (std::nothrow) Key[a_length]);
+    if(!keys)
+    {
+        return false;
+    }
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        keys[i] = a_projection(a_records[i]);
+        a_indices[i] = (INDEX)i;
+    }
+
+    KeyValueSort<Key, INDEX> sorter;
+    return sorter.SortMT(keys.get(), a_indices, a_length, a_jobQueue);
+}
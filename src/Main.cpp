@@ -3,28 +3,48 @@
 
 #include "stdafx.h"
 
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <limits.h>
+#include <limits>
 #include <memory>
 #include <stdlib.h>
 #include <stack>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifdef _DEBUG
 #include <vld.h>
 #endif
 
 #include "BinarySearchTree.h"
+#include "CountLatch.h"
 #include "ComputePrimes.h"
+#include "ExternalSort.h"
+#include "KeyValueSort.h"
 #include "MergeSort.h"
+#include "ParallelFor.h"
+#include "RadixSort.h"
+#include "SortBenchmark.h"
+#include "SortedLevels.h"
+#include "StringSort.h"
 #include "Timer.h"
+#include "JobClosure.h"
+#include "JobGraph.h"
 #include "JobQueue.h"
+#include "JobQueueBenchmark.h"
+#include "WorkStealingDeque.h"
 #include "GetMostCommonLetter.h"
 #include "ReverseWords.h"
 #include "Cache.h"
 #include "ConvertBase.h"
 
 // function to verify the contents of an array are sorted in ascending order
-bool VerifyOrder(int* a_testData, int a_dataLength)
+bool VerifyOrder(int* a_testData, size_t a_dataLength)
 {
-    for(int i = 0; i < a_dataLength - 1; ++i)
+    for(size_t i = 0; i + 1 < a_dataLength; ++i)
     {
         if(a_testData[i] > a_testData[i + 1])
         {
@@ -36,10 +56,252 @@ bool VerifyOrder(int* a_testData, int a_dataLength)
 }
 
 
+// Counts the items that have the same bits as a_value, so that -0.0 and +0.0 are told apart.
+template<class T>
+size_t CountBitsEqual(const T* a_items, size_t a_length, T a_value)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        count += (memcmp(&a_items[i], &a_value, sizeof(T)) == 0);
+    }
+    return count;
+}
+
+
+// Merges 8 copies of a_left with 8 copies of a_right, and then the other way round, and checks that the result
+// still has 8 of each. Returns false if the merge turned any key into the other.
+template<class T>
+bool MergeKeepsKeys(T a_left, T a_right)
+{
+    for(int order = 0; order < 2; ++order)
+    {
+        T left[8];
+        T right[8];
+        T merged[16];
+        std::fill(left, left + 8, order ? a_right : a_left);
+        std::fill(right, right + 8, order ? a_left : a_right);
+        MergeRanges(left, left + 8, right, right + 8, merged);
+        if(CountBitsEqual(merged, 16, a_left) != 8 || CountBitsEqual(merged, 16, a_right) != 8)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Sorts a mix of -0.0, +0.0 and other keys in blocks of the sorting network, and checks that it still has as many
+// of each zero.
+template<class T>
+bool SortKeepsSignedZeros()
+{
+    const size_t length = 1000;
+    std::vector<T> items(length);
+    for(size_t i = 0; i < length; ++i)
+    {
+        int kind = rand() % 3;
+        items[i] = kind == 0 ? (T)-0.0 : kind == 1 ? (T)0.0 : (T)(rand() % 100 - 50);
+    }
+    size_t negativeZeros = CountBitsEqual(&items[0], length, (T)-0.0);
+    size_t positiveZeros = CountBitsEqual(&items[0], length, (T)0.0);
+
+    MergeSort<T> sorter;
+    sorter.SortUnrolledMemcpy(&items[0], length);
+    return std::is_sorted(items.begin(), items.end()) && CountBitsEqual(&items[0], length, (T)-0.0) == negativeZeros &&
+        CountBitsEqual(&items[0], length, (T)0.0) == positiveZeros;
+}
+
+
+// The same as VerifyOrder(), but the pairs of neighbours are shared out between the threads of a_jobQueue.
+bool VerifyOrderMT(int* a_testData, size_t a_dataLength, JobQueue& a_jobQueue)
+{
+    return ParallelReduce(0, a_dataLength > 0 ? a_dataLength - 1 : 0, true,
+        [a_testData](size_t a_begin, size_t a_end, bool a_sorted)
+        {
+            for(size_t i = a_begin; i < a_end && a_sorted; ++i)
+            {
+                a_sorted = a_testData[i] <= a_testData[i + 1];
+            }
+            return a_sorted;
+        },
+        [](bool a_left, bool a_right) { return a_left && a_right; },
+        a_jobQueue);
+}
+
+
+// Number of times each byte value occurs, for a histogram made with ParallelReduce().
+struct ByteCounts
+{
+    uint32_t m_counts[256];
+};
+
+
+// A wide record that is sorted by a small key, for testing sorts that only move the keys.
+struct WideRecord
+{
+    int m_key;
+    char m_payload[60];
+
+    bool operator<(const WideRecord& a_other) const { return m_key < a_other.m_key; }
+};
+
+
+// Orders keys by their low byte from high to low, so that many keys compare equal, for a KeyValueSort test.
+struct DescendingLowByte
+{
+    inline bool operator()(int a_left, int a_right) const { return (a_left & 0xff) > (a_right & 0xff); }
+};
+
+
+// A tree of jobs where each job submits its two children, for timing many small jobs that are submitted by the
+// worker threads themselves. Node i has children 2i + 1 and 2i + 2, and only the leaves notify the latch.
+struct ForkJobNode;
+
+struct ForkJobTree
+{
+    JobQueue* m_jobQueue;
+    CountLatch* m_latch;
+    std::unique_ptr<ForkJobNode[]> m_nodes;
+    int m_numNodes;
+};
+
+struct ForkJobNode
+{
+    ForkJobTree* m_tree;
+    int m_index;
+};
+
+void ForkJob(void* a_context)
+{
+    ForkJobNode* node = (ForkJobNode*) a_context;
+    ForkJobTree* tree = node->m_tree;
+    int child = 2 * node->m_index + 1;
+    if(child >= tree->m_numNodes)
+    {
+		tree->m_latch->Notify();
+        return;
+    }
+    for(int i = child; i < child + 2 && i < tree->m_numNodes; ++i)
+    {
+        Job job;
+        job.m_data = &tree->m_nodes[i];
+        job.m_function = &ForkJob;
+        tree->m_jobQueue->SubmitJob(job);
+    }
+}
+
+
+
+
+// The reverse of ForkJobTree: a JobGraph where each job adds up the sums of its two children once they are both done.
+// Node i has children 2i + 1 and 2i + 2, and a leaf's sum is its own index.
+// Jobs for the test of the ring buffer backend, which count themselves, and can be held back until a gate opens so
+// that the ring buffer fills up.
+struct RingJobContext
+{
+    std::atomic<int> m_numRun;
+    std::atomic<int> m_numAtGate;
+    std::atomic<bool> m_gateOpen;
+    CountLatch* m_latch;
+};
+
+void RingCountJob(void* a_context)
+{
+    RingJobContext* context = (RingJobContext*) a_context;
+    context->m_numRun.fetch_add(1);
+	context->m_latch->Notify();
+}
+
+void RingGateJob(void* a_context)
+{
+    RingJobContext* context = (RingJobContext*) a_context;
+    context->m_numAtGate.fetch_add(1);
+    while(!context->m_gateOpen.load())
+    {
+        std::this_thread::yield();
+    }
+    RingCountJob(a_context);
+}
+
+
+struct JoinJobNode
+{
+    JoinJobNode* m_children[2];
+    int64_t m_sum;
+    int m_index;
+};
+
+void JoinJob(void* a_context)
+{
+    JoinJobNode* node = (JoinJobNode*) a_context;
+    if(!node->m_children[0])
+    {
+        node->m_sum = node->m_index;
+        return;
+    }
+    node->m_sum = node->m_children[0]->m_sum + (node->m_children[1] ? node->m_children[1]->m_sum : 0);
+}
+
+
+// Reads a count from the command line into a_value. Returns false unless the whole of a_text is a decimal number from
+// 1 to a_max. _tcstoull() on its own would take a sign and wrap negative numbers around to huge ones.
+bool ParseCount(const _TCHAR* a_text, unsigned long long a_max, unsigned long long& a_value)
+{
+    if(a_text[0] < _T('0') || a_text[0] > _T('9'))
+    {
+        return false;
+    }
+    _TCHAR* end = 0;
+    errno = 0;
+    a_value = _tcstoull(a_text, &end, 10);
+    return errno == 0 && *end == 0 && a_value > 0 && a_value <= a_max;
+}
 
 
 int _tmain(int argc, _TCHAR* argv[]) {
 
+    // "benchmark [max items] [repeats]" runs the sort benchmark suite instead of the tests
+    if(argc > 1 && _tcscmp(argv[1], _T("benchmark")) == 0)
+    {
+        SortBenchmarkOptions options;
+        unsigned long long value;
+        if(argc > 2)
+        {
+            if(!ParseCount(argv[2], SIZE_MAX, value))
+            {
+                printf("benchmark: the max items must be a number from 1 to %llu\n", (unsigned long long)SIZE_MAX);
+                return 1;
+            }
+            options.m_maxLength = (size_t)value;
+        }
+        if(argc > 3)
+        {
+            if(!ParseCount(argv[3], INT_MAX, value))
+            {
+                printf("benchmark: the repeats must be a number from 1 to %d\n", INT_MAX);
+                return 1;
+            }
+            options.m_repeats = (int)value;
+        }
+        RunSortBenchmarks(options);
+        return 0;
+    }
+
+    // "jobbenchmark [jobs per producer]" runs the JobQueue submission benchmarks instead of the tests
+    if(argc > 1 && _tcscmp(argv[1], _T("jobbenchmark")) == 0)
+    {
+        unsigned long long numJobs = 100000;
+        if(argc > 2 && !ParseCount(argv[2], SIZE_MAX, numJobs))
+        {
+            printf("jobbenchmark: the jobs per producer must be a number from 1 to %llu\n", (unsigned long long)SIZE_MAX);
+            return 1;
+        }
+        int numThreads = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+        RunJobQueueBenchmarks(numThreads, (size_t)numJobs);
+        return 0;
+    }
+
     Timer timer;
     float ms;
 	printf("Starting tests...\n");
@@ -169,6 +431,336 @@ int _tmain(int argc, _TCHAR* argv[]) {
         printf("Computed %d primes Fast in %f ms\n", maxPrimes, ms);
     }
 
+    // JOB SCHEDULER
+    {
+        // Test WorkStealingDeque on its own: the owner pops the newest job, a thief steals the oldest, and the array
+        // grows past its starting capacity without losing any
+        WorkStealingDeque deque(4);
+        const int NUM_DEQUE_JOBS = 100;
+        int jobData[NUM_DEQUE_JOBS];
+        Job job;
+        job.m_function = 0;
+        for(int i = 0; i < NUM_DEQUE_JOBS; ++i)
+        {
+            job.m_data = &jobData[i];
+            deque.Push(job);
+        }
+        bool success = deque.Steal(job) && job.m_data == &jobData[0];
+        for(int i = NUM_DEQUE_JOBS - 1; i > 0 && success; --i)
+        {
+            success = deque.Pop(job) && job.m_data == &jobData[i];
+        }
+        success = success && !deque.Pop(job) && !deque.Steal(job) && deque.IsEmpty();
+        printf("WorkStealingDeque %s\n", (success ? "success" : "FAIL"));
+
+        // The owner pushes a job and pops it straight back, while a thief steals all the time, so they race for the
+        // last job in the deque. Each job must be taken by exactly one of them.
+        const int NUM_DEQUE_RACES = 100000;
+        std::unique_ptr<std::atomic<int>[]> timesTaken(new std::atomic<int>[NUM_DEQUE_RACES]);
+        for(int i = 0; i < NUM_DEQUE_RACES; ++i)
+        {
+            timesTaken[i].store(0);
+        }
+        std::atomic<bool> ownerDone(false);
+        std::thread thief([&deque, &ownerDone]()
+        {
+            Job stolen;
+            while(!ownerDone.load())
+            {
+                if(deque.Steal(stolen))
+                {
+                    ((std::atomic<int>*)stolen.m_data)->fetch_add(1);
+                }
+            }
+        });
+        for(int i = 0; i < NUM_DEQUE_RACES; ++i)
+        {
+            job.m_data = &timesTaken[i];
+            deque.Push(job);
+            if(deque.Pop(job))
+            {
+                ((std::atomic<int>*)job.m_data)->fetch_add(1);
+            }
+        }
+        ownerDone.store(true);
+        thief.join();
+        success = deque.IsEmpty();
+        for(int i = 0; i < NUM_DEQUE_RACES && success; ++i)
+        {
+            success = timesTaken[i].load() == 1;
+        }
+        printf("WorkStealingDeque (steals racing the last job) %s\n", (success ? "success" : "FAIL"));
+    }
+    {
+        // Test the ring buffer backend. The workers are held at a gate while this thread fills the ring buffer, which
+        // TrySubmitJob() then refuses. After the gate opens, SubmitJob() and SubmitJobs() have to wait for space.
+        const int RING_CAPACITY = 16;
+        const int NUM_RING_WORKERS = 3;
+        const int NUM_RING_JOBS = 10000;
+		CountLatch latch;
+        RingJobContext context;
+        context.m_numRun.store(0);
+        context.m_numAtGate.store(0);
+        context.m_gateOpen.store(false);
+        context.m_latch = &latch;
+
+        JobQueue ringQueue(NUM_RING_WORKERS, JobQueue::BACKEND_RING_BUFFER, RING_CAPACITY);
+        Job job;
+        job.m_data = &context;
+        job.m_function = &RingGateJob;
+        for(int i = 0; i < NUM_RING_WORKERS; ++i)
+        {
+            ringQueue.SubmitJob(job);
+        }
+        while(context.m_numAtGate.load() < NUM_RING_WORKERS)
+        {
+            std::this_thread::yield();
+        }
+
+        job.m_function = &RingCountJob;
+        int numAccepted = 0;
+        while(numAccepted <= RING_CAPACITY && ringQueue.TrySubmitJob(job))
+        {
+            ++numAccepted;
+        }
+        bool success = numAccepted == RING_CAPACITY;
+
+        context.m_gateOpen.store(true);
+        for(int i = 0; i < NUM_RING_JOBS; ++i)
+        {
+            ringQueue.SubmitJob(job);
+        }
+        std::vector<Job> jobs(NUM_RING_JOBS, job);
+        ringQueue.SubmitJobs(jobs.data(), jobs.size());
+        int numJobs = NUM_RING_WORKERS + numAccepted + 2 * NUM_RING_JOBS;
+		latch.Wait(numJobs);
+        success = success && context.m_numRun.load() == numJobs;
+        printf("JobQueue (ring buffer) %s\n", (success ? "success" : "FAIL"));
+
+        // With no workers nothing empties a full ring buffer, so the jobs that don't fit run on this thread
+        // instead of SubmitJob() and SubmitJobs() waiting forever.
+        context.m_numRun.store(0);
+        JobQueue noWorkers(0, JobQueue::BACKEND_RING_BUFFER, RING_CAPACITY);
+        for(int i = 0; i < 2 * RING_CAPACITY; ++i)
+        {
+            noWorkers.SubmitJob(job);
+        }
+        noWorkers.SubmitJobs(jobs.data(), RING_CAPACITY);
+        success = context.m_numRun.load() == 2 * RING_CAPACITY;
+        printf("JobQueue (ring buffer, no worker threads) %s\n", (success ? "success" : "FAIL"));
+    }
+    {
+        // Time a binary tree of 2^21 - 1 small jobs that are all submitted by other jobs, so they go on the workers'
+        // own deques. The latch counts the 2^20 leaves.
+        const size_t NUM_THREADS_FOR_JOBS = 8;
+		JobQueue jobScheduler(NUM_THREADS_FOR_JOBS - 1);
+		CountLatch latch;
+        ForkJobTree tree;
+        tree.m_jobQueue = &jobScheduler;
+        tree.m_latch = &latch;
+        tree.m_numNodes = (1 << 21) - 1;
+        tree.m_nodes.reset(new ForkJobNode[tree.m_numNodes]);
+        for(int i = 0; i < tree.m_numNodes; ++i)
+        {
+            tree.m_nodes[i].m_tree = &tree;
+            tree.m_nodes[i].m_index = i;
+        }
+
+        timer.Reset();
+        Job job;
+        job.m_data = &tree.m_nodes[0];
+        job.m_function = &ForkJob;
+        jobScheduler.SubmitJob(job);
+		latch.Wait(1 << 20);
+        ms = 1000.0f * timer.Time();
+        printf("JobQueue (%d jobs) time (%d threads) %f ms\n", tree.m_numNodes, (int)NUM_THREADS_FOR_JOBS, ms);
+    }
+
+    // JOB GRAPH
+    {
+        // Every job of the tree depends on its children, so it is scheduled by whichever child finishes last.
+        const size_t NUM_THREADS_FOR_JOBS = 8;
+		JobQueue jobScheduler(NUM_THREADS_FOR_JOBS - 1);
+        const int numNodes = (1 << 17) - 1;
+        std::unique_ptr<JoinJobNode[]> nodes(new JoinJobNode[numNodes]);
+        JobGraph graph;
+        for(int i = 0; i < numNodes; ++i)
+        {
+            Job job;
+            job.m_data = &nodes[i];
+            job.m_function = &JoinJob;
+            graph.AddJob(job);
+        }
+        int64_t expectedSum = 0;
+        for(int i = 0; i < numNodes; ++i)
+        {
+            nodes[i].m_index = i;
+            nodes[i].m_sum = -1;
+            for(int j = 0; j < 2; ++j)
+            {
+                int child = 2 * i + 1 + j;
+                nodes[i].m_children[j] = child < numNodes ? &nodes[child] : 0;
+                if(child < numNodes)
+                {
+                    graph.AddDependency(child, i);
+                }
+            }
+            if(!nodes[i].m_children[0])
+            {
+                expectedSum += i;
+            }
+        }
+
+        timer.Reset();
+        graph.Run(jobScheduler);
+        ms = 1000.0f * timer.Time();
+        printf("JobGraph (%d jobs) time (%d threads) %f ms\n", numNodes, (int)NUM_THREADS_FOR_JOBS, ms);
+        printf("JobGraph %s\n", (nodes[0].m_sum == expectedSum ? "success" : "FAIL"));
+    }
+
+    // JOB CLOSURES
+    {
+        // A fan out of jobs that are lambdas, each adding up its own slice of an array, all submitted in one batch.
+        const size_t NUM_THREADS_FOR_JOBS = 8;
+		JobQueue jobScheduler(NUM_THREADS_FOR_JOBS - 1);
+		CountLatch latch;
+        const size_t numJobs = 4096;
+        const size_t itemsPerJob = 1024;
+        std::unique_ptr<uint32_t[]> items(new uint32_t[numJobs * itemsPerJob]);
+        std::unique_ptr<uint64_t[]> sums(new uint64_t[numJobs]);
+        uint64_t expectedSum = 0;
+        for(size_t i = 0; i < numJobs * itemsPerJob; ++i)
+        {
+            items[i] = (uint32_t)rand();
+            expectedSum += items[i];
+        }
+
+        timer.Reset();
+        std::unique_ptr<JobClosure[]> closures(new JobClosure[numJobs]);
+        std::unique_ptr<Job[]> jobs(new Job[numJobs]);
+        uint32_t* slices = items.get();
+        uint64_t* sumData = sums.get();
+        CountLatch* jobLatch = &latch;
+        for(size_t i = 0; i < numJobs; ++i)
+        {
+            closures[i].Set([slices, sumData, jobLatch, i, itemsPerJob]()
+            {
+                uint64_t sum = 0;
+                for(size_t j = i * itemsPerJob; j < (i + 1) * itemsPerJob; ++j)
+                {
+                    sum += slices[j];
+                }
+                sumData[i] = sum;
+				jobLatch->Notify();
+            });
+            jobs[i] = closures[i].AsJob();
+        }
+        jobScheduler.SubmitJobs(jobs.get(), numJobs);
+		latch.Wait((int)numJobs);
+        ms = 1000.0f * timer.Time();
+        printf("JobClosure (%d jobs in one batch) time (%d threads) %f ms\n", (int)numJobs, (int)NUM_THREADS_FOR_JOBS, ms);
+
+        uint64_t sum = 0;
+        for(size_t i = 0; i < numJobs; ++i)
+        {
+            sum += sums[i];
+        }
+        printf("JobClosure %s\n", (sum == expectedSum ? "success" : "FAIL"));
+    }
+
+    // PARALLEL LOOPS
+    {
+        const size_t NUM_THREADS_FOR_LOOPS = 8;
+		JobQueue jobScheduler(NUM_THREADS_FOR_LOOPS - 1);
+
+        // Sieve of Eratosthenes: each part of the range crosses off the multiples of the primes up to the square root
+        // that fall within it, and then the primes left are counted.
+        const size_t sieveLength = 10000000;
+        const size_t sieveRoot = 3163; // the smallest number whose square is at least sieveLength
+        std::unique_ptr<uint8_t[]> composite(new uint8_t[sieveLength]);
+        memset(composite.get(), 0, sieveLength);
+        std::vector<size_t> rootPrimes;
+        for(size_t i = 2; i < sieveRoot; ++i)
+        {
+            if(!composite[i])
+            {
+                rootPrimes.push_back(i);
+                for(size_t j = i * i; j < sieveRoot; j += i)
+                {
+                    composite[j] = 1;
+                }
+            }
+        }
+
+        timer.Reset();
+        uint8_t* compositeData = composite.get();
+        ParallelFor(sieveRoot, sieveLength,
+            [compositeData, &rootPrimes](size_t a_begin, size_t a_end)
+            {
+                for(size_t i = 0; i < rootPrimes.size(); ++i)
+                {
+                    size_t prime = rootPrimes[i];
+                    for(size_t j = std::max(prime * prime, (a_begin + prime - 1) / prime * prime); j < a_end; j += prime)
+                    {
+                        compositeData[j] = 1;
+                    }
+                }
+            },
+            jobScheduler, 65536);
+        size_t numPrimes = ParallelReduce((size_t)2, sieveLength, (size_t)0,
+            [compositeData](size_t a_begin, size_t a_end, size_t a_count)
+            {
+                for(size_t i = a_begin; i < a_end; ++i)
+                {
+                    a_count += !compositeData[i];
+                }
+                return a_count;
+            },
+            [](size_t a_left, size_t a_right) { return a_left + a_right; },
+            jobScheduler);
+        ms = 1000.0f * timer.Time();
+        printf("ParallelFor sieve (%d numbers) time (%d threads) %f ms\n", (int)sieveLength, (int)NUM_THREADS_FOR_LOOPS, ms);
+        printf("ParallelFor sieve %s\n", (numPrimes == 664579 ? "success" : "FAIL"));
+
+        // histogram of random bytes, where each piece counts into its own ByteCounts and they are added up at the end
+        const size_t histogramLength = 16 << 20;
+        std::unique_ptr<uint8_t[]> bytes(new uint8_t[histogramLength]);
+        ByteCounts expected;
+        memset(&expected, 0, sizeof(expected));
+        for(size_t i = 0; i < histogramLength; ++i)
+        {
+            bytes[i] = (uint8_t)rand();
+            expected.m_counts[bytes[i]]++;
+        }
+
+        ByteCounts empty;
+        memset(&empty, 0, sizeof(empty));
+        uint8_t* byteData = bytes.get();
+        timer.Reset();
+        ByteCounts counts = ParallelReduce((size_t)0, histogramLength, empty,
+            [byteData](size_t a_begin, size_t a_end, ByteCounts a_counts)
+            {
+                for(size_t i = a_begin; i < a_end; ++i)
+                {
+                    a_counts.m_counts[byteData[i]]++;
+                }
+                return a_counts;
+            },
+            [](const ByteCounts& a_left, const ByteCounts& a_right)
+            {
+                ByteCounts sum;
+                for(int i = 0; i < 256; ++i)
+                {
+                    sum.m_counts[i] = a_left.m_counts[i] + a_right.m_counts[i];
+                }
+                return sum;
+            },
+            jobScheduler);
+        ms = 1000.0f * timer.Time();
+        printf("ParallelReduce histogram (%d bytes) time (%d threads) %f ms\n", (int)histogramLength, (int)NUM_THREADS_FOR_LOOPS, ms);
+        printf("ParallelReduce histogram %s\n", (memcmp(&counts, &expected, sizeof(counts)) == 0 ? "success" : "FAIL"));
+    }
+
     // SORTING
     {
         // Prepare data to sort. We use the same input data for each sort test.
@@ -195,8 +787,267 @@ int _tmain(int argc, _TCHAR* argv[]) {
             mergeSorter.SortMT(testData.get(), dataLength, jobScheduler);
             ms = 1000.0f * timer.Time();
             printf("SortMT time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
-            bool success = VerifyOrder(testData.get(), dataLength);
+            bool success = VerifyOrderMT(testData.get(), dataLength, jobScheduler);
             printf("SortMT %s\n", (success ? "success" : "FAIL"));
+
+            // Test MergeSort::SortSampleMT on the same data with the same threads
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            mergeSorter.SortSampleMT(testData.get(), dataLength, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortSampleMT time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("SortSampleMT %s\n", (success ? "success" : "FAIL"));
+
+            // with no worker threads nothing would take the bucket jobs, so it has to sort on this thread
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            {
+                JobQueue noWorkers(0);
+                mergeSorter.SortSampleMT(testData.get(), dataLength, noWorkers);
+            }
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("SortSampleMT (no worker threads) %s\n", (success ? "success" : "FAIL"));
+
+            // keep the sorted data to check the partial sorts against
+            std::unique_ptr<int[]> sortedData(new int[dataLength]);
+            memcpy(sortedData.get(), testData.get(), sizeof(int) * dataLength);
+
+            // Test RadixSort::SortMT on the same data with the same threads
+            RadixSort<int> radixSorter(dataLength);
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            radixSorter.SortMT(testData.get(), dataLength, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("RadixSort::SortMT time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("RadixSort::SortMT %s\n", (success ? "success" : "FAIL"));
+
+            // Test MergeSort::SortMTAsync by sorting batches as they arrive. Receiving a batch (a memcpy here) overlaps
+            // with sorting the previous ones, and each batch in flight has its own sorter and buffer.
+            {
+                const int NUM_BATCHES = 16;
+                const int PIPELINE_DEPTH = 3;
+                const size_t batchLength = dataLength / NUM_BATCHES;
+                std::unique_ptr<int[]> batches(new int[batchLength * PIPELINE_DEPTH]);
+                std::unique_ptr<MergeSort<int>[]> batchSorters(new MergeSort<int>[PIPELINE_DEPTH]);
+                std::unique_ptr<SortFuture<int>[]> batchFutures(new SortFuture<int>[PIPELINE_DEPTH]);
+
+                // for comparison, sort each batch with SortMT before receiving the next one
+                timer.Reset();
+                for(int i = 0; i < NUM_BATCHES; ++i)
+                {
+                    memcpy(batches.get(), originalData.get() + i * batchLength, sizeof(int) * batchLength);
+                    batchSorters[0].SortMT(batches.get(), batchLength, jobScheduler);
+                }
+                ms = 1000.0f * timer.Time();
+                printf("SortMT (%d batches) time (%d threads) %f ms\n", NUM_BATCHES, (int)NUM_THREADS_FOR_SORTING, ms);
+
+                success = true;
+                timer.Reset();
+                for(int i = 0; i < NUM_BATCHES + PIPELINE_DEPTH; ++i)
+                {
+                    // wait for the batch that was sorted in this slot, then receive the next batch into it
+                    int slot = i % PIPELINE_DEPTH;
+                    int* batch = batches.get() + slot * batchLength;
+                    batchFutures[slot].Wait();
+                    if(i >= PIPELINE_DEPTH)
+                    {
+                        success = success && VerifyOrder(batch, batchLength);
+                    }
+                    if(i < NUM_BATCHES)
+                    {
+                        memcpy(batch, originalData.get() + i * batchLength, sizeof(int) * batchLength);
+                        success = success && batchSorters[slot].SortMTAsync(batch, batchLength, jobScheduler, batchFutures[slot]);
+                    }
+                }
+                ms = 1000.0f * timer.Time();
+                printf("SortMTAsync (%d batches) time (%d threads) %f ms\n", NUM_BATCHES, (int)NUM_THREADS_FOR_SORTING, ms);
+                printf("SortMTAsync %s\n", (success ? "success" : "FAIL"));
+
+                // A sorter waits for its async sort before it grows its scratch buffer for a bigger sort, and before
+                // it is destroyed, since the async sort's jobs are still writing to the buffer until it finishes.
+                SortFuture<int> firstFuture;
+                SortFuture<int> secondFuture;
+                memcpy(batches.get(), originalData.get(), sizeof(int) * batchLength);
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                {
+                    MergeSort<int> asyncSorter;
+                    success = asyncSorter.SortMTAsync(batches.get(), batchLength, jobScheduler, firstFuture);
+                    success = success && asyncSorter.SortMTAsync(testData.get(), dataLength, jobScheduler, secondFuture);
+                }
+                firstFuture.Wait();
+                secondFuture.Wait();
+                success = success && VerifyOrder(batches.get(), batchLength) && VerifyOrder(testData.get(), dataLength);
+                printf("SortMTAsync (sorter reused and destroyed while sorting) %s\n", (success ? "success" : "FAIL"));
+            }
+
+            // Test MergeSort::SortSegments and SortSegmentsMT on many short arrays of 10 to 5000 items
+            {
+                std::vector<size_t> segmentStart(1, 0);
+                while(segmentStart.back() < (size_t)dataLength)
+                {
+                    size_t length = 10 + rand() % 4991;
+                    segmentStart.push_back(std::min(segmentStart.back() + length, (size_t)dataLength));
+                }
+                size_t numSegments = segmentStart.size() - 1;
+
+                // for comparison, sort each segment with a separate call
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                for(size_t i = 0; i < numSegments; ++i)
+                {
+                    mergeSorter.SortUnrolledMemcpy(testData.get() + segmentStart[i], segmentStart[i + 1] - segmentStart[i]);
+                }
+                ms = 1000.0f * timer.Time();
+                printf("SortUnrolledMemcpy (%d segments) time %f ms\n", (int)numSegments, ms);
+
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                mergeSorter.SortSegments(testData.get(), segmentStart.data(), numSegments);
+                ms = 1000.0f * timer.Time();
+                printf("SortSegments (%d segments) time %f ms\n", (int)numSegments, ms);
+                success = true;
+                for(size_t i = 0; i < numSegments; ++i)
+                {
+                    success = success && VerifyOrder(testData.get() + segmentStart[i], segmentStart[i + 1] - segmentStart[i]);
+                }
+                printf("SortSegments %s\n", (success ? "success" : "FAIL"));
+
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                mergeSorter.SortSegmentsMT(testData.get(), segmentStart.data(), numSegments, jobScheduler);
+                ms = 1000.0f * timer.Time();
+                printf("SortSegmentsMT (%d segments) time (%d threads) %f ms\n", (int)numSegments, (int)NUM_THREADS_FOR_SORTING, ms);
+                success = true;
+                for(size_t i = 0; i < numSegments; ++i)
+                {
+                    success = success && VerifyOrder(testData.get() + segmentStart[i], segmentStart[i + 1] - segmentStart[i]);
+                }
+                printf("SortSegmentsMT %s\n", (success ? "success" : "FAIL"));
+
+                // with no worker threads the groups of segments would never run, so it has to sort them on this thread
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                JobQueue noWorkers(0);
+                mergeSorter.SortSegmentsMT(testData.get(), segmentStart.data(), numSegments, noWorkers);
+                success = true;
+                for(size_t i = 0; i < numSegments; ++i)
+                {
+                    success = success && VerifyOrder(testData.get() + segmentStart[i], segmentStart[i + 1] - segmentStart[i]);
+                }
+                printf("SortSegmentsMT (no worker threads) %s\n", (success ? "success" : "FAIL"));
+            }
+
+            // Test MergeSort::TopKMT, NthElementMT and PartialSortMT, which only sort part of the data
+            {
+                const int k = 1000;
+                std::unique_ptr<int[]> topK(new int[k]);
+                timer.Reset();
+                mergeSorter.TopKMT(originalData.get(), dataLength, k, topK.get(), jobScheduler);
+                ms = 1000.0f * timer.Time();
+                printf("TopKMT (k = %d) time (%d threads) %f ms\n", k, (int)NUM_THREADS_FOR_SORTING, ms);
+                success = memcmp(topK.get(), sortedData.get(), sizeof(int) * k) == 0;
+                printf("TopKMT %s\n", (success ? "success" : "FAIL"));
+
+                const int nth = dataLength / 2;
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                mergeSorter.NthElementMT(testData.get(), dataLength, nth, jobScheduler);
+                ms = 1000.0f * timer.Time();
+                printf("NthElementMT (median) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+                success = testData[nth] == sortedData[nth];
+                for(int i = 0; i < dataLength; ++i)
+                {
+                    success = success && (i < nth ? testData[i] <= testData[nth] : testData[i] >= testData[nth]);
+                }
+                printf("NthElementMT %s\n", (success ? "success" : "FAIL"));
+
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                mergeSorter.PartialSortMT(testData.get(), dataLength, k, jobScheduler);
+                ms = 1000.0f * timer.Time();
+                printf("PartialSortMT (k = %d) time (%d threads) %f ms\n", k, (int)NUM_THREADS_FOR_SORTING, ms);
+                success = memcmp(testData.get(), sortedData.get(), sizeof(int) * k) == 0;
+                printf("PartialSortMT %s\n", (success ? "success" : "FAIL"));
+            }
+
+            // Test MergeSort::SortUniqueMT, which removes repeats and counts them as it sorts
+            {
+                std::unique_ptr<size_t[]> counts(new size_t[dataLength]);
+                size_t uniqueLength = 0;
+                memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+                timer.Reset();
+                mergeSorter.SortUniqueMT(testData.get(), dataLength, jobScheduler, uniqueLength, counts.get());
+                ms = 1000.0f * timer.Time();
+                printf("SortUniqueMT (%d unique) time (%d threads) %f ms\n", (int)uniqueLength, (int)NUM_THREADS_FOR_SORTING, ms);
+
+                // walk through the sorted data one group of equal items at a time
+                success = true;
+                size_t position = 0;
+                for(size_t i = 0; i < uniqueLength && success; ++i)
+                {
+                    success = position + counts[i] <= (size_t)dataLength && testData[i] == sortedData[position]
+                        && sortedData[position + counts[i] - 1] == testData[i];
+                    position += counts[i];
+                    success = success && (position == (size_t)dataLength || sortedData[position] != testData[i]);
+                }
+                success = success && position == (size_t)dataLength;
+                printf("SortUniqueMT %s\n", (success ? "success" : "FAIL"));
+            }
+
+            // Test RadixSort::Sort
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            radixSorter.Sort(testData.get(), dataLength);
+            ms = 1000.0f * timer.Time();
+            printf("RadixSort::Sort time %f ms\n", ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("RadixSort::Sort %s\n", (success ? "success" : "FAIL"));
+
+            // Test ExternalSort with a memory budget of a quarter of the data, so it has to merge several runs from disk.
+            FILE* file = ExternalSortOpenFile("ExternalSortInput.tmp", "wb");
+            success = (file != 0) && (fwrite(originalData.get(), sizeof(int), dataLength, file) == (size_t)dataLength);
+            success = (file != 0) && (fclose(file) == 0) && success;
+            ExternalSort<int> externalSorter(sizeof(int) * dataLength / 4, "");
+            timer.Reset();
+            success = success && externalSorter.Sort("ExternalSortInput.tmp", "ExternalSortOutput.tmp", jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("ExternalSort time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            auto outputIsSorted = [&](const char* a_path)
+            {
+                FILE* output = ExternalSortOpenFile(a_path, "rb");
+                bool sorted = (output != 0) && (fread(testData.get(), sizeof(int), dataLength, output) == (size_t)dataLength);
+                if(output != 0)
+                {
+                    sorted = sorted && fgetc(output) == EOF;
+                    fclose(output);
+                }
+                return sorted && VerifyOrder(testData.get(), dataLength);
+            };
+            success = success && outputIsSorted("ExternalSortOutput.tmp");
+            printf("ExternalSort %s\n", (success ? "success" : "FAIL"));
+
+            // two sorts at once with the same temp directory, each with its own run files
+            ExternalSort<int> otherSorter(sizeof(int) * dataLength / 4, "");
+            bool otherSuccess = false;
+            std::thread otherSort([&otherSorter, &otherSuccess]()
+            {
+                JobQueue otherQueue(1);
+                otherSuccess = otherSorter.Sort("ExternalSortInput.tmp", "ExternalSortOther.tmp", otherQueue);
+            });
+            success = externalSorter.Sort("ExternalSortInput.tmp", "ExternalSortOutput.tmp", jobScheduler);
+            otherSort.join();
+            success = success && otherSuccess && outputIsSorted("ExternalSortOutput.tmp") && outputIsSorted("ExternalSortOther.tmp");
+            printf("ExternalSort (two sorts sharing the temp directory) %s\n", (success ? "success" : "FAIL"));
+            remove("ExternalSortOther.tmp");
+
+            // a file that ends part of the way through a record has to fail rather than lose the partial record
+            file = ExternalSortOpenFile("ExternalSortInput.tmp", "ab");
+            success = (file != 0) && (fwrite("x", 1, 1, file) == 1);
+            success = (file != 0) && (fclose(file) == 0) && success;
+            success = success && !externalSorter.Sort("ExternalSortInput.tmp", "ExternalSortOutput.tmp", jobScheduler);
+            printf("ExternalSort (partial record) %s\n", (success ? "success" : "FAIL"));
+            remove("ExternalSortInput.tmp");
+            remove("ExternalSortOutput.tmp");
         }
 
         // Test MergeSort::SortUnrolledMemcpy
@@ -225,6 +1076,290 @@ int _tmain(int argc, _TCHAR* argv[]) {
         printf("SortSimple time %f ms\n", ms);
 		success = VerifyOrder(testData.get(), dataLength);
         printf("SortSimple %s\n", (success ? "success" : "FAIL"));
+
+        // Test that the vectorized merges of floats and doubles move keys that compare equal, or NaNs, rather than
+        // making copies of one of them
+        success = MergeKeepsKeys(-0.0f, 0.0f) && MergeKeepsKeys(0.0f, std::numeric_limits<float>::quiet_NaN()) &&
+            MergeKeepsKeys(-0.0, 0.0) && MergeKeepsKeys(0.0, std::numeric_limits<double>::quiet_NaN());
+        printf("MergeRanges (signed zeros and NaNs) %s\n", (success ? "success" : "FAIL"));
+        success = SortKeepsSignedZeros<float>() && SortKeepsSignedZeros<double>();
+        printf("SortUnrolledMemcpy (signed zeros) %s\n", (success ? "success" : "FAIL"));
+
+        // Test MergeSort::SortAdaptive
+		memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+        timer.Reset();
+		mergeSorter.SortAdaptive(testData.get(), dataLength);
+        ms = 1000.0f * timer.Time();
+        printf("SortAdaptive time %f ms\n", ms);
+		success = VerifyOrder(testData.get(), dataLength);
+        printf("SortAdaptive %s\n", (success ? "success" : "FAIL"));
+
+        // Test MergeSort::SortLowMemory and SortLowMemoryMT with a new sorter, so they only get a small scratch buffer
+        {
+            MergeSort<int> lowMemorySorter;
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            lowMemorySorter.SortLowMemory(testData.get(), dataLength);
+            ms = 1000.0f * timer.Time();
+            printf("SortLowMemory time %f ms\n", ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("SortLowMemory %s\n", (success ? "success" : "FAIL"));
+
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+            MergeSort<int> lowMemorySorterMT;
+            memcpy(testData.get(), originalData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            lowMemorySorterMT.SortLowMemoryMT(testData.get(), dataLength, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortLowMemoryMT time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("SortLowMemoryMT %s\n", (success ? "success" : "FAIL"));
+        }
+
+        // Test MergeSort::SortAdaptive and SortAdaptiveMT on nearly sorted data: sorted with 1 in 1000 items changed.
+        std::unique_ptr<int[]> nearlySortedData(new int[dataLength]);
+        memcpy(nearlySortedData.get(), testData.get(), sizeof(int) * dataLength);
+        for(int i = 0; i < dataLength / 1000; ++i)
+        {
+            nearlySortedData[((unsigned int)rand() * 32768u + (unsigned int)rand()) % dataLength] = rand();
+        }
+
+		memcpy(testData.get(), nearlySortedData.get(), sizeof(int) * dataLength);
+        timer.Reset();
+		mergeSorter.SortAdaptive(testData.get(), dataLength);
+        ms = 1000.0f * timer.Time();
+        printf("SortAdaptive (nearly sorted) time %f ms\n", ms);
+		success = VerifyOrder(testData.get(), dataLength);
+        printf("SortAdaptive (nearly sorted) %s\n", (success ? "success" : "FAIL"));
+
+        {
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+
+            memcpy(testData.get(), nearlySortedData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            mergeSorter.SortAdaptiveMT(testData.get(), dataLength, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortAdaptiveMT (nearly sorted) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = VerifyOrder(testData.get(), dataLength);
+            printf("SortAdaptiveMT (nearly sorted) %s\n", (success ? "success" : "FAIL"));
+
+            memcpy(testData.get(), nearlySortedData.get(), sizeof(int) * dataLength);
+            timer.Reset();
+            mergeSorter.SortMT(testData.get(), dataLength, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortMT (nearly sorted) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+        }
+
+        // Test MergeSort::SortMT on strings, which are moved rather than copied with memcpy
+        {
+            const int stringCount = 200001;
+            std::unique_ptr<std::string[]> strings(new std::string[stringCount]);
+            for(int i = 0; i < stringCount; ++i)
+            {
+                char text[32];
+                sprintf(text, "item %d %d", rand(), rand());
+                strings[i] = text;
+            }
+
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+            MergeSort<std::string> stringSorter;
+
+            // Test StringSort::SortMT on pointers to a copy of the same strings, which only looks at the characters
+            // it needs to
+            std::unique_ptr<std::string[]> stringCopies(new std::string[stringCount]);
+            std::unique_ptr<const char*[]> stringPointers(new const char*[stringCount]);
+            for(int i = 0; i < stringCount; ++i)
+            {
+                stringCopies[i] = strings[i];
+                stringPointers[i] = stringCopies[i].c_str();
+            }
+            StringSort radixStringSorter;
+            timer.Reset();
+            success = radixStringSorter.SortMT(stringPointers.get(), stringCount, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("StringSort::SortMT time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            for(int i = 0; success && i < stringCount - 1; ++i)
+            {
+                success = strcmp(stringPointers[i], stringPointers[i + 1]) <= 0;
+            }
+            printf("StringSort::SortMT %s\n", (success ? "success" : "FAIL"));
+
+            // with no worker threads nothing would take the bucket jobs, so it has to sort on this thread
+            for(int i = 0; i < stringCount; ++i)
+            {
+                stringPointers[i] = stringCopies[i].c_str();
+            }
+            {
+                JobQueue noWorkers(0);
+                success = radixStringSorter.SortMT(stringPointers.get(), stringCount, noWorkers);
+            }
+            for(int i = 0; success && i < stringCount - 1; ++i)
+            {
+                success = strcmp(stringPointers[i], stringPointers[i + 1]) <= 0;
+            }
+            printf("StringSort::SortMT (no worker threads) %s\n", (success ? "success" : "FAIL"));
+
+            timer.Reset();
+            stringSorter.SortMT(strings.get(), stringCount, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortMT (strings) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = true;
+            for(int i = 0; i < stringCount - 1; ++i)
+            {
+                if(strings[i + 1] < strings[i])
+                {
+                    success = false;
+                    break;
+                }
+            }
+            printf("SortMT (strings) %s\n", (success ? "success" : "FAIL"));
+
+            // The strings of a new scratch buffer are constructed by the threads that sort into it, so give each sort
+            // that splits the buffer between threads a new sorter. SortUniqueMT() leaves no two strings the same.
+            const char* sortNames[] = { "SortMT", "SortMTAsync", "SortUniqueMT", "SortAdaptiveMT", "SortLowMemoryMT" };
+            for(int sort = 0; sort < 5; ++sort)
+            {
+                for(int i = 0; i < stringCount; ++i)
+                {
+                    strings[i] = stringCopies[i];
+                }
+                size_t sortedLength = stringCount;
+                {
+                    MergeSort<std::string> newSorter;
+                    SortFuture<std::string> future;
+                    switch(sort)
+                    {
+                    case 0: success = newSorter.SortMT(strings.get(), stringCount, jobScheduler); break;
+                    case 1: success = newSorter.SortMTAsync(strings.get(), stringCount, jobScheduler, future); future.Wait(); break;
+                    case 2: success = newSorter.SortUniqueMT(strings.get(), stringCount, jobScheduler, sortedLength); break;
+                    case 3: success = newSorter.SortAdaptiveMT(strings.get(), stringCount, jobScheduler); break;
+                    default: success = newSorter.SortLowMemoryMT(strings.get(), stringCount, jobScheduler); break;
+                    }
+                }
+                for(size_t i = 0; success && i + 1 < sortedLength; ++i)
+                {
+                    success = (sort == 2) ? strings[i] < strings[i + 1] : !(strings[i + 1] < strings[i]);
+                }
+                printf("%s (strings, new scratch buffer) %s\n", sortNames[sort], (success ? "success" : "FAIL"));
+            }
+        }
+
+        // Test KeyValueSort directly with a comparator of its own, that sorts the keys by their low byte from high to low
+        {
+            const int pairCount = 1000001;
+            std::unique_ptr<int[]> keys(new int[pairCount]);
+            std::unique_ptr<int[]> values(new int[pairCount]);
+            for(int i = 0; i < pairCount; ++i)
+            {
+                keys[i] = rand();
+                values[i] = i;
+            }
+            std::unique_ptr<int[]> originalKeys(new int[pairCount]);
+            memcpy(originalKeys.get(), keys.get(), sizeof(int) * pairCount);
+
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+            KeyValueSort<int, int, DescendingLowByte> pairSorter;
+
+            timer.Reset();
+            pairSorter.SortMT(keys.get(), values.get(), pairCount, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("KeyValueSort::SortMT (custom comparator) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+
+            // each value must still be with its key, and keys that compare equal must keep their order
+            DescendingLowByte less;
+            success = keys[pairCount - 1] == originalKeys[values[pairCount - 1]];
+            for(int i = 0; i < pairCount - 1 && success; ++i)
+            {
+                success = keys[i] == originalKeys[values[i]] && !less(keys[i + 1], keys[i]) &&
+                    (less(keys[i], keys[i + 1]) || values[i] < values[i + 1]);
+            }
+            printf("KeyValueSort (custom comparator) %s\n", (success ? "success" : "FAIL"));
+        }
+
+        // Test Argsort on wide records, which only moves the keys and indices, against sorting the records themselves
+        {
+            const int recordCount = 1000001;
+            std::unique_ptr<WideRecord[]> records(new WideRecord[recordCount]);
+            for(int i = 0; i < recordCount; ++i)
+            {
+                records[i].m_key = rand();
+                memset(records[i].m_payload, i & 0xff, sizeof(records[i].m_payload));
+            }
+
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+            std::unique_ptr<uint32_t[]> order(new uint32_t[recordCount]);
+
+            timer.Reset();
+            Argsort(records.get(), recordCount, order.get(), [](const WideRecord& a_record) { return a_record.m_key; }, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("Argsort (64 byte records) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+            success = true;
+            for(int i = 0; i < recordCount - 1; ++i)
+            {
+                const WideRecord& record = records[order[i]];
+                const WideRecord& next = records[order[i + 1]];
+                if(next.m_key < record.m_key || (next.m_key == record.m_key && order[i + 1] < order[i]))
+                {
+                    success = false;
+                    break;
+                }
+            }
+            printf("Argsort %s\n", (success ? "success" : "FAIL"));
+
+            // indices that can't count up to the last record are refused, instead of wrapping around
+            std::unique_ptr<uint16_t[]> shortOrder(new uint16_t[recordCount]);
+            success = !Argsort(records.get(), recordCount, shortOrder.get(), [](const WideRecord& a_record) { return a_record.m_key; }, jobScheduler);
+            printf("Argsort (indices too small) %s\n", (success ? "success" : "FAIL"));
+
+            MergeSort<WideRecord> recordSorter;
+            timer.Reset();
+            recordSorter.SortMT(records.get(), recordCount, jobScheduler);
+            ms = 1000.0f * timer.Time();
+            printf("SortMT (64 byte records) time (%d threads) %f ms\n", (int)NUM_THREADS_FOR_SORTING, ms);
+        }
+
+        // Test SortedLevels by inserting the data in small batches, with a range query after each batch
+        {
+            const size_t NUM_THREADS_FOR_SORTING = 8;
+			JobQueue jobScheduler(NUM_THREADS_FOR_SORTING - 1);
+            SortedLevels<int> levels;
+            const int batchLength = 4096;
+            size_t queryCount = 0;
+
+            timer.Reset();
+            success = true;
+            for(int i = 0; i < dataLength; i += batchLength)
+            {
+                success = success && levels.InsertMT(originalData.get() + i, std::min(batchLength, dataLength - i), jobScheduler);
+                queryCount += levels.CountRange(originalData[i], originalData[i] + 1000);
+            }
+            success = success && levels.WaitForCompaction();
+            ms = 1000.0f * timer.Time();
+            printf("SortedLevels::InsertMT (%d batches, %d levels) time (%d threads) %f ms\n", (dataLength + batchLength - 1) / batchLength,
+                (int)levels.NumLevels(), (int)NUM_THREADS_FOR_SORTING, ms);
+            success = success && queryCount > 0 && levels.Size() == (size_t)dataLength;
+            size_t copied = levels.CopyRange(INT_MIN, INT_MAX, testData.get());
+            success = success && copied == levels.LowerBound(INT_MAX) && VerifyOrder(testData.get(), copied);
+            printf("SortedLevels %s\n", (success ? "success" : "FAIL"));
+
+            // with no worker threads a background compaction would never run, so it has to compact on this thread
+            JobQueue noWorkers(0);
+            SortedLevels<int> serialLevels;
+            success = true;
+            for(int i = 0; i < dataLength; i += batchLength)
+            {
+                success = success && serialLevels.InsertMT(originalData.get() + i, std::min(batchLength, dataLength - i), noWorkers);
+            }
+            success = success && serialLevels.WaitForCompaction() && serialLevels.Size() == (size_t)dataLength;
+            copied = serialLevels.CopyRange(INT_MIN, INT_MAX, testData.get());
+            success = success && copied == (size_t)dataLength && VerifyOrder(testData.get(), copied);
+            printf("SortedLevels (no worker threads) %s\n", (success ? "success" : "FAIL"));
+        }
     }
 
     // STRINGS
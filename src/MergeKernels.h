@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+// Vectorized merging is selected at compile time from the instruction sets the compiler is allowed to use.
+// 32 bit keys need SSE4.1 (for integer min/max) and 64 bit keys need AVX2.
+#if defined(__AVX2__)
+#define MERGE_SIMD_32BIT
+#define MERGE_SIMD_64BIT
+#elif defined(__SSE4_1__) || defined(__AVX__)
+#define MERGE_SIMD_32BIT
+#endif
+
+#if defined(MERGE_SIMD_32BIT)
+#include <immintrin.h>
+#endif
+
+
+// Moves a_count items from a_source to a_destination, which must not overlap. Trivially copyable types are copied
+// with memcpy, and other types are moved one at a time so that sorting them never makes deep copies.
+template<class T>
+inline void MoveItems(T* a_source, T* a_destination, size_t a_count, std::true_type)
+{
+    memcpy(a_destination, a_source, sizeof(T) * a_count);
+}
+
+
+template<class T>
+inline void MoveItems(T* a_source, T* a_destination, size_t a_count, std::false_type)
+{
+    std::move(a_source, a_source + a_count, a_destination);
+}
+
+
+template<class T>
+inline void MoveItems(T* a_source, T* a_destination, size_t a_count)
+{
+    MoveItems(a_source, a_destination, a_count, std::is_trivially_copyable<T>());
+}
+
+
+// The same as MoveItems() but the source and destination may overlap.
+template<class T>
+inline void MoveItemsOverlapping(T* a_source, T* a_destination, size_t a_count, std::true_type)
+{
+    memmove(a_destination, a_source, sizeof(T) * a_count);
+}
+
+
+template<class T>
+inline void MoveItemsOverlapping(T* a_source, T* a_destination, size_t a_count, std::false_type)
+{
+    if(a_destination < a_source)
+    {
+        std::move(a_source, a_source + a_count, a_destination);
+    }
+    else
+    {
+        std::move_backward(a_source, a_source + a_count, a_destination + a_count);
+    }
+}
+
+
+template<class T>
+inline void MoveItemsOverlapping(T* a_source, T* a_destination, size_t a_count)
+{
+    MoveItemsOverlapping(a_source, a_destination, a_count, std::is_trivially_copyable<T>());
+}
+
+
+// Finds where the merge path of two sorted arrays crosses the given diagonal.
+// The first a_diagonal items of the merged result consist of the first N items of the left array and the
+// first a_diagonal - N items of the right array. This returns N. Equal items are taken from the left array first.
+// Only needs O(log n) comparisons, so every thread working on a merge can find its own starting point.
+// Items are compared with a_less, which is operator< unless another comparison is given.
+template<class T, class LESS = std::less<T>>
+inline size_t MergePathSplit(const T* a_left, size_t a_leftLength, const T* a_right, size_t a_rightLength, size_t a_diagonal, const LESS& a_less = LESS())
+{
+    size_t low = (a_diagonal > a_rightLength) ? a_diagonal - a_rightLength : 0;
+    size_t high = std::min(a_diagonal, a_leftLength);
+    while(low < high)
+    {
+        size_t middle = (low + high) >> 1;
+        if(a_less(a_right[a_diagonal - middle - 1], a_left[middle]))
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+
+// Merges the sorted ranges [a_left, a_endLeft) and [a_right, a_endRight) into a_destinationBuffer.
+// Unlike MergeMemcpy(), either range may be empty. Equal items are taken from the left range first.
+// Used to merge a single segment of a merge path. The items are moved out of the ranges.
+template<class T>
+inline void MergeRangesMemcpy(T* a_left, T* a_endLeft, T* a_right, T* a_endRight, T* a_destinationBuffer)
+{
+    if(a_left < a_endLeft && a_right < a_endRight)
+    {
+        while(true)
+        {
+            if(*a_right < *a_left)
+            {
+                *a_destinationBuffer = std::move(*a_right);
+                a_destinationBuffer++;
+                a_right++;
+                if(a_right >= a_endRight)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                *a_destinationBuffer = std::move(*a_left);
+                a_destinationBuffer++;
+                a_left++;
+                if(a_left >= a_endLeft)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    // at most one of these has anything left to copy
+    MoveItems(a_left, a_destinationBuffer, a_endLeft - a_left);
+    a_destinationBuffer += a_endLeft - a_left;
+    MoveItems(a_right, a_destinationBuffer, a_endRight - a_right);
+}
+
+
+// Describes how to merge 4 keys at a time with a bitonic merge network for a key type.
+// Types without a specialization are merged one item at a time.
+template<class T>
+struct SimdMergeTraits
+{
+    static const bool s_enabled = false;
+};
+
+
+// Chooses the vectorized or the scalar version of a merge at compile time.
+template<class T>
+struct SimdMergeTag : std::integral_constant<bool, SimdMergeTraits<T>::s_enabled>
+{
+};
+
+
+#if defined(MERGE_SIMD_32BIT)
+
+// Shuffles for a bitonic merge of two sorted vectors of 4 x 32 bit keys.
+// Integer keys are reinterpreted as floats for the shuffles, which doesn't change their bits.
+struct SimdShuffle128
+{
+    typedef __m128 Vector;
+
+    static inline Vector Reverse(Vector a_v)
+    {
+        return _mm_shuffle_ps(a_v, a_v, _MM_SHUFFLE(0, 1, 2, 3));
+    }
+
+    // [L0 L1 H0 H1], [L2 L3 H2 H3] so the next step compares items 2 apart.
+    static inline void SplitHalves(Vector a_low, Vector a_high, Vector& a_first, Vector& a_second)
+    {
+        a_first = _mm_movelh_ps(a_low, a_high);
+        a_second = _mm_movehl_ps(a_high, a_low);
+    }
+
+    // The inverse of SplitHalves().
+    static inline void JoinHalves(Vector a_first, Vector a_second, Vector& a_low, Vector& a_high)
+    {
+        a_low = _mm_movelh_ps(a_first, a_second);
+        a_high = _mm_movehl_ps(a_second, a_first);
+    }
+
+    // [L0 L2 H0 H2], [L1 L3 H1 H3] so the next step compares neighbouring items.
+    static inline void SplitPairs(Vector a_low, Vector a_high, Vector& a_first, Vector& a_second)
+    {
+        a_first = _mm_shuffle_ps(a_low, a_high, _MM_SHUFFLE(2, 0, 2, 0));
+        a_second = _mm_shuffle_ps(a_low, a_high, _MM_SHUFFLE(3, 1, 3, 1));
+    }
+
+    // The inverse of SplitPairs().
+    static inline void JoinPairs(Vector a_first, Vector a_second, Vector& a_low, Vector& a_high)
+    {
+        a_low = _mm_unpacklo_ps(a_first, a_second);
+        a_high = _mm_unpackhi_ps(a_first, a_second);
+    }
+
+    // Treats the 4 vectors as the rows of a 4x4 matrix and turns the columns into rows.
+    static inline void Transpose4(Vector& a_row0, Vector& a_row1, Vector& a_row2, Vector& a_row3)
+    {
+        _MM_TRANSPOSE4_PS(a_row0, a_row1, a_row2, a_row3);
+    }
+};
+
+
+template<>
+struct SimdMergeTraits<int> : SimdShuffle128
+{
+    static const bool s_enabled = true;
+
+    static inline Vector Load(const int* a_p) { return _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)a_p)); }
+    static inline void Store(int* a_p, Vector a_v) { _mm_storeu_si128((__m128i*)a_p, _mm_castps_si128(a_v)); }
+    static inline Vector Min(Vector a_a, Vector a_b) { return _mm_castsi128_ps(_mm_min_epi32(_mm_castps_si128(a_a), _mm_castps_si128(a_b))); }
+    static inline Vector Max(Vector a_a, Vector a_b) { return _mm_castsi128_ps(_mm_max_epi32(_mm_castps_si128(a_a), _mm_castps_si128(a_b))); }
+};
+
+
+template<>
+struct SimdMergeTraits<unsigned int> : SimdShuffle128
+{
+    static const bool s_enabled = true;
+
+    static inline Vector Load(const unsigned int* a_p) { return _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)a_p)); }
+    static inline void Store(unsigned int* a_p, Vector a_v) { _mm_storeu_si128((__m128i*)a_p, _mm_castps_si128(a_v)); }
+    static inline Vector Min(Vector a_a, Vector a_b) { return _mm_castsi128_ps(_mm_min_epu32(_mm_castps_si128(a_a), _mm_castps_si128(a_b))); }
+    static inline Vector Max(Vector a_a, Vector a_b) { return _mm_castsi128_ps(_mm_max_epu32(_mm_castps_si128(a_a), _mm_castps_si128(a_b))); }
+};
+
+
+// _mm_min_ps() and _mm_max_ps() return the second operand when the keys compare equal or either is a NaN, so
+// -0.0 and +0.0, or a NaN, would come out twice and the other key not at all. Instead each lane of the result is
+// picked from one of the inputs with a compare and a blend, so the keys are moved and never recomputed.
+template<>
+struct SimdMergeTraits<float> : SimdShuffle128
+{
+    static const bool s_enabled = true;
+
+    static inline Vector Load(const float* a_p) { return _mm_loadu_ps(a_p); }
+    static inline void Store(float* a_p, Vector a_v) { _mm_storeu_ps(a_p, a_v); }
+    static inline Vector Min(Vector a_a, Vector a_b) { return _mm_blendv_ps(a_a, a_b, _mm_cmplt_ps(a_b, a_a)); }
+    static inline Vector Max(Vector a_a, Vector a_b) { return _mm_blendv_ps(a_b, a_a, _mm_cmplt_ps(a_b, a_a)); }
+};
+
+#endif // MERGE_SIMD_32BIT
+
+
+#if defined(MERGE_SIMD_64BIT)
+
+// Shuffles for a bitonic merge of two sorted vectors of 4 x 64 bit keys.
+// Integer keys are reinterpreted as doubles for the shuffles, which doesn't change their bits.
+struct SimdShuffle256
+{
+    typedef __m256d Vector;
+
+    static inline Vector Reverse(Vector a_v)
+    {
+        return _mm256_permute4x64_pd(a_v, _MM_SHUFFLE(0, 1, 2, 3));
+    }
+
+    static inline void SplitHalves(Vector a_low, Vector a_high, Vector& a_first, Vector& a_second)
+    {
+        a_first = _mm256_permute2f128_pd(a_low, a_high, 0x20);
+        a_second = _mm256_permute2f128_pd(a_low, a_high, 0x31);
+    }
+
+    static inline void JoinHalves(Vector a_first, Vector a_second, Vector& a_low, Vector& a_high)
+    {
+        SplitHalves(a_first, a_second, a_low, a_high);
+    }
+
+    // Unlike SimdShuffle128 this gives [L0 H0 L2 H2], [L1 H1 L3 H3], which JoinPairs() undoes.
+    static inline void SplitPairs(Vector a_low, Vector a_high, Vector& a_first, Vector& a_second)
+    {
+        a_first = _mm256_unpacklo_pd(a_low, a_high);
+        a_second = _mm256_unpackhi_pd(a_low, a_high);
+    }
+
+    static inline void JoinPairs(Vector a_first, Vector a_second, Vector& a_low, Vector& a_high)
+    {
+        SplitPairs(a_first, a_second, a_low, a_high);
+    }
+
+    static inline void Transpose4(Vector& a_row0, Vector& a_row1, Vector& a_row2, Vector& a_row3)
+    {
+        Vector t0 = _mm256_unpacklo_pd(a_row0, a_row1);
+        Vector t1 = _mm256_unpackhi_pd(a_row0, a_row1);
+        Vector t2 = _mm256_unpacklo_pd(a_row2, a_row3);
+        Vector t3 = _mm256_unpackhi_pd(a_row2, a_row3);
+        a_row0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+        a_row1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+        a_row2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+        a_row3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+    }
+};
+
+
+// AVX2 has no 64 bit integer min/max, so they are built from a compare and a blend.
+template<class T>
+struct SimdMergeTraitsInt64 : SimdShuffle256
+{
+    static const bool s_enabled = true;
+
+    static inline Vector Load(const T* a_p) { return _mm256_castsi256_pd(_mm256_loadu_si256((const __m256i*)a_p)); }
+    static inline void Store(T* a_p, Vector a_v) { _mm256_storeu_si256((__m256i*)a_p, _mm256_castpd_si256(a_v)); }
+    static inline Vector Min(Vector a_a, Vector a_b) { return _mm256_blendv_pd(a_a, a_b, Greater(a_a, a_b)); }
+    static inline Vector Max(Vector a_a, Vector a_b) { return _mm256_blendv_pd(a_b, a_a, Greater(a_a, a_b)); }
+
+    // All bits set in each lane where a_a > a_b. Unsigned keys have their top bit flipped so a signed compare works.
+    static inline Vector Greater(Vector a_a, Vector a_b)
+    {
+        __m256i flip = _mm256_set1_epi64x(std::is_signed<T>::value ? 0 : (long long)0x8000000000000000ull);
+        __m256i a = _mm256_xor_si256(_mm256_castpd_si256(a_a), flip);
+        __m256i b = _mm256_xor_si256(_mm256_castpd_si256(a_b), flip);
+        return _mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b));
+    }
+};
+
+
+template<> struct SimdMergeTraits<long long> : SimdMergeTraitsInt64<long long> {};
+template<> struct SimdMergeTraits<unsigned long long> : SimdMergeTraitsInt64<unsigned long long> {};
+template<> struct SimdMergeTraits<long> : std::conditional<sizeof(long) == 8, SimdMergeTraitsInt64<long>, SimdMergeTraits<void> >::type {};
+template<> struct SimdMergeTraits<unsigned long> : std::conditional<sizeof(unsigned long) == 8, SimdMergeTraitsInt64<unsigned long>, SimdMergeTraits<void> >::type {};
+
+
+// A compare and a blend rather than _mm256_min_pd() and _mm256_max_pd(), for the same reason as floats.
+template<>
+struct SimdMergeTraits<double> : SimdShuffle256
+{
+    static const bool s_enabled = true;
+
+    static inline Vector Load(const double* a_p) { return _mm256_loadu_pd(a_p); }
+    static inline void Store(double* a_p, Vector a_v) { _mm256_storeu_pd(a_p, a_v); }
+    static inline Vector Min(Vector a_a, Vector a_b) { return _mm256_blendv_pd(a_a, a_b, _mm256_cmp_pd(a_b, a_a, _CMP_LT_OQ)); }
+    static inline Vector Max(Vector a_a, Vector a_b) { return _mm256_blendv_pd(a_b, a_a, _mm256_cmp_pd(a_b, a_a, _CMP_LT_OQ)); }
+};
+
+#endif // MERGE_SIMD_64BIT
+
+
+// Sorts two bitonic vectors of 4 keys at once with a bitonic network.
+template<class TRAITS>
+inline void BitonicSortHalves4(typename TRAITS::Vector& a_low, typename TRAITS::Vector& a_high)
+{
+    typedef typename TRAITS::Vector Vector;
+
+    // compare items 2 apart in both vectors at once
+    Vector first, second;
+    TRAITS::SplitHalves(a_low, a_high, first, second);
+    TRAITS::JoinHalves(TRAITS::Min(first, second), TRAITS::Max(first, second), a_low, a_high);
+
+    // compare neighbouring items in both vectors at once
+    TRAITS::SplitPairs(a_low, a_high, first, second);
+    TRAITS::JoinPairs(TRAITS::Min(first, second), TRAITS::Max(first, second), a_low, a_high);
+}
+
+
+// Merges two sorted vectors of 4 keys with a bitonic network. Afterwards a_low holds the lowest 4 keys and
+// a_high holds the highest 4 keys, both in ascending order. There are no branches.
+template<class TRAITS>
+inline void BitonicMerge4(typename TRAITS::Vector& a_low, typename TRAITS::Vector& a_high)
+{
+    typedef typename TRAITS::Vector Vector;
+
+    // a_low followed by a_high reversed is a bitonic sequence. Compare items 4 apart.
+    Vector high = TRAITS::Reverse(a_high);
+    Vector low = TRAITS::Min(a_low, high);
+    high = TRAITS::Max(a_low, high);
+
+    BitonicSortHalves4<TRAITS>(low, high);
+    a_low = low;
+    a_high = high;
+}
+
+
+// The same as MergeRangesMemcpy() but merges 4 keys at a time using a bitonic merge network.
+// Only a single branch per 4 keys, which picks the input to load from next, depends on the data.
+// The merge is not stable, which doesn't matter for the primitive key types this is used for.
+template<class T>
+inline void MergeRangesSimd(T* a_left, T* a_endLeft, T* a_right, T* a_endRight, T* a_destinationBuffer)
+{
+    typedef SimdMergeTraits<T> Traits;
+
+    if(a_endLeft - a_left >= 4 && a_endRight - a_right >= 4)
+    {
+        typename Traits::Vector low = Traits::Load(a_left);
+        typename Traits::Vector high = Traits::Load(a_right);
+        a_left += 4;
+        a_right += 4;
+
+        while(true)
+        {
+            BitonicMerge4<Traits>(low, high);
+            Traits::Store(a_destinationBuffer, low);
+            a_destinationBuffer += 4;
+
+            if(a_endLeft - a_left < 4 || a_endRight - a_right < 4)
+            {
+                break;
+            }
+
+            // Load the next 4 keys from the input with the smaller next key. Every key in 'high' came from before
+            // the next key of its input, so the lowest 4 keys of the next merge can't be beaten by any unread key.
+            bool takeLeft = !(*a_right < *a_left);
+            low = Traits::Load(takeLeft ? a_left : a_right);
+            a_left += takeLeft ? 4 : 0;
+            a_right += takeLeft ? 0 : 4;
+        }
+
+        // Merge the 4 keys still in 'high' with the remainder of both inputs until they are used up.
+        T pending[4];
+        Traits::Store(pending, high);
+        const T* next = pending;
+        const T* endPending = pending + 4;
+        while(next < endPending)
+        {
+            if(a_left < a_endLeft && *a_left < *next && (a_right >= a_endRight || !(*a_right < *a_left)))
+            {
+                *a_destinationBuffer++ = *a_left++;
+            }
+            else if(a_right < a_endRight && *a_right < *next)
+            {
+                *a_destinationBuffer++ = *a_right++;
+            }
+            else
+            {
+                *a_destinationBuffer++ = *next++;
+            }
+        }
+    }
+
+    MergeRangesMemcpy(a_left, a_endLeft, a_right, a_endRight, a_destinationBuffer);
+}
+
+
+// Merges the sorted ranges like MergeRangesMemcpy(), using MergeRangesSimd() for key types that support it.
+template<class T>
+inline void MergeRanges(T* a_left, T* a_endLeft, T* a_right, T* a_endRight, T* a_destinationBuffer, std::true_type)
+{
+    MergeRangesSimd(a_left, a_endLeft, a_right, a_endRight, a_destinationBuffer);
+}
+
+
+template<class T>
+inline void MergeRanges(T* a_left, T* a_endLeft, T* a_right, T* a_endRight, T* a_destinationBuffer, std::false_type)
+{
+    MergeRangesMemcpy(a_left, a_endLeft, a_right, a_endRight, a_destinationBuffer);
+}
+
+
+template<class T>
+inline void MergeRanges(T* a_left, T* a_endLeft, T* a_right, T* a_endRight, T* a_destinationBuffer)
+{
+    MergeRanges(a_left, a_endLeft, a_right, a_endRight, a_destinationBuffer, SimdMergeTag<T>());
+}
@@ -2,3 +2,136 @@
 
 #include "MergeSort.h"
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+#if !defined(_WIN32)
+// Buffers at least this big are backed by huge pages.
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+
+// Returns the number of bytes to map for a sort buffer. Buffers backed by huge pages are a whole number of them.
+static size_t SortBufferMappedBytes(size_t a_bytes)
+{
+    if(a_bytes < HUGE_PAGE_SIZE)
+    {
+        return a_bytes;
+    }
+    return (a_bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+#endif
+
+
+static size_t DetectCacheSize()
+{
+    // used if the cache size can't be found
+    const size_t defaultCacheSize = 256 * 1024;
+
+#if defined(_WIN32)
+    DWORD bufferSize = 0;
+    GetLogicalProcessorInformation(0, &bufferSize);
+    if(bufferSize == 0)
+    {
+        return defaultCacheSize;
+    }
+    std::unique_ptr<SYSTEM_LOGICAL_PROCESSOR_INFORMATION[]> info(new SYSTEM_LOGICAL_PROCESSOR_INFORMATION[bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION)]);
+    if(!GetLogicalProcessorInformation(info.get(), &bufferSize))
+    {
+        return defaultCacheSize;
+    }
+    for(DWORD i = 0; i < bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); ++i)
+    {
+        if(info[i].Relationship == RelationCache && info[i].Cache.Level == 2)
+        {
+            return info[i].Cache.Size;
+        }
+    }
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if(size > 0)
+    {
+        return (size_t)size;
+    }
+#endif
+
+    return defaultCacheSize;
+}
+
+
+size_t GetSortCacheSize()
+{
+    // only ask the OS once
+    static size_t s_cacheSize = DetectCacheSize();
+    return s_cacheSize;
+}
+
+
+void* AllocateSortBuffer(size_t a_bytes)
+{
+    if(a_bytes == 0)
+    {
+        return 0;
+    }
+
+#if defined(_WIN32)
+    // Large pages need the "Lock pages in memory" privilege, so fall back to normal pages without it. Large pages
+    // are placed when they are allocated, but normal pages are placed when they are first touched.
+    size_t largePageSize = GetLargePageMinimum();
+    if(largePageSize != 0 && a_bytes >= largePageSize)
+    {
+        size_t roundedBytes = (a_bytes + largePageSize - 1) / largePageSize * largePageSize;
+        void* buffer = VirtualAlloc(0, roundedBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if(buffer != 0)
+        {
+            return buffer;
+        }
+    }
+    return VirtualAlloc(0, a_bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    // try the reserved huge page pool first, and otherwise ask for transparent huge pages
+    size_t mappedBytes = SortBufferMappedBytes(a_bytes);
+#if defined(MAP_HUGETLB)
+    if(a_bytes >= HUGE_PAGE_SIZE)
+    {
+        void* buffer = mmap(0, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(buffer != MAP_FAILED)
+        {
+            return buffer;
+        }
+    }
+#endif
+    void* buffer = mmap(0, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffer == MAP_FAILED)
+    {
+        return 0;
+    }
+#if defined(MADV_HUGEPAGE)
+    if(a_bytes >= HUGE_PAGE_SIZE)
+    {
+        madvise(buffer, mappedBytes, MADV_HUGEPAGE);
+    }
+#endif
+    return buffer;
+#endif
+}
+
+
+void FreeSortBuffer(void* a_buffer, size_t a_bytes)
+{
+    if(a_buffer == 0)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    VirtualFree(a_buffer, 0, MEM_RELEASE);
+#else
+    munmap(a_buffer, SortBufferMappedBytes(a_bytes));
+#endif
+}
@@ -1,10 +1,18 @@
 #pragma once
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <vector>
 
+#include "AdaptiveMerge.h"
 #include "CountLatch.h"
+#include "JobGraph.h"
 #include "JobQueue.h"
+#include "MergeKernels.h"
+#include "MultiwayMerge.h"
+#include "SortingNetwork.h"
 
 
 template<class T>
@@ -12,22 +20,196 @@ struct SortContext
 {
     T* m_buffer1; // source left array
     T* m_buffer2; // dest left array
-    int m_dataLength; // total length of the array to be sorted
+    size_t m_dataLength; // total length of the array to be sorted
+    size_t m_tileLength; // number of items to sort completely before merging with the rest
+    size_t m_scratchLength; // number of items m_buffer2 can contain, for sorts that can make do with less
+    size_t m_constructLength; // number of items at the start of m_buffer2 to construct first, if the scratch buffer is new
 	CountLatch* m_latch;
 };
 
 
+// Describes a merge of two neighbouring sorted arrays.
 template<class T>
 struct MergeContext
 {
-    T* m_buffer1; // source left array
-    T* m_buffer2; // dest left array
-    int m_right; // offset to the right array (left array has offset 0 and ends just before the right array)
-    int m_end; // offset to the end of the right array
+    T* m_buffer1; // source buffer
+    T* m_buffer2; // dest buffer
+    size_t m_left; // offset to the left array
+    size_t m_right; // offset to the right array (left array ends just before the right array)
+    size_t m_end; // offset to the end of the right array
+    size_t m_scratchLength; // number of items m_buffer2 can contain, for merges that can make do with less
+	CountLatch* m_latch;
+};
+
+
+// Describes one segment of a merge of all the sorted runs at once. Each segment writes a different part of the
+// destination buffer, so any number of threads can work on the merge without waiting for each other.
+template<class T>
+struct MultiwayMergeContext
+{
+    T* m_source; // source buffer holding all the runs
+    T* m_destination; // dest buffer
+    const size_t* m_runStart; // offsets to the runs, followed by the offset to the end of the last run
+    int m_numRuns;
+    size_t m_segmentStart; // offset of the first item this segment writes to the dest buffer
+    size_t m_segmentEnd; // offset to the end of the items this segment writes to the dest buffer
+    size_t* m_splitStart; // number of items of each run that come before this segment
+    size_t* m_splitEnd; // number of items of each run that come before the end of this segment
+    T** m_current; // m_numRuns pointers to the next item of each run that the merge moves on
+    T** m_end; // m_numRuns pointers to the end of each run's part of the segment
+	CountLatch* m_latch;
+};
+
+
+// Describes one thread's part of a selection of the a_k smallest items for TopKMT().
+template<class T>
+struct TopKContext
+{
+    const T* m_input; // the thread's part of the input
+    size_t m_length; // number of items in the thread's part
+    T* m_heap; // where the thread keeps its smallest items, which are sorted when it has finished
+    size_t m_k; // number of items to keep
+	CountLatch* m_latch;
+};
+
+
+// Describes one thread's part of a three way partition around a pair of pivots for NthElementMT().
+// The items less than m_low go first, the items greater than m_high go last, and the rest go in between.
+template<class T>
+struct PartitionContext
+{
+    T* m_input; // the thread's part of the items being partitioned
+    T* m_partitioned; // the same part of the buffer that all the partitioned items are moved to
+    size_t m_length; // number of items in the thread's part
+    const T* m_low;
+    const T* m_high;
+    size_t m_count[3]; // number of the thread's items that go in each part of the partition
+    T* m_destination[3]; // where the thread's items of each part of the partition go
+	CountLatch* m_latch;
+};
+
+
+// Describes one thread's part of the input for SortUniqueMT(), which it sorts into the scratch buffer and then
+// removes the repeats from.
+template<class T>
+struct UniqueSortContext
+{
+    SortContext<T> m_sort; // the part to sort, which ends up in m_sort.m_buffer2
+    size_t* m_counts; // where the count of each unique item of the part goes, or 0 if they aren't needed
+    size_t m_uniqueLength; // number of unique items left at the start of the part
+};
+
+
+// Describes one segment of the merge of the unique items of every part for SortUniqueMT(). The segments are cut
+// by position in the merged result, but each segment writes fewer items than that once its repeats are removed.
+template<class T>
+struct UniqueMergeContext
+{
+    T* m_source; // scratch buffer holding all the parts
+    T* m_destination; // dest buffer
+    const size_t* m_runStart; // offsets to the parts
+    const size_t* m_runEnd; // offsets to the end of the unique items of each part
+    size_t* m_runCounts; // counts of the unique items of all the parts, or 0 if they aren't needed
+    size_t* m_destinationCounts; // counts of the items written to m_destination, at the same offsets
+    int m_numRuns;
+    size_t m_segmentStart; // position in the merged result of the first item of the segment
+    size_t* m_splitStart; // number of items of each run that come before this segment
+    size_t* m_splitEnd; // number of items of each run that come before the end of this segment
+    size_t m_uniqueLength; // number of items the segment wrote, starting at m_segmentStart
+	CountLatch* m_latch;
+};
+
+
+// Describes one thread's part of the input for SortSampleMT(), which it puts into buckets.
+template<class T>
+struct SampleSortContext
+{
+    T* m_input; // the thread's part of the input
+    T* m_scratchBuffer; // the whole scratch buffer, which the buckets are moved to
+    size_t m_length; // number of items in the thread's part
+    const T* m_splitters; // the different splitters in order
+    int m_numSplitters;
+    uint16_t* m_bucketOf; // the bucket of each item of the thread's part
+    size_t* m_counts; // number of the thread's items in each bucket, and then where the first of them goes
+	CountLatch* m_latch;
+};
+
+
+// Describes a group of neighbouring buckets for SortSampleMT(), which are sorted one after another.
+template<class T>
+struct BucketContext
+{
+    T* m_scratchBuffer; // buffer holding all the buckets
+    T* m_destination; // buffer the sorted buckets are written to, at the same offsets
+    const size_t* m_bucketStart; // offsets to the buckets, followed by the offset to the end of the last bucket
+    int m_firstBucket;
+    int m_endBucket; // index after the last bucket of the group
+    size_t m_tileLength;
+    size_t m_maxLength; // longer buckets are left for SortMT()
+	CountLatch* m_latch;
+};
+
+
+// Describes a group of neighbouring segments for SortSegments(), which are sorted one after another.
+template<class T>
+struct SegmentContext
+{
+    T* m_input; // buffer holding all the segments
+    T* m_scratchBuffer; // scratch buffer, where each segment uses the same offsets as in m_input
+    const size_t* m_segmentStart; // offsets to the segments, followed by the offset to the end of the last segment
+    size_t m_firstSegment;
+    size_t m_endSegment; // index after the last segment of the group
+    size_t m_tileLength;
+    size_t m_maxLength; // longer segments are left for SortMT()
 	CountLatch* m_latch;
 };
 
 
+// Returns the size in bytes of the CPU's L2 cache, or a typical size if it can't be found.
+size_t GetSortCacheSize();
+
+
+// Allocates a_bytes of memory for a sort buffer, backed by huge pages where the OS allows it so that passes over a
+// large buffer don't keep missing the TLB. Where possible the memory is not touched, so each page ends up on the
+// NUMA node of the thread that writes to it first. Returns 0 on failure.
+void* AllocateSortBuffer(size_t a_bytes);
+
+// Frees a buffer from AllocateSortBuffer(), which must be given the same size.
+void FreeSortBuffer(void* a_buffer, size_t a_bytes);
+
+
+template<class T>
+class MergeSort;
+
+template<class T>
+struct AsyncSortState;
+
+
+// Follows a sort that MergeSort::SortMTAsync() has started on a job queue.
+template<class T>
+class SortFuture
+{
+public:
+    SortFuture() {}
+
+    // Waits for the sort to finish, because its jobs still use this.
+    ~SortFuture();
+
+    // Returns true once the sort has finished, or if no sort was started.
+    bool IsDone();
+
+    // Blocks until the sort has finished.
+    void Wait();
+
+private:
+    SortFuture(const SortFuture&);
+    SortFuture& operator=(const SortFuture&);
+
+    friend class MergeSort<T>;
+    std::shared_ptr<AsyncSortState<T>> m_state; // shared with the MergeSort, whose scratch buffer the sort uses
+};
+
+
 template<class T>
 class MergeSort
 {
@@ -36,45 +218,157 @@ public:
     MergeSort();
 
     // Pre-allocate scratch buffer to the given number of T items, and then auto allocate more if needed.
-    MergeSort(int a_scratchLength);
+    MergeSort(size_t a_scratchLength);
 
     // Use the pre-allocated scratch buffer which can contain the given numbe of T items.
     // Sorting may fail if the given buffer is too small.
-    MergeSort(T* a_scratchBuffer, int a_scratchLength);
+    MergeSort(T* a_scratchBuffer, size_t a_scratchLength);
 
     ~MergeSort();
 
     // Sorts the input buffer, which contains the given number of T items.
+    // Blocks of SORT_NETWORK_LENGTH items are sorted with a sorting network before merging starts.
     // Returns false if the scratch buffer was not big enough.
-    bool SortUnrolledMemcpy(T* a_input, int a_length);
+    bool SortUnrolledMemcpy(T* a_input, size_t a_length);
 
-    // The same as SortUnrolledMemcpy() but without a memcpy optimization
-    bool SortSimpleUnrolled(T* a_input, int a_length);
+    // The same as SortUnrolledMemcpy() but without a memcpy optimization, and it only unrolls the first merge
+    bool SortSimpleUnrolled(T* a_input, size_t a_length);
 
     // The same as SortUnrolled() but doesn't unroll the first iteration of the main loop
-    bool SortSimple(T* a_input, int a_length);
+    bool SortSimple(T* a_input, size_t a_length);
+
+    // The same as SortUnrolledMemcpy() but is multithreaded. Each thread sorts part of the input, and then all the
+    // parts are merged in a single pass, with each thread writing its own part of the output.
+    bool SortMT(T* a_input, size_t a_length, JobQueue& a_jobQueue);
+
+    // The same as SortMT() but returns straight away, and the whole sort runs on the job queue's threads.
+    // a_future tells when the input is sorted, and any sort it was following is waited for first.
+    // The scratch buffer is in use until the sort has finished, so sorts that run at the same time each need
+    // their own MergeSort: any other sort with this MergeSort, and its destructor, wait for it first. Small sorts, or sorts with no threads in the queue, are done before this returns.
+    // Returns false if the scratch buffer was not big enough, in which case nothing was started.
+    bool SortMTAsync(T* a_input, size_t a_length, JobQueue& a_jobQueue, SortFuture<T>& a_future);
+
+    // Sorts the input buffer and removes the repeats, so the first a_uniqueLength items are the different items in
+    // order. If a_counts isn't 0, it must hold a_length counts, and a_counts[i] is set to the number of times item i
+    // came up. Returns false if the scratch buffer was not big enough.
+    bool SortUnique(T* a_input, size_t a_length, size_t& a_uniqueLength, size_t* a_counts = 0);
+
+    // The same as SortUnique() but is multithreaded, like SortMT(). Each thread removes the repeats from its part as
+    // soon as it is sorted, and the merge drops the rest, so there's no separate pass to remove them and the merge
+    // has less to do. The only other pass is over the unique items, to close up the gaps between merge segments.
+    bool SortUniqueMT(T* a_input, size_t a_length, JobQueue& a_jobQueue, size_t& a_uniqueLength, size_t* a_counts = 0);
+
+    // An alternative to SortMT() for many threads. Splitters are chosen from a sorted sample of the input, every
+    // thread moves its part of the input into the buckets between the splitters in the scratch buffer, and then the
+    // buckets are sorted independently back into the input. Each item is moved about twice, and the bucket sorts
+    // mostly run in the cache. Items equal to a splitter that comes up more than once go in a bucket of their own
+    // that doesn't need sorting, and any bucket that still ends up with more than a thread's share of the items is
+    // sorted with SortMT().
+    bool SortSampleMT(T* a_input, size_t a_length, JobQueue& a_jobQueue);
+
+    // Sorts the input buffer by finding runs that are already sorted (or reverse sorted) and merging them, galloping
+    // through parts of the runs that don't overlap. Input that is already nearly sorted takes close to O(n).
+    // The sort is stable and only needs a scratch buffer of half the length.
+    // Returns false if the scratch buffer was not big enough.
+    bool SortAdaptive(T* a_input, size_t a_length);
+
+    // The same as SortAdaptive() but is multithreaded. Each thread sorts part of the input adaptively, and then
+    // neighbouring parts are merged in parallel.
+    bool SortAdaptiveMT(T* a_input, size_t a_length, JobQueue& a_jobQueue);
+
+    // The same as SortAdaptive() but only needs a scratch buffer of about sqrt(n) items, for when there isn't room
+    // for another copy of the input. Merges of runs longer than the scratch buffer are split up by swapping blocks
+    // in place, so this is slower. Any larger scratch buffer this already has is used to speed it up.
+    bool SortLowMemory(T* a_input, size_t a_length);
+
+    // The same as SortLowMemory() but is multithreaded, with a small scratch buffer for each thread.
+    bool SortLowMemoryMT(T* a_input, size_t a_length, JobQueue& a_jobQueue);
+
+    // Sorts each of a_numSegments separate arrays in the input buffer. Segment i holds the items from
+    // a_segmentStart[i] up to a_segmentStart[i + 1], so a_segmentStart has a_numSegments + 1 offsets.
+    // Each segment is sorted the fastest way for its length, without the overhead of a call per segment.
+    // Returns false if the scratch buffer was not big enough for a_segmentStart[a_numSegments] items.
+    bool SortSegments(T* a_input, const size_t* a_segmentStart, size_t a_numSegments);
+
+    // The same as SortSegments() but is multithreaded. Short segments are grouped into jobs with about the same
+    // number of items each, and segments too long to share out that way are each sorted with SortMT().
+    bool SortSegmentsMT(T* a_input, const size_t* a_segmentStart, size_t a_numSegments, JobQueue& a_jobQueue);
+
+    // Writes the a_k smallest items of the input buffer to a_output in order, without changing the input.
+    // Each thread keeps a heap of the smallest items of its part in one pass over the input, and then the sorted
+    // heaps are merged until there are a_k items. This is for a_k much smaller than a_length: the time for each
+    // thread grows with a_k log a_k, and the scratch buffer has to hold a_k items per thread.
+    // Returns false if the scratch buffer was not big enough.
+    bool TopKMT(const T* a_input, size_t a_length, size_t a_k, T* a_output, JobQueue& a_jobQueue);
+
+    // Rearranges the input buffer like std::nth_element(): the item at a_nth is the one that would be there if the
+    // input was sorted, no item before it is greater, and no item after it is less. Each round samples the items
+    // around a_nth to choose two pivots, and all the threads partition the items around them in parallel. Only the
+    // few items between the pivots are left for the next round, so this takes a few passes over the input.
+    // Returns false if the scratch buffer was not big enough.
+    bool NthElementMT(T* a_input, size_t a_length, size_t a_nth, JobQueue& a_jobQueue);
+
+    // Rearranges the input buffer like std::partial_sort(): the a_k smallest items come first, in order, and the
+    // rest follow in no particular order. This is NthElementMT() followed by SortMT() of the first a_k items.
+    // Returns false if the scratch buffer was not big enough.
+    bool PartialSortMT(T* a_input, size_t a_length, size_t a_k, JobQueue& a_jobQueue);
 
-    // The same as SortSimpleUnrolled() but is multithreaded.
-    bool SortMT(T* a_input, uint32_t a_length, JobQueue& a_jobQueue);
+    // SortUnrolledMemcpy() and the threads of SortMT() sort tiles of this many items completely while they are
+    // in the cache before merging the tiles together. By default a tile and its scratch space fill the L2 cache.
+    // Passing 0 restores the default.
+    void SetTileLength(size_t a_tileLength);
+    inline size_t GetTileLength() const { return m_tileLength; }
 
 private:
 
-    // Returns false if a large enough buffer cannot be allocated.
-    bool EnsureBufferIsLargeEnough(int a_length);
+    // Returns false if a large enough buffer cannot be allocated. Waits for a sort from SortMTAsync() that may still
+    // be using the scratch buffer, because every sort calls this before it touches the buffer. Sorts that split the
+    // buffer between threads pass a_constructLater, so that each thread constructs the items of its own part of a
+    // new buffer, and then call FinishConstructingScratch().
+    bool EnsureBufferIsLargeEnough(size_t a_length, bool a_constructLater = false);
+
+    // Blocks until the last sort started by SortMTAsync() has finished with the scratch buffer.
+    void WaitForAsyncSort();
+
+    // Allocates a new scratch buffer, or frees the one we allocated. Returns false if it cannot be allocated.
+    bool AllocateScratch(size_t a_length);
+    void FreeScratch();
+
+    // Returns the offset in the scratch buffer that is in the same proportion to its length as a_offset is to a_length.
+    inline size_t ScratchShare(size_t a_offset, size_t a_length) const { return a_offset * m_scratchLength / a_length; }
+
+    // Returns how many items of a part of the scratch buffer its thread has to construct, which is none unless the
+    // buffer is new.
+    inline size_t ScratchToConstruct(size_t a_length) const { return m_scratchConstructed ? 0 : a_length; }
+
+    // Constructs the items of a new scratch buffer from a_constructedLength to its end, the threads that used it
+    // having constructed the ones before that. Does nothing if they are already constructed.
+    void FinishConstructingScratch(size_t a_constructedLength);
+
+    // Items in the scratch buffer are only constructed for types that aren't trivially copyable.
+    void DestroyScratch(std::true_type) {}
+    void DestroyScratch(std::false_type);
 
     T* m_scratchBuffer;
-    int m_scratchLength; // number of T items that the buffer can contain
+    size_t m_scratchLength; // number of T items that the buffer can contain
+    bool m_scratchConstructed; // false until the items of a buffer we allocated have all been constructed
     bool m_autoAllocateScratch;
+    size_t m_tileLength; // number of T items in a tile that is sorted before merging with other tiles
+    std::shared_ptr<AsyncSortState<T>> m_asyncSort; // the last sort started by SortMTAsync(), until it is waited for
 };
 
 
-// Merges two arrays from the source buffer (indexed by a_left and a_right) into the destination buffer.
-// a_right - a_left is the count of the left array and a_end - a_right is the count of the right array.
-// The sorted result in a_destinationBuffer starts at a_left and has a count of a_end - a_left.
-// We assume a precondition that the left buffer always has at least one item.
-// Optimizes by using memcpy to copy across the remaining source array when the other array is empty.
+// The vectorized version of MergeMemcpy(), used for key types with a SimdMergeTraits specialization.
 template<class T>
-inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, int a_right, int a_end)
+inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, size_t a_left, size_t a_right, size_t a_end, std::true_type)
+{
+    MergeRangesSimd(a_sourceBuffer + a_left, a_sourceBuffer + a_right, a_sourceBuffer + a_right, a_sourceBuffer + a_end, a_destinationBuffer + a_left);
+}
+
+
+// The scalar version of MergeMemcpy(), used for all other types.
+template<class T>
+inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, size_t a_left, size_t a_right, size_t a_end, std::false_type)
 {
     a_destinationBuffer += a_left;
     T* left = a_sourceBuffer + a_left;
@@ -88,7 +382,7 @@ inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, i
     // There may be nothing in the right input buffer so check this case first.
     if(right >= endRight)
     {
-        memcpy(a_destinationBuffer, left, (char*)endLeft - (char*)left);
+        MoveItems(left, a_destinationBuffer, endLeft - left);
         return;
     }
 
@@ -97,25 +391,25 @@ inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, i
         // compare left and right input buffers and copy the smaller value to the destination buffer.
         if(*left < *right)
         {
-            *a_destinationBuffer = *left;
+            *a_destinationBuffer = std::move(*left);
             a_destinationBuffer++;
             left++;
             // if we have exhausted the left buffer, copy the remainder of the right and return
             if(left >= endLeft)
             {
-                memcpy(a_destinationBuffer, right, (char*)endRight - (char*)right);
+                MoveItems(right, a_destinationBuffer, endRight - right);
                 return;
             }
         }
         else
         {
-            *a_destinationBuffer = *right;
+            *a_destinationBuffer = std::move(*right);
             a_destinationBuffer++;
             right++;
             // if we have exhausted the right buffer, copy the remainder of the left and return
             if(right >= endRight)
             {
-                memcpy(a_destinationBuffer, left, (char*)endLeft - (char*)left);
+                MoveItems(left, a_destinationBuffer, endLeft - left);
                 return;
             }
         }
@@ -123,9 +417,23 @@ inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, i
 }
 
 
+// Merges two arrays from the source buffer (indexed by a_left and a_right) into the destination buffer.
+// a_right - a_left is the count of the left array and a_end - a_right is the count of the right array.
+// The sorted result in a_destinationBuffer starts at a_left and has a count of a_end - a_left.
+// We assume a precondition that the left buffer always has at least one item.
+// Optimizes by using memcpy to copy across the remaining source array when the other array is empty.
+// Types that aren't trivially copyable are moved instead of copied.
+// Primitive key types that support it are merged 4 at a time by MergeRangesSimd() instead.
+template<class T>
+inline void MergeMemcpy(T* a_sourceBuffer, T* a_destinationBuffer, size_t a_left, size_t a_right, size_t a_end)
+{
+    MergeMemcpy(a_sourceBuffer, a_destinationBuffer, a_left, a_right, a_end, SimdMergeTag<T>());
+}
+
+
 // Functions the same as MergeMemcpy() but more straightforward and not quite as fast.
 template<class T>
-inline void MergeSimple(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, int a_right, int a_end)
+inline void MergeSimple(T* a_sourceBuffer, T* a_destinationBuffer, size_t a_left, size_t a_right, size_t a_end)
 {
     T* left = a_sourceBuffer + a_left;
     T* right = a_sourceBuffer + a_right;
@@ -141,12 +449,12 @@ inline void MergeSimple(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, i
     {
         if(left < endLeft && (right >= endRight || *left < *right))
         {
-            *a_destinationBuffer = *left;
+            *a_destinationBuffer = std::move(*left);
             left++;
         }
         else
         {
-            *a_destinationBuffer = *right;
+            *a_destinationBuffer = std::move(*right);
             right++;
         }
         a_destinationBuffer++;
@@ -155,67 +463,136 @@ inline void MergeSimple(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, i
 }
 
 
-// The same as MergeSimple() but only merges into the first half of the destination buffer.
-// Used for the multi-threaded merge so that 2 threads can work on a single merge.
+// Sorts a_length items in a_buffer1 with bottom-up merges, using a_buffer2 as scratch space.
+// Rather than making a pass over all the items for each merge width, each tile of a_tileLength items is sorted
+// completely while it is still in the cache, and only then are the sorted tiles merged together.
+// The sorted items end up in a_buffer2 if a_resultInBuffer2 is true, and otherwise in a_buffer1. When the number
+// of passes would leave them in the other buffer, the first pass sorts the blocks in place instead of copying them.
+// Returns the buffer that holds the sorted items.
 template<class T>
-inline void MergeFirst(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, int a_right, int a_end)
+inline T* SortTiles(T* a_buffer1, T* a_buffer2, size_t a_length, size_t a_tileLength, bool a_resultInBuffer2)
 {
-    T* left = a_sourceBuffer + a_left;
-    T* right = a_sourceBuffer + a_right;
-    T* endLeft = right;
-    T* endRight = a_sourceBuffer + a_end;
-    T* destinationBufferEnd = a_destinationBuffer + a_left + ((a_end - a_left + 1) >> 1); // only fill the first half, rounded up
-    a_destinationBuffer += a_left;
+    T* sorted = a_buffer1;
+    T* scratch = a_buffer2;
 
-    // We assume a precondition that the left buffer always has at least one item
-    assert(left < endLeft);
+    // every pass moves the items to the other buffer, and the first tile decides where all the tiles end up
+    int numPasses = 1;
+    for(size_t width = SORT_NETWORK_LENGTH; width < std::min(a_tileLength, a_length); width <<= 1)
+    {
+        numPasses++;
+    }
+    for(size_t width = a_tileLength; width < a_length; width <<= 1)
+    {
+        numPasses++;
+    }
+    bool sortBlocksInPlace = ((numPasses & 1) == 1) != a_resultInBuffer2;
 
-    do
+    for(size_t tile = 0; tile < a_length; tile += a_tileLength)
     {
-        if(left < endLeft && (right >= endRight || *left < *right))
+        size_t tileLength = std::min(a_tileLength, a_length - tile);
+
+        // These pointers are swapped for each iteration to avoid copying.
+        T* buffer1 = a_buffer1 + tile;
+        T* buffer2 = a_buffer2 + tile;
+
+        // sort small blocks with a sorting network so that merging can start at a larger width
+        if(sortBlocksInPlace)
         {
-            *a_destinationBuffer = *left;
-            left++;
+            SortNetworkBlocks(buffer1, buffer1, tileLength);
         }
         else
         {
-            *a_destinationBuffer = *right;
-            right++;
+            SortNetworkBlocks(buffer1, buffer2, tileLength);
+            std::swap(buffer1, buffer2);
+        }
+
+        for(size_t width = SORT_NETWORK_LENGTH; width < tileLength; width <<= 1)
+        {
+            for(size_t i = 0; i < tileLength; i += (width << 1))
+            {
+                MergeMemcpy(buffer1, buffer2, i, std::min(i + width, tileLength), std::min(i + (width << 1), tileLength));
+            }
+            std::swap(buffer1, buffer2);
+        }
+
+        // all tiles need to end up in the same buffer as the first one. Only a short last tile can differ.
+        if(tile == 0)
+        {
+            sorted = buffer1 - tile;
+            scratch = buffer2 - tile;
+        }
+        else if(buffer1 != sorted + tile)
+        {
+            MoveItems(buffer1, sorted + tile, tileLength);
         }
-        a_destinationBuffer++;
     }
-    while(a_destinationBuffer < destinationBufferEnd);
+
+    for(size_t width = a_tileLength; width < a_length; width <<= 1)
+    {
+        for(size_t i = 0; i < a_length; i += (width << 1))
+        {
+            MergeMemcpy(sorted, scratch, i, std::min(i + width, a_length), std::min(i + (width << 1), a_length));
+        }
+        std::swap(sorted, scratch);
+    }
+
+    return sorted;
+}
+
+
+// Constructs the items of one thread's part of a new scratch buffer, for types that aren't trivially copyable,
+// which are moved into it with assignment. Doing this in the thread's job, rather than when the buffer is
+// allocated, means its pages are first touched by the thread that sorts into them, as they are for other types.
+template<class T>
+inline void ConstructScratchItems(T* a_items, size_t a_count, std::true_type)
+{
+}
+
+
+template<class T>
+inline void ConstructScratchItems(T* a_items, size_t a_count, std::false_type)
+{
+    for(size_t i = 0; i < a_count; ++i)
+    {
+        new (a_items + i) T();
+    }
 }
 
 
-// The same as MergeFirst() but merges from the other end of the lists.
-// Used for the multi-threaded merge so that 2 threads can work on a single merge.
 template<class T>
-inline void MergeSecond(T* a_sourceBuffer, T* a_destinationBuffer, int a_left, int a_right, int a_end)
+inline void ConstructScratchItems(T* a_items, size_t a_count)
 {
-    // all pointers are set up to start from the end of the buffers and iterate towards the start.
-    T* left = a_sourceBuffer + a_right - 1;
-    T* right = a_sourceBuffer + a_end - 1;
-    T* endLeft = a_sourceBuffer - 1;
-    T* endRight = left;
-    // the destination end is one less that the end position of MergeFirst()
-    T* destinationBufferEnd = a_destinationBuffer + ((a_end - a_left + 1) >> 1) - 1;
-    a_destinationBuffer += a_end - 1; // start from last entry
+    ConstructScratchItems(a_items, a_count, std::is_trivially_copyable<T>());
+}
+
 
-    // condition must go at the front for the case where the list only had one entry.
-    while(a_destinationBuffer > destinationBufferEnd)
+// Sorts the segments a_firstSegment up to a_endSegment of a_input, as described for MergeSort::SortSegments(),
+// skipping any longer than a_maxLength. Segments of up to SORT_NETWORK_LENGTH items are sorted in place with the
+// sorting network or an insertion sort, and longer ones with SortTiles(), which is faster than an insertion sort
+// from just over SORT_NETWORK_LENGTH items.
+template<class T>
+inline void SortSegmentRange(T* a_input, T* a_scratchBuffer, const size_t* a_segmentStart, size_t a_firstSegment, size_t a_endSegment, size_t a_tileLength, size_t a_maxLength)
+{
+    for(size_t i = a_firstSegment; i < a_endSegment; ++i)
     {
-        if(left > endLeft && (right <= endRight || *left > *right))
+        size_t start = a_segmentStart[i];
+        size_t length = a_segmentStart[i + 1] - start;
+        if(length < 2 || length > a_maxLength)
+        {
+            continue;
+        }
+        if(length <= SORT_NETWORK_LENGTH)
         {
-            *a_destinationBuffer = *left;
-            left--;
+            SortNetworkBlocks(a_input + start, a_input + start, length);
         }
         else
         {
-            *a_destinationBuffer = *right;
-            right--;
+            T* sorted = SortTiles(a_input + start, a_scratchBuffer + start, length, a_tileLength, false);
+            if(sorted != a_input + start)
+            {
+                MoveItems(sorted, a_input + start, length);
+            }
         }
-        a_destinationBuffer--;
     }
 }
 
@@ -224,45 +601,45 @@ template<class T>
 MergeSort<T>::MergeSort()
     : m_scratchBuffer(0)
     , m_scratchLength(0)
+    , m_scratchConstructed(true)
     , m_autoAllocateScratch(true)
 {
+    SetTileLength(0);
 }
 
 
 template<class T>
-MergeSort<T>::MergeSort(int a_scratchLength)
-    : m_scratchLength(a_scratchLength)
+MergeSort<T>::MergeSort(size_t a_scratchLength)
+    : m_scratchBuffer(0)
+    , m_scratchLength(0)
+    , m_scratchConstructed(true)
     , m_autoAllocateScratch(true)
 {
-    m_scratchBuffer = new (std::nothrow) T[a_scratchLength];
-    if(m_scratchBuffer == 0)
-    {
-        m_scratchLength = 0;
-    }
+    SetTileLength(0);
+    AllocateScratch(a_scratchLength);
 }
 
 
 template<class T>
-MergeSort<T>::MergeSort(T* a_scratchBuffer, int a_scratchLength)
+MergeSort<T>::MergeSort(T* a_scratchBuffer, size_t a_scratchLength)
     : m_scratchBuffer(a_scratchBuffer)
     , m_scratchLength(a_scratchLength)
+    , m_scratchConstructed(true)
     , m_autoAllocateScratch(false)
 {
+    SetTileLength(0);
 }
 
 
 template<class T>
 MergeSort<T>::~MergeSort()
 {
-    if(m_autoAllocateScratch && m_scratchBuffer != 0)
-    {
-        delete [] m_scratchBuffer;
-    }
+    FreeScratch();
 }
 
 
 template<class T>
-bool MergeSort<T>::SortUnrolledMemcpy(T* a_input, int a_length)
+bool MergeSort<T>::SortUnrolledMemcpy(T* a_input, size_t a_length)
 {
     // skip the trivial case
     if(a_length < 2)
@@ -276,57 +653,19 @@ bool MergeSort<T>::SortUnrolledMemcpy(T* a_input, int a_length)
         return false;
     }
 
-    // Keep a copy of the input array pointer and the scratch array. 
-    // These pointers are swapped for each iteration to avoid copying.
-    T* buffer1 = a_input;
-    T* buffer2 = m_scratchBuffer;
-
-    // unroll the first iteration because we can make some shortcuts
-    for(int i = 0; i < a_length; i += 2)
-    {
-        if(i + 1 < a_length)
-        {
-            // compare left and right
-            if(buffer1[i] < buffer1[i + 1])
-            {
-                // order is correct, so copy both elements
-                memcpy(buffer2 + i, buffer1 + i, sizeof(T) << 1);
-            }
-            else
-            {
-                // swap as we copy
-                buffer2[i] = buffer1[i + 1];
-                buffer2[i + 1] = buffer1[i];
-            }
-        }
-        else
-        {
-            // just copy the left
-            buffer2[i] = buffer1[i];
-        }
-    }
-    std::swap(buffer1, buffer2);
-
-    for(int width = 2; width < a_length; width <<= 1)
-    {
-        for(int i = 0; i < a_length; i += (width << 1))
-        {
-            MergeMemcpy(buffer1, buffer2, i, std::min(i + width, a_length), std::min(i + (width << 1), a_length));
-        }
-        std::swap(buffer1, buffer2);
-    }
+    T* sorted = SortTiles(a_input, m_scratchBuffer, a_length, m_tileLength, false);
 
     // if the results are in the scratch buffer, copy them back into the input buffer
-    if(buffer1 == m_scratchBuffer)
+    if(sorted == m_scratchBuffer)
     {
-        memcpy(a_input, buffer1, sizeof(T) * a_length);
+        MoveItems(sorted, a_input, a_length);
     }
 
     return true;
 }
 
 template<class T>
-bool MergeSort<T>::SortSimpleUnrolled(T* a_input, int a_length)
+bool MergeSort<T>::SortSimpleUnrolled(T* a_input, size_t a_length)
 {
     if(!EnsureBufferIsLargeEnough(a_length))
     {
@@ -339,7 +678,7 @@ bool MergeSort<T>::SortSimpleUnrolled(T* a_input, int a_length)
     T* buffer2 = m_scratchBuffer;
 
     // unroll the first iteration because we can make some shortcuts
-    for(int i = 0; i < a_length; i += 2)
+    for(size_t i = 0; i < a_length; i += 2)
     {
         if(i + 1 < a_length)
         {
@@ -347,26 +686,26 @@ bool MergeSort<T>::SortSimpleUnrolled(T* a_input, int a_length)
             if(buffer1[i] < buffer1[i + 1])
             {
                 // order is correct, so copy both elements
-                memcpy(buffer2 + i, buffer1 + i, sizeof(T) << 1);
+                MoveItems(buffer1 + i, buffer2 + i, 2);
             }
             else
             {
                 // swap as we copy
-                buffer2[i] = buffer1[i + 1];
-                buffer2[i + 1] = buffer1[i];
+                buffer2[i] = std::move(buffer1[i + 1]);
+                buffer2[i + 1] = std::move(buffer1[i]);
             }
         }
         else
         {
             // just copy the left
-            buffer2[i] = buffer1[i];
+            buffer2[i] = std::move(buffer1[i]);
         }
     }
     std::swap(buffer1, buffer2);
 
-    for(int width = 2; width < a_length; width <<= 1)
+    for(size_t width = 2; width < a_length; width <<= 1)
     {
-        for(int i = 0; i < a_length; i += (width << 1))
+        for(size_t i = 0; i < a_length; i += (width << 1))
         {
             MergeSimple(buffer1, buffer2, i, std::min(i + width, a_length), std::min(i + (width << 1), a_length));
         }
@@ -376,7 +715,7 @@ bool MergeSort<T>::SortSimpleUnrolled(T* a_input, int a_length)
     // if the results are in the scratch buffer, copy them back into the input buffer
     if(buffer1 == m_scratchBuffer)
     {
-        memcpy(a_input, buffer1, sizeof(T) * a_length);
+        MoveItems(buffer1, a_input, a_length);
     }
 
     return true;
@@ -384,7 +723,7 @@ bool MergeSort<T>::SortSimpleUnrolled(T* a_input, int a_length)
 
 
 template<class T>
-bool MergeSort<T>::SortSimple(T* a_input, int a_length)
+bool MergeSort<T>::SortSimple(T* a_input, size_t a_length)
 {
     if(!EnsureBufferIsLargeEnough(a_length))
     {
@@ -396,9 +735,9 @@ bool MergeSort<T>::SortSimple(T* a_input, int a_length)
     T* buffer1 = a_input;
     T* buffer2 = m_scratchBuffer;
 
-    for(int width = 1; width < a_length; width <<= 1)
+    for(size_t width = 1; width < a_length; width <<= 1)
     {
-        for(int i = 0; i < a_length; i += (width << 1))
+        for(size_t i = 0; i < a_length; i += (width << 1))
         {
             MergeSimple(buffer1, buffer2, i, std::min(i + width, a_length), std::min(i + (width << 1), a_length));
         }
@@ -408,7 +747,7 @@ bool MergeSort<T>::SortSimple(T* a_input, int a_length)
     // if the results are in the scratch buffer, copy them back into the input buffer
     if(buffer1 == m_scratchBuffer)
     {
-        memcpy(a_input, buffer1, sizeof(T) * a_length);
+        MoveItems(buffer1, a_input, a_length);
     }
 
     return true;
@@ -420,38 +759,12 @@ void SortJob(void* a_context)
 {
     SortContext<T>* context = (SortContext<T>*) a_context;
 
-    // unroll the first iteration because we can make some shortcuts
-    for(int i = 0; i < context->m_dataLength; i += 2)
-    {
-        if(i + 1 < context->m_dataLength)
-        {
-            // compare left and right
-            if(context->m_buffer1[i] < context->m_buffer1[i + 1])
-            {
-                // order is correct, so copy both elements
-                memcpy(context->m_buffer2 + i, context->m_buffer1 + i, sizeof(T) << 1);
-            }
-            else
-            {
-                // swap as we copy
-                context->m_buffer2[i] = context->m_buffer1[i + 1];
-                context->m_buffer2[i + 1] = context->m_buffer1[i];
-            }
-        }
-        else
-        {
-            // just copy the left
-            context->m_buffer2[i] = context->m_buffer1[i];
-        }
-    }
-    std::swap(context->m_buffer1, context->m_buffer2);
+    ConstructScratchItems(context->m_buffer2, context->m_constructLength);
 
-    for(int width = 2; width < context->m_dataLength; width <<= 1)
+    // leave the sorted items in the scratch buffer so the final merge can write them straight back
+    T* sorted = SortTiles(context->m_buffer1, context->m_buffer2, context->m_dataLength, context->m_tileLength, true);
+    if(sorted != context->m_buffer1)
     {
-        for(int i = 0; i < context->m_dataLength; i += (width << 1))
-        {
-            MergeMemcpy(context->m_buffer1, context->m_buffer2, i, std::min(i + width, context->m_dataLength), std::min(i + (width << 1), context->m_dataLength));
-        }
         std::swap(context->m_buffer1, context->m_buffer2);
     }
 
@@ -460,67 +773,84 @@ void SortJob(void* a_context)
 
 
 template<class T>
-void MergeFirstJob(void* a_context)
+void MultiwaySplitJob(void* a_context)
 {
-    MergeContext<T>* context = (MergeContext<T>*) a_context;
+    MultiwayMergeContext<T>* context = (MultiwayMergeContext<T>*) a_context;
 
-    MergeFirst(context->m_buffer1, context->m_buffer2, 0, context->m_right, context->m_end);
-    std::swap(context->m_buffer1, context->m_buffer2);
+    // find where this segment's part of each run starts
+    MultiwaySplit(context->m_source, context->m_runStart, context->m_numRuns, context->m_segmentStart, context->m_splitStart);
 
 	context->m_latch->Notify();
 }
 
 
+// Merges the parts of the runs that belong in one segment of the destination buffer.
 template<class T>
-void MergeSecondJob(void* a_context)
+inline void MultiwayMergeSegment(const MultiwayMergeContext<T>& a_context)
 {
-    MergeContext<T>* context = (MergeContext<T>*) a_context;
+    int numRuns = a_context.m_numRuns;
+
+    for(int i = 0; i < numRuns; ++i)
+    {
+        a_context.m_current[i] = a_context.m_source + a_context.m_runStart[i] + a_context.m_splitStart[i];
+        a_context.m_end[i] = a_context.m_source + a_context.m_runStart[i] + a_context.m_splitEnd[i];
+    }
+    MultiwayMergeRanges(a_context.m_current, a_context.m_end, numRuns, a_context.m_destination + a_context.m_segmentStart);
+}
+
+
+// Must not start until every MultiwaySplitJob() is finished, because it moves items out of the runs.
+template<class T>
+void MultiwayMergeJob(void* a_context)
+{
+    MultiwayMergeContext<T>* context = (MultiwayMergeContext<T>*) a_context;
 
-    MergeSecond(context->m_buffer1, context->m_buffer2, 0, context->m_right, context->m_end);
-    // don't need to swap the buffers because we ignore the buffers coming from the second jobs
+    MultiwayMergeSegment(*context);
 
 	context->m_latch->Notify();
 }
 
 
 template<class T>
-bool MergeSort<T>::SortMT(T* a_input, uint32_t a_length, JobQueue& a_jobQueue)
+bool MergeSort<T>::SortMT(T* a_input, size_t a_length, JobQueue& a_jobQueue)
 {
 
     // use a single thread for small sorts
-    const uint32_t minItemsPerThread = 256;
+    const size_t minItemsPerThread = 256;
     uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
     if(a_length < totalNumThreads * minItemsPerThread)
     {
         return SortUnrolledMemcpy(a_input, a_length);
     }
 
-    if(!EnsureBufferIsLargeEnough(a_length))
+    if(!EnsureBufferIsLargeEnough(a_length, true))
     {
         return false;
     }
 
-    // Keep a copy of the input array pointer and the scratch array. 
-    // These pointers are swapped for each iteration to avoid copying.
-    T* buffer1 = a_input;
-    T* buffer2 = m_scratchBuffer;
-
-    // First divide the list into a number of lists equal to the number of threads and sort them.
-    uint32_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    // First divide the list into a number of lists equal to the number of threads and sort them into the scratch buffer.
+    // A new scratch buffer hasn't been touched yet, so the thread that sorts each list is the first to write to its
+    // part of the buffer, and on a NUMA machine those pages are placed on that thread's node.
+    // runStart[i] is the offset of sorted list i, and runStart[numRuns] is the end of the data.
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
     std::unique_ptr<SortContext<T>[]> sortContext(new SortContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads + 1]);
 
 	CountLatch latch;
 
     // Dispatch work to threads
-    uint32_t itemsDispatched = 0;
+    size_t itemsDispatched = 0;
     for (uint32_t i = 0; i < totalNumThreads; ++i)
     {
-        int itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
 
-        sortContext[i].m_buffer1 = buffer1 + itemsDispatched;
-        sortContext[i].m_buffer2 = buffer2 + itemsDispatched;
+        sortContext[i].m_buffer1 = a_input + itemsDispatched;
+        sortContext[i].m_buffer2 = m_scratchBuffer + itemsDispatched;
         sortContext[i].m_dataLength = itemsForThread;
+        sortContext[i].m_tileLength = m_tileLength;
+        sortContext[i].m_constructLength = ScratchToConstruct(itemsForThread);
 		sortContext[i].m_latch = &latch;
+        runStart[i] = itemsDispatched;
         itemsDispatched += itemsForThread;
 
         if(i < a_jobQueue.NumThreads())
@@ -535,112 +865,1561 @@ bool MergeSort<T>::SortMT(T* a_input, uint32_t a_length, JobQueue& a_jobQueue)
             SortJob<T>(&sortContext[i]);
         }
     }
+    runStart[totalNumThreads] = a_length;
     
     // wait for all sorting to be done
 	latch.Wait(totalNumThreads);
+    FinishConstructingScratch(a_length);
 
-    // copy sorted contexts into merge contexts
-	std::unique_ptr<MergeContext<T>[]> mergeContext(new MergeContext<T>[totalNumThreads]);
+    // make sure every list ended up in the scratch buffer
     for(uint32_t i = 0; i < totalNumThreads; ++i)
     {
-        mergeContext[i].m_buffer1 = sortContext[i].m_buffer1;
-        mergeContext[i].m_buffer2 = sortContext[i].m_buffer2;
-        mergeContext[i].m_right = sortContext[i].m_dataLength;
-        mergeContext[i].m_end = sortContext[i].m_dataLength;
+        if(sortContext[i].m_buffer1 != m_scratchBuffer + runStart[i])
+        {
+            MoveItems(sortContext[i].m_buffer1, m_scratchBuffer + runStart[i], sortContext[i].m_dataLength);
+        }
     }
 
-    uint32_t totalMerges = totalNumThreads;
-    while(totalMerges > 1)
+    // Merge all the lists back into the input buffer in one pass, rather than in rounds of pairs that each read
+    // and write everything. Each thread writes its own segment of the output. First every thread searches the
+    // lists to find the parts of them that belong in its segment.
+	latch.Reset();
+    std::unique_ptr<MultiwayMergeContext<T>[]> mergeContext(new MultiwayMergeContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> splits(new size_t[(totalNumThreads + 1) * totalNumThreads]);
+    std::unique_ptr<T*[]> rangePointers(new T*[2 * totalNumThreads * totalNumThreads]); // m_current and m_end of every segment
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
     {
-        // there must be an even number of merges. Any left-over list can't be merged this iteration.
-        uint32_t numMerges = totalMerges >> 1;
-        totalMerges = (totalMerges + 1) >> 1;
-
-		latch.Reset();
-        uint32_t jobCount = 0;
+        MultiwayMergeContext<T>& context = mergeContext[i];
+        context.m_current = rangePointers.get() + 2 * i * totalNumThreads;
+        context.m_end = context.m_current + totalNumThreads;
+        context.m_source = m_scratchBuffer;
+        context.m_destination = a_input;
+        context.m_runStart = runStart.get();
+        context.m_numRuns = (int)totalNumThreads;
+        context.m_segmentStart = runStart[i];
+        context.m_segmentEnd = runStart[i + 1];
+        context.m_splitStart = splits.get() + i * totalNumThreads;
+        context.m_splitEnd = splits.get() + (i + 1) * totalNumThreads;
+		context.m_latch = &latch;
+    }
 
-        for(uint32_t i = 0; i < totalMerges; ++i)
-        {
-            if(i < numMerges)
-            {
-                // take the results of the previous iteration and create new merge contexts by merging 2 together.
-                mergeContext[i].m_buffer1 = mergeContext[i << 1].m_buffer1;
-                mergeContext[i].m_buffer2 = mergeContext[i << 1].m_buffer2;
-                mergeContext[i].m_right = mergeContext[i << 1].m_end;
-                mergeContext[i].m_end = mergeContext[i].m_right + mergeContext[(i << 1) + 1].m_end;
-				mergeContext[i].m_latch = &latch;
-
-                // submit 2 jobs for the merge context, each working from the other end of the list
-                {
-                    Job job;
-                    job.m_data = &mergeContext[i];
-                    job.m_function = &MergeFirstJob<T>;
-                    a_jobQueue.SubmitJob(job);
-					jobCount++;
-                }
-                if((i << 1) + 1 < a_jobQueue.NumThreads())
-                {
-                    Job job;
-                    job.m_data = &mergeContext[i];
-                    job.m_function = &MergeSecondJob<T>;
-                    a_jobQueue.SubmitJob(job);
-					jobCount++;
-                }
-                else
-                {
-                    MergeSecondJob<T>(&mergeContext[i]);
-					jobCount++;
-                }
-            }
-            else
-            {
-                // no work required
-                mergeContext[i].m_buffer1 = mergeContext[i << 1].m_buffer1;
-                mergeContext[i].m_buffer2 = mergeContext[i << 1].m_buffer2;
-                mergeContext[i].m_right = mergeContext[i << 1].m_end;
-                mergeContext[i].m_end = mergeContext[i << 1].m_end;
-            }
-        }
+    // the end of the last segment comes after everything
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        splits[totalNumThreads * totalNumThreads + i] = runStart[i + 1] - runStart[i];
+    }
 
-        // wait for all merging to be done
-		latch.Wait(jobCount);
+    // Submit all but the last segment, which this thread does itself, in one batch. Merging moves items out of the
+    // lists, which would change what the searches find, so the searches all have to finish first.
+    std::unique_ptr<Job[]> jobs(new Job[totalNumThreads]);
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+    {
+        jobs[i].m_data = &mergeContext[i];
+        jobs[i].m_function = &MultiwaySplitJob<T>;
     }
+    a_jobQueue.SubmitJobs(jobs.get(), totalNumThreads - 1);
+    MultiwaySplitJob<T>(&mergeContext[totalNumThreads - 1]);
+	latch.Wait(totalNumThreads);
 
-    // if the results are in the scratch buffer, copy them back into the input buffer
-    if(mergeContext[0].m_buffer1 == m_scratchBuffer)
+	latch.Reset();
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
     {
-        memcpy(a_input, mergeContext[0].m_buffer1, sizeof(T) * a_length);
+        jobs[i].m_function = &MultiwayMergeJob<T>;
     }
+    a_jobQueue.SubmitJobs(jobs.get(), totalNumThreads - 1);
+    MultiwayMergeJob<T>(&mergeContext[totalNumThreads - 1]);
+
+    // wait for all merging to be done
+	latch.Wait(totalNumThreads);
 
     return true;
 }
 
 
+// One part of a sort started by SortMTAsync(). The same part is the job for every stage of the sort.
 template<class T>
-bool MergeSort<T>::EnsureBufferIsLargeEnough(int a_length)
+struct AsyncSortPart
 {
-    if(m_scratchLength < a_length)
-    {
-        if(!m_autoAllocateScratch)
+    AsyncSortState<T>* m_state;
+    uint32_t m_index;
+};
+
+
+// Everything a sort started by SortMTAsync() needs while it runs on the job queue. Each stage is one job per part,
+// and the last job of a stage to finish submits the next stage, so no thread has to wait between the stages.
+template<class T>
+struct AsyncSortState
+{
+    JobQueue* m_jobQueue;
+    T* m_input;
+    T* m_scratchBuffer;
+    size_t m_tileLength;
+    bool m_constructScratch; // whether each part constructs the items of its part of a new scratch buffer first
+    uint32_t m_numParts;
+    std::unique_ptr<AsyncSortPart<T>[]> m_parts;
+    std::unique_ptr<size_t[]> m_runStart; // offsets to the parts, followed by the end of the data
+    std::unique_ptr<size_t[]> m_splits;
+    std::unique_ptr<T*[]> m_rangePointers; // m_current and m_end of every merge context
+    std::unique_ptr<MultiwayMergeContext<T>[]> m_mergeContext;
+    std::atomic<uint32_t> m_jobsLeft; // number of jobs of the current stage that haven't finished
+    CountLatch m_done; // notified once when the sort has finished
+};
+
+
+// Called at the end of every job of an async sort. The last job of the stage starts the next stage, or if there
+// isn't one, tells the future that the sort has finished.
+template<class T>
+void FinishAsyncSortStage(AsyncSortState<T>* a_state, void (*a_nextStage)(void*))
+{
+    if(a_state->m_jobsLeft.fetch_sub(1) != 1)
+    {
+        return;
+    }
+    if(a_nextStage == 0)
+    {
+		a_state->m_done.Notify();
+        return;
+    }
+
+    // The jobs can finish the sort, and the state can be freed, before the loop does. So the loop can't read it.
+    uint32_t numParts = a_state->m_numParts;
+    AsyncSortPart<T>* parts = a_state->m_parts.get();
+    JobQueue* jobQueue = a_state->m_jobQueue;
+    a_state->m_jobsLeft = numParts;
+    for(uint32_t i = 0; i < numParts; ++i)
+    {
+        Job job;
+        job.m_data = &parts[i];
+        job.m_function = a_nextStage;
+        jobQueue->SubmitJob(job);
+    }
+}
+
+
+// Must not start until every AsyncSplitJob() is finished, because it moves items out of the runs.
+template<class T>
+void AsyncMergeJob(void* a_context)
+{
+    AsyncSortPart<T>* part = (AsyncSortPart<T>*) a_context;
+    AsyncSortState<T>* state = part->m_state;
+
+    MultiwayMergeSegment(state->m_mergeContext[part->m_index]);
+
+    FinishAsyncSortStage(state, 0);
+}
+
+
+template<class T>
+void AsyncSplitJob(void* a_context)
+{
+    AsyncSortPart<T>* part = (AsyncSortPart<T>*) a_context;
+    AsyncSortState<T>* state = part->m_state;
+
+    const MultiwayMergeContext<T>& context = state->m_mergeContext[part->m_index];
+    MultiwaySplit(context.m_source, context.m_runStart, context.m_numRuns, context.m_segmentStart, context.m_splitStart);
+
+    FinishAsyncSortStage(state, &AsyncMergeJob<T>);
+}
+
+
+template<class T>
+void AsyncSortJob(void* a_context)
+{
+    AsyncSortPart<T>* part = (AsyncSortPart<T>*) a_context;
+    AsyncSortState<T>* state = part->m_state;
+
+    // Sort the part into the scratch buffer ready for the merge, or if it is the only part, back into the input.
+    bool merge = state->m_numParts > 1;
+    size_t start = state->m_runStart[part->m_index];
+    size_t length = state->m_runStart[part->m_index + 1] - start;
+    T* input = state->m_input + start;
+    T* scratch = state->m_scratchBuffer + start;
+    if(state->m_constructScratch)
+    {
+        ConstructScratchItems(scratch, length);
+    }
+    T* sorted = SortTiles(input, scratch, length, state->m_tileLength, merge);
+    T* target = merge ? scratch : input;
+    if(sorted != target)
+    {
+        MoveItems(sorted, target, length);
+    }
+
+    FinishAsyncSortStage(state, merge ? &AsyncSplitJob<T> : 0);
+}
+
+
+template<class T>
+bool MergeSort<T>::SortMTAsync(T* a_input, size_t a_length, JobQueue& a_jobQueue, SortFuture<T>& a_future)
+{
+    a_future.Wait();
+    a_future.m_state.reset();
+
+    // Sorts that are too small to split up are done on this thread, as in SortMT(). The queue's threads do
+    // all the work of larger sorts, so there is one part for each of them.
+    const size_t minItemsPerThread = 256;
+    uint32_t numParts = (uint32_t)a_jobQueue.NumThreads();
+    if(numParts == 0 || a_length < numParts * minItemsPerThread)
+    {
+        return SortUnrolledMemcpy(a_input, a_length);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length, true))
+    {
+        return false;
+    }
+
+    std::shared_ptr<AsyncSortState<T>> state(new AsyncSortState<T>);
+    state->m_jobQueue = &a_jobQueue;
+    state->m_input = a_input;
+    state->m_scratchBuffer = m_scratchBuffer;
+    state->m_tileLength = m_tileLength;
+    state->m_constructScratch = !m_scratchConstructed;
+    state->m_numParts = numParts;
+    state->m_parts.reset(new AsyncSortPart<T>[numParts]);
+    state->m_runStart.reset(new size_t[numParts + 1]);
+    state->m_splits.reset(new size_t[(numParts + 1) * numParts]);
+    state->m_rangePointers.reset(new T*[2 * numParts * numParts]);
+    state->m_mergeContext.reset(new MultiwayMergeContext<T>[numParts]);
+    state->m_jobsLeft = numParts;
+
+    // divide the list between the parts, and set up the merge the same way as SortMT()
+    size_t maxItemsPerPart = (a_length + numParts - 1) / numParts;
+    for(uint32_t i = 0; i < numParts; ++i)
+    {
+        state->m_parts[i].m_state = state.get();
+        state->m_parts[i].m_index = i;
+        state->m_runStart[i] = std::min(i * maxItemsPerPart, a_length);
+    }
+    state->m_runStart[numParts] = a_length;
+
+    for(uint32_t i = 0; i < numParts; ++i)
+    {
+        MultiwayMergeContext<T>& context = state->m_mergeContext[i];
+        context.m_source = m_scratchBuffer;
+        context.m_destination = a_input;
+        context.m_runStart = state->m_runStart.get();
+        context.m_numRuns = (int)numParts;
+        context.m_segmentStart = state->m_runStart[i];
+        context.m_segmentEnd = state->m_runStart[i + 1];
+        context.m_splitStart = state->m_splits.get() + i * numParts;
+        context.m_splitEnd = state->m_splits.get() + (i + 1) * numParts;
+        context.m_current = state->m_rangePointers.get() + 2 * i * numParts;
+        context.m_end = context.m_current + numParts;
+        context.m_latch = 0;
+        state->m_splits[numParts * numParts + i] = state->m_runStart[i + 1] - state->m_runStart[i];
+    }
+
+    AsyncSortPart<T>* parts = state->m_parts.get();
+    m_asyncSort = state;
+    a_future.m_state = std::move(state);
+    for(uint32_t i = 0; i < numParts; ++i)
+    {
+        Job job;
+        job.m_data = &parts[i];
+        job.m_function = &AsyncSortJob<T>;
+        a_jobQueue.SubmitJob(job);
+    }
+
+    // the parts only construct the scratch items they sort into, and the rest are past the end of the data
+    FinishConstructingScratch(a_length);
+
+    return true;
+}
+
+
+template<class T>
+SortFuture<T>::~SortFuture()
+{
+    Wait();
+}
+
+
+template<class T>
+bool SortFuture<T>::IsDone()
+{
+    return !m_state || m_state->m_done.TryWait(1);
+}
+
+
+template<class T>
+void SortFuture<T>::Wait()
+{
+    if(m_state)
+    {
+		m_state->m_done.Wait(1);
+    }
+}
+
+
+template<class T>
+bool MergeSort<T>::SortAdaptive(T* a_input, size_t a_length)
+{
+    if(!EnsureBufferIsLargeEnough(a_length / 2))
+    {
+        return false;
+    }
+
+    SortRunsAdaptive(a_input, a_length, m_scratchBuffer);
+    return true;
+}
+
+
+// m_buffer1 is the part of the input to sort and m_buffer2 is the scratch space for it.
+// This is a job of a JobGraph, which keeps track of when it finishes, so m_latch isn't used.
+template<class T>
+void SortAdaptiveJob(void* a_context)
+{
+    SortContext<T>* context = (SortContext<T>*) a_context;
+
+    ConstructScratchItems(context->m_buffer2, context->m_constructLength);
+    SortRunsAdaptive(context->m_buffer1, context->m_dataLength, context->m_buffer2);
+}
+
+
+// m_buffer1 is the input and m_buffer2 is scratch space for this merge. Also a job of a JobGraph.
+template<class T>
+void MergeAdaptiveJob(void* a_context)
+{
+    MergeContext<T>* context = (MergeContext<T>*) a_context;
+
+    MergeRunsGalloping(context->m_buffer1, context->m_left, context->m_right, context->m_end, context->m_buffer2);
+}
+
+
+template<class T>
+bool MergeSort<T>::SortAdaptiveMT(T* a_input, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use a single thread for small sorts
+    const size_t minItemsPerThread = 256;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread)
+    {
+        return SortAdaptive(a_input, a_length);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length / 2, true))
+    {
+        return false;
+    }
+
+    // Each part of the input, and later each merge, uses the part of the scratch buffer at half its offset.
+    // A merge never needs more than half its length, so these never overlap. Each part constructs the scratch
+    // items up to half the offset of the next part, which covers every merge that waits for it.
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<SortContext<T>[]> sortContext(new SortContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads + 1]);
+    std::unique_ptr<size_t[]> runJob(new size_t[totalNumThreads]); // the job in the graph that finishes each run
+
+    // The sorts and merges are all one graph of jobs, so each merge starts as soon as the two runs it needs are
+    // done, rather than waiting for every merge of the round before.
+    JobGraph graph;
+    size_t itemsDispatched = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+
+        sortContext[i].m_buffer1 = a_input + itemsDispatched;
+        sortContext[i].m_buffer2 = m_scratchBuffer + (itemsDispatched >> 1);
+        sortContext[i].m_dataLength = itemsForThread;
+        sortContext[i].m_tileLength = m_tileLength;
+        sortContext[i].m_constructLength = ScratchToConstruct(((itemsDispatched + itemsForThread) >> 1) - (itemsDispatched >> 1));
+		sortContext[i].m_latch = 0;
+        runStart[i] = itemsDispatched;
+        itemsDispatched += itemsForThread;
+
+        Job job;
+        job.m_data = &sortContext[i];
+        job.m_function = &SortAdaptiveJob<T>;
+        runJob[i] = graph.AddJob(job);
+    }
+    runStart[totalNumThreads] = a_length;
+
+    // merge neighbouring pairs of parts until there is only one (a tree of n parts has n - 1 merges)
+    std::unique_ptr<MergeContext<T>[]> mergeContext(new MergeContext<T>[totalNumThreads]);
+    uint32_t numMerges = 0;
+    uint32_t numRuns = totalNumThreads;
+    while(numRuns > 1)
+    {
+        // the merged parts start where every second part used to start, and an odd part at the end is left as it is
+        for(uint32_t i = 0; i < numRuns; i += 2)
+        {
+            if(i + 1 < numRuns)
+            {
+                MergeContext<T>& context = mergeContext[numMerges++];
+                context.m_left = runStart[i];
+                context.m_right = runStart[i + 1];
+                context.m_end = runStart[i + 2];
+                context.m_buffer1 = a_input;
+                context.m_buffer2 = m_scratchBuffer + (context.m_left >> 1);
+				context.m_latch = 0;
+
+                Job job;
+                job.m_data = &context;
+                job.m_function = &MergeAdaptiveJob<T>;
+                size_t merge = graph.AddJob(job);
+                graph.AddDependency(runJob[i], merge);
+                graph.AddDependency(runJob[i + 1], merge);
+                runJob[i >> 1] = merge;
+            }
+            else
+            {
+                runJob[i >> 1] = runJob[i];
+            }
+            runStart[i >> 1] = runStart[i];
+        }
+        numRuns = (numRuns + 1) >> 1;
+        runStart[numRuns] = a_length;
+    }
+
+    // this thread sorts the last part, and then does whichever merges that makes ready
+    graph.Run(a_jobQueue);
+    FinishConstructingScratch(a_length >> 1);
+
+    return true;
+}
+
+
+template<class T>
+bool MergeSort<T>::SortLowMemory(T* a_input, size_t a_length)
+{
+    if(!EnsureBufferIsLargeEnough(LowMemoryTempLength(a_length)))
+    {
+        return false;
+    }
+
+    SortRunsAdaptive(a_input, a_length, m_scratchBuffer, m_scratchLength);
+    return true;
+}
+
+
+// m_buffer1 is the part of the input to sort and m_buffer2 is the scratch space for it, which may be small.
+// This is a job of a JobGraph, which keeps track of when it finishes, so m_latch isn't used.
+template<class T>
+void SortLowMemoryJob(void* a_context)
+{
+    SortContext<T>* context = (SortContext<T>*) a_context;
+
+    ConstructScratchItems(context->m_buffer2, context->m_constructLength);
+    SortRunsAdaptive(context->m_buffer1, context->m_dataLength, context->m_buffer2, context->m_scratchLength);
+}
+
+
+// m_buffer1 is the input and m_buffer2 is scratch space for this merge, which may be small. Also a job of a JobGraph.
+template<class T>
+void MergeLowMemoryJob(void* a_context)
+{
+    MergeContext<T>* context = (MergeContext<T>*) a_context;
+
+    MergeRunsBuffered(context->m_buffer1, context->m_left, context->m_right, context->m_end, context->m_buffer2, context->m_scratchLength);
+}
+
+
+template<class T>
+bool MergeSort<T>::SortLowMemoryMT(T* a_input, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use a single thread for small sorts
+    const size_t minItemsPerThread = 256;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread)
+    {
+        return SortLowMemory(a_input, a_length);
+    }
+
+    // Each part of the input, and later each merge, gets the share of the scratch buffer in proportion to where its
+    // items are in the input. Parts and merges that can run at the same time cover different items, so their
+    // scratch never overlaps, and as merges finish the shares get bigger. The shares of the parts cover the whole
+    // buffer, so each part constructs the scratch items of its own share.
+    if(!EnsureBufferIsLargeEnough(LowMemoryTempLength(a_length) * totalNumThreads, true))
+    {
+        return false;
+    }
+
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<SortContext<T>[]> sortContext(new SortContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads + 1]);
+    std::unique_ptr<size_t[]> runJob(new size_t[totalNumThreads]); // the job in the graph that finishes each run
+
+    // The sorts and merges are all one graph of jobs, so each merge starts as soon as the two runs it needs are
+    // done, rather than waiting for every merge of the round before.
+    JobGraph graph;
+    size_t itemsDispatched = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+        size_t scratchStart = ScratchShare(itemsDispatched, a_length);
+
+        sortContext[i].m_buffer1 = a_input + itemsDispatched;
+        sortContext[i].m_buffer2 = m_scratchBuffer + scratchStart;
+        sortContext[i].m_dataLength = itemsForThread;
+        sortContext[i].m_tileLength = m_tileLength;
+        sortContext[i].m_scratchLength = ScratchShare(itemsDispatched + itemsForThread, a_length) - scratchStart;
+        sortContext[i].m_constructLength = ScratchToConstruct(sortContext[i].m_scratchLength);
+		sortContext[i].m_latch = 0;
+        runStart[i] = itemsDispatched;
+        itemsDispatched += itemsForThread;
+
+        Job job;
+        job.m_data = &sortContext[i];
+        job.m_function = &SortLowMemoryJob<T>;
+        runJob[i] = graph.AddJob(job);
+    }
+    runStart[totalNumThreads] = a_length;
+
+    // merge neighbouring pairs of parts until there is only one (a tree of n parts has n - 1 merges)
+    std::unique_ptr<MergeContext<T>[]> mergeContext(new MergeContext<T>[totalNumThreads]);
+    uint32_t numMerges = 0;
+    uint32_t numRuns = totalNumThreads;
+    while(numRuns > 1)
+    {
+        // the merged parts start where every second part used to start, and an odd part at the end is left as it is
+        for(uint32_t i = 0; i < numRuns; i += 2)
+        {
+            if(i + 1 < numRuns)
+            {
+                MergeContext<T>& context = mergeContext[numMerges++];
+                context.m_left = runStart[i];
+                context.m_right = runStart[i + 1];
+                context.m_end = runStart[i + 2];
+                size_t scratchStart = ScratchShare(context.m_left, a_length);
+                context.m_buffer1 = a_input;
+                context.m_buffer2 = m_scratchBuffer + scratchStart;
+                context.m_scratchLength = ScratchShare(context.m_end, a_length) - scratchStart;
+				context.m_latch = 0;
+
+                Job job;
+                job.m_data = &context;
+                job.m_function = &MergeLowMemoryJob<T>;
+                size_t merge = graph.AddJob(job);
+                graph.AddDependency(runJob[i], merge);
+                graph.AddDependency(runJob[i + 1], merge);
+                runJob[i >> 1] = merge;
+            }
+            else
+            {
+                runJob[i >> 1] = runJob[i];
+            }
+            runStart[i >> 1] = runStart[i];
+        }
+        numRuns = (numRuns + 1) >> 1;
+        runStart[numRuns] = a_length;
+    }
+
+    // this thread sorts the last part, and then does whichever merges that makes ready
+    graph.Run(a_jobQueue);
+    FinishConstructingScratch(m_scratchLength);
+
+    return true;
+}
+
+
+template<class T>
+bool MergeSort<T>::SortSegments(T* a_input, const size_t* a_segmentStart, size_t a_numSegments)
+{
+    if(!EnsureBufferIsLargeEnough(a_segmentStart[a_numSegments]))
+    {
+        return false;
+    }
+
+    SortSegmentRange(a_input, m_scratchBuffer, a_segmentStart, 0, a_numSegments, m_tileLength, a_segmentStart[a_numSegments]);
+    return true;
+}
+
+
+template<class T>
+void SortSegmentsJob(void* a_context)
+{
+    SegmentContext<T>* context = (SegmentContext<T>*) a_context;
+
+    SortSegmentRange(context->m_input, context->m_scratchBuffer, context->m_segmentStart, context->m_firstSegment,
+        context->m_endSegment, context->m_tileLength, context->m_maxLength);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+bool MergeSort<T>::SortSegmentsMT(T* a_input, const size_t* a_segmentStart, size_t a_numSegments, JobQueue& a_jobQueue)
+{
+    // the groups of segments are jobs, which need other threads to run them
+    if(a_jobQueue.NumThreads() == 0)
+    {
+        return SortSegments(a_input, a_segmentStart, a_numSegments);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_segmentStart[a_numSegments]))
+    {
+        return false;
+    }
+
+    // A segment with a whole thread's share of the items would hold up the job it was in, so sort each of those
+    // with all the threads first.
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    size_t totalLength = a_segmentStart[a_numSegments] - a_segmentStart[0];
+    size_t maxLength = std::max<size_t>(totalLength / totalNumThreads, SORT_NETWORK_LENGTH);
+    size_t otherLength = totalLength;
+    for(size_t i = 0; i < a_numSegments; ++i)
+    {
+        size_t length = a_segmentStart[i + 1] - a_segmentStart[i];
+        if(length > maxLength)
+        {
+            SortMT(a_input + a_segmentStart[i], length, a_jobQueue);
+            otherLength -= length;
+        }
+    }
+
+    // Group the rest into jobs with about the same number of items. There are a few jobs per thread, so threads
+    // that get groups which sort faster than the others take more of them.
+    const size_t jobsPerThread = 4;
+    const size_t minItemsPerJob = 4096;
+    size_t itemsPerJob = std::max(otherLength / (totalNumThreads * jobsPerThread), minItemsPerJob);
+    std::vector<SegmentContext<T>> segmentContext;
+
+	CountLatch latch;
+
+    size_t firstSegment = 0;
+    size_t itemsInJob = 0;
+    for(size_t i = 0; i < a_numSegments; ++i)
+    {
+        size_t length = a_segmentStart[i + 1] - a_segmentStart[i];
+        if(length <= maxLength)
+        {
+            itemsInJob += length;
+        }
+        if(itemsInJob >= itemsPerJob || i + 1 == a_numSegments)
+        {
+            SegmentContext<T> context;
+            context.m_input = a_input;
+            context.m_scratchBuffer = m_scratchBuffer;
+            context.m_segmentStart = a_segmentStart;
+            context.m_firstSegment = firstSegment;
+            context.m_endSegment = i + 1;
+            context.m_tileLength = m_tileLength;
+            context.m_maxLength = maxLength;
+            context.m_latch = &latch;
+            segmentContext.push_back(context);
+            firstSegment = i + 1;
+            itemsInJob = 0;
+        }
+    }
+
+    // submit all but the last group, which this thread does itself
+    for(size_t i = 0; i + 1 < segmentContext.size(); ++i)
+    {
+        Job job;
+        job.m_data = &segmentContext[i];
+        job.m_function = &SortSegmentsJob<T>;
+        a_jobQueue.SubmitJob(job);
+    }
+    if(!segmentContext.empty())
+    {
+        SortSegmentsJob<T>(&segmentContext.back());
+    }
+
+    // wait for all sorting to be done
+	latch.Wait((int)segmentContext.size());
+
+    return true;
+}
+
+
+template<class T>
+void TopKJob(void* a_context)
+{
+    TopKContext<T>* context = (TopKContext<T>*) a_context;
+    const T* input = context->m_input;
+    T* heap = context->m_heap;
+    size_t k = context->m_k;
+
+    // Keep the k smallest items in a max heap. Once the heap has seen a lot of items, few items are smaller than
+    // its largest one, so most items are only compared once.
+    for(size_t i = 0; i < k; ++i)
+    {
+        heap[i] = input[i];
+    }
+    std::make_heap(heap, heap + k);
+    for(size_t i = k; i < context->m_length; ++i)
+    {
+        if(input[i] < heap[0])
+        {
+            std::pop_heap(heap, heap + k);
+            heap[k - 1] = input[i];
+            std::push_heap(heap, heap + k);
+        }
+    }
+    std::sort_heap(heap, heap + k);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+bool MergeSort<T>::TopKMT(const T* a_input, size_t a_length, size_t a_k, T* a_output, JobQueue& a_jobQueue)
+{
+    a_k = std::min(a_k, a_length);
+    if(a_k == 0)
+    {
+        return true;
+    }
+
+    // use a single thread for small inputs
+    const size_t minItemsPerThread = 4096;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread)
+    {
+        totalNumThreads = 1;
+    }
+
+    // every thread keeps up to a_k items in its own part of the scratch buffer
+    if(!EnsureBufferIsLargeEnough(a_k * totalNumThreads))
+    {
+        return false;
+    }
+
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<TopKContext<T>[]> topKContext(new TopKContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads + 1]);
+
+	CountLatch latch;
+
+    // Dispatch work to threads
+    size_t itemsDispatched = 0;
+    size_t heapStart = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+
+        topKContext[i].m_input = a_input + itemsDispatched;
+        topKContext[i].m_length = itemsForThread;
+        topKContext[i].m_heap = m_scratchBuffer + heapStart;
+        topKContext[i].m_k = std::min(a_k, itemsForThread);
+		topKContext[i].m_latch = &latch;
+        runStart[i] = heapStart;
+        itemsDispatched += itemsForThread;
+        heapStart += topKContext[i].m_k;
+
+        if(i + 1 < totalNumThreads)
+        {
+            Job job;
+            job.m_data = &topKContext[i];
+            job.m_function = &TopKJob<T>;
+            a_jobQueue.SubmitJob(job);
+        }
+        else
+        {
+            TopKJob<T>(&topKContext[i]);
+        }
+    }
+    runStart[totalNumThreads] = heapStart;
+
+    // wait for all the heaps to be sorted
+	latch.Wait(totalNumThreads);
+
+    // the smallest a_k items are the first of each sorted heap, up to where the merged result reaches a_k
+    std::unique_ptr<size_t[]> splits(new size_t[totalNumThreads]);
+    std::unique_ptr<T*[]> current(new T*[totalNumThreads]);
+    std::unique_ptr<T*[]> end(new T*[totalNumThreads]);
+    MultiwaySplit(m_scratchBuffer, runStart.get(), (int)totalNumThreads, a_k, splits.get());
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        current[i] = m_scratchBuffer + runStart[i];
+        end[i] = current[i] + splits[i];
+    }
+    MultiwayMergeRanges(current.get(), end.get(), (int)totalNumThreads, a_output);
+
+    return true;
+}
+
+
+template<class T>
+void PartitionCountJob(void* a_context)
+{
+    PartitionContext<T>* context = (PartitionContext<T>*) a_context;
+    const T& low = *context->m_low;
+    const T& high = *context->m_high;
+
+    size_t count[3] = { 0, 0, 0 };
+    for(size_t i = 0; i < context->m_length; ++i)
+    {
+        const T& item = context->m_input[i];
+        count[item < low ? 0 : (high < item ? 2 : 1)]++;
+    }
+    context->m_count[0] = count[0];
+    context->m_count[1] = count[1];
+    context->m_count[2] = count[2];
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void PartitionMoveJob(void* a_context)
+{
+    PartitionContext<T>* context = (PartitionContext<T>*) a_context;
+    const T& low = *context->m_low;
+    const T& high = *context->m_high;
+
+    T* destination[3] = { context->m_destination[0], context->m_destination[1], context->m_destination[2] };
+    for(size_t i = 0; i < context->m_length; ++i)
+    {
+        T& item = context->m_input[i];
+        *destination[item < low ? 0 : (high < item ? 2 : 1)]++ = std::move(item);
+    }
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void PartitionMoveBackJob(void* a_context)
+{
+    PartitionContext<T>* context = (PartitionContext<T>*) a_context;
+
+    MoveItems(context->m_partitioned, context->m_input, context->m_length);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+bool MergeSort<T>::NthElementMT(T* a_input, size_t a_length, size_t a_nth, JobQueue& a_jobQueue)
+{
+    if(a_nth >= a_length)
+    {
+        return true;
+    }
+
+    const size_t minItemsPerThread = 16384;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length >= totalNumThreads * minItemsPerThread && !EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    // Every round partitions the items of [begin, end) into those less than a low pivot, those greater than a high
+    // pivot, and the rest, and then carries on with whichever part holds a_nth. The pivots are chosen from a sorted
+    // sample so that a_nth very likely falls between them, and only about 4 / sqrt(sampleLength) of the items do.
+    const size_t sampleLength = 4096;
+    const size_t sampleMargin = 128;
+    std::unique_ptr<PartitionContext<T>[]> partitionContext(new PartitionContext<T>[totalNumThreads]);
+    std::vector<T> sample(sampleLength);
+    size_t begin = 0;
+    size_t end = a_length;
+    uint32_t random = 12345;
+
+	CountLatch latch;
+
+    while(end - begin >= totalNumThreads * minItemsPerThread)
+    {
+        size_t length = end - begin;
+        for(size_t i = 0; i < sampleLength; ++i)
+        {
+            random = random * 1664525 + 1013904223;
+            sample[i] = a_input[begin + (size_t)(((uint64_t)random * length) >> 32)];
+        }
+        std::sort(sample.begin(), sample.end());
+        size_t sampleRank = (size_t)((double)(a_nth - begin) / length * sampleLength);
+        const T& low = sample[sampleRank > sampleMargin ? sampleRank - sampleMargin : 0];
+        const T& high = sample[std::min(sampleRank + sampleMargin, sampleLength - 1)];
+
+        size_t maxItemsPerThread = (length + totalNumThreads - 1) / totalNumThreads;
+        size_t itemsDispatched = 0;
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            size_t itemsForThread = std::min(maxItemsPerThread, length - itemsDispatched);
+
+            PartitionContext<T>& context = partitionContext[i];
+            context.m_input = a_input + begin + itemsDispatched;
+            context.m_partitioned = m_scratchBuffer + itemsDispatched;
+            context.m_length = itemsForThread;
+            context.m_low = &low;
+            context.m_high = &high;
+            context.m_latch = &latch;
+            itemsDispatched += itemsForThread;
+        }
+
+        // count each thread's items in each part
+		latch.Reset();
+        for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+        {
+            Job job;
+            job.m_data = &partitionContext[i];
+            job.m_function = &PartitionCountJob<T>;
+            a_jobQueue.SubmitJob(job);
+        }
+        PartitionCountJob<T>(&partitionContext[totalNumThreads - 1]);
+		latch.Wait(totalNumThreads);
+
+        // each part is written to the scratch buffer with the items of each thread one after another
+        size_t partStart[4] = { 0, 0, 0, 0 };
+        for(int part = 0; part < 3; ++part)
+        {
+            size_t offset = partStart[part];
+            for(uint32_t i = 0; i < totalNumThreads; ++i)
+            {
+                partitionContext[i].m_destination[part] = m_scratchBuffer + offset;
+                offset += partitionContext[i].m_count[part];
+            }
+            partStart[part + 1] = offset;
+        }
+
+		latch.Reset();
+        for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+        {
+            Job job;
+            job.m_data = &partitionContext[i];
+            job.m_function = &PartitionMoveJob<T>;
+            a_jobQueue.SubmitJob(job);
+        }
+        PartitionMoveJob<T>(&partitionContext[totalNumThreads - 1]);
+		latch.Wait(totalNumThreads);
+
+		latch.Reset();
+        for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+        {
+            Job job;
+            job.m_data = &partitionContext[i];
+            job.m_function = &PartitionMoveBackJob<T>;
+            a_jobQueue.SubmitJob(job);
+        }
+        PartitionMoveBackJob<T>(&partitionContext[totalNumThreads - 1]);
+		latch.Wait(totalNumThreads);
+
+        // carry on with the part that holds a_nth
+        int part = 0;
+        while(begin + partStart[part + 1] <= a_nth)
+        {
+            ++part;
+        }
+        if(part == 1 && !(low < high))
+        {
+            // the middle part is all equal to the pivots, so every item is already in place
+            return true;
+        }
+        if(partStart[part + 1] - partStart[part] == length)
+        {
+            // the pivots didn't split anything off, which happens when there are few different items
+            break;
+        }
+        end = begin + partStart[part + 1];
+        begin += partStart[part];
+    }
+
+    std::nth_element(a_input + begin, a_input + a_nth, a_input + end);
+    return true;
+}
+
+
+template<class T>
+bool MergeSort<T>::PartialSortMT(T* a_input, size_t a_length, size_t a_k, JobQueue& a_jobQueue)
+{
+    a_k = std::min(a_k, a_length);
+    if(a_k == 0)
+    {
+        return true;
+    }
+
+    // put the a_k smallest items first, and then sort just those
+    if(!NthElementMT(a_input, a_length, a_k - 1, a_jobQueue))
+    {
+        return false;
+    }
+    return SortMT(a_input, a_k, a_jobQueue);
+}
+
+
+// Removes the repeats from the sorted items in place, keeping the first of each group of equal items, and returns
+// the number of items left. If a_counts isn't 0, a_counts[i] is set to the number of times item i came up.
+template<class T>
+inline size_t UniqueItems(T* a_items, size_t a_length, size_t* a_counts)
+{
+    if(a_length == 0)
+    {
+        return 0;
+    }
+    size_t unique = 0;
+    size_t groupStart = 0;
+    for(size_t i = 1; i < a_length; ++i)
+    {
+        if(a_items[unique] < a_items[i])
+        {
+            if(a_counts != 0)
+            {
+                a_counts[unique] = i - groupStart;
+            }
+            groupStart = i;
+            if(++unique != i)
+            {
+                a_items[unique] = std::move(a_items[i]);
+            }
+        }
+    }
+    if(a_counts != 0)
+    {
+        a_counts[unique] = a_length - groupStart;
+    }
+    return unique + 1;
+}
+
+
+template<class T>
+bool MergeSort<T>::SortUnique(T* a_input, size_t a_length, size_t& a_uniqueLength, size_t* a_counts)
+{
+    if(!SortUnrolledMemcpy(a_input, a_length))
+    {
+        return false;
+    }
+    a_uniqueLength = UniqueItems(a_input, a_length, a_counts);
+    return true;
+}
+
+
+template<class T>
+void SortUniqueJob(void* a_context)
+{
+    UniqueSortContext<T>* context = (UniqueSortContext<T>*) a_context;
+    SortContext<T>& sort = context->m_sort;
+
+    ConstructScratchItems(sort.m_buffer2, sort.m_constructLength);
+
+    // sort the part into the scratch buffer, and then remove the repeats while it is still warm in the cache
+    T* sorted = SortTiles(sort.m_buffer1, sort.m_buffer2, sort.m_dataLength, sort.m_tileLength, true);
+    if(sorted != sort.m_buffer2)
+    {
+        MoveItems(sorted, sort.m_buffer2, sort.m_dataLength);
+    }
+    context->m_uniqueLength = UniqueItems(sort.m_buffer2, sort.m_dataLength, context->m_counts);
+
+	sort.m_latch->Notify();
+}
+
+
+template<class T>
+void UniqueSplitJob(void* a_context)
+{
+    UniqueMergeContext<T>* context = (UniqueMergeContext<T>*) a_context;
+
+    // find where this segment's part of each run starts
+    MultiwaySplit(context->m_source, context->m_runStart, context->m_runEnd, context->m_numRuns, context->m_segmentStart, context->m_splitStart);
+
+	context->m_latch->Notify();
+}
+
+
+// Must not start until every UniqueSplitJob() is finished, because it moves items out of the runs.
+template<class T>
+void UniqueMergeJob(void* a_context)
+{
+    UniqueMergeContext<T>* context = (UniqueMergeContext<T>*) a_context;
+    int numRuns = context->m_numRuns;
+
+    std::unique_ptr<T*[]> current(new T*[numRuns]);
+    std::unique_ptr<T*[]> end(new T*[numRuns]);
+    std::unique_ptr<size_t*[]> currentCount(new size_t*[numRuns]);
+    for(int i = 0; i < numRuns; ++i)
+    {
+        current[i] = context->m_source + context->m_runStart[i] + context->m_splitStart[i];
+        end[i] = context->m_source + context->m_runStart[i] + context->m_splitEnd[i];
+        currentCount[i] = (context->m_runCounts != 0) ? context->m_runCounts + context->m_runStart[i] + context->m_splitStart[i] : 0;
+    }
+    size_t* destinationCounts = (context->m_destinationCounts != 0) ? context->m_destinationCounts + context->m_segmentStart : 0;
+    context->m_uniqueLength = MultiwayMergeUnique(current.get(), end.get(), (context->m_runCounts != 0) ? currentCount.get() : 0,
+        numRuns, context->m_destination + context->m_segmentStart, destinationCounts);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+bool MergeSort<T>::SortUniqueMT(T* a_input, size_t a_length, JobQueue& a_jobQueue, size_t& a_uniqueLength, size_t* a_counts)
+{
+    // use a single thread for small sorts
+    const size_t minItemsPerThread = 256;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread)
+    {
+        return SortUnique(a_input, a_length, a_uniqueLength, a_counts);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length, true))
+    {
+        return false;
+    }
+
+    // Sort each part into the scratch buffer and remove its repeats, as in SortMT(). The counts of each part go in
+    // a buffer alongside the scratch buffer.
+    std::unique_ptr<size_t[]> runCounts(a_counts != 0 ? new size_t[a_length] : 0);
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<UniqueSortContext<T>[]> sortContext(new UniqueSortContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> runStart(new size_t[totalNumThreads]);
+    std::unique_ptr<size_t[]> runEnd(new size_t[totalNumThreads]);
+
+	CountLatch latch;
+
+    // Dispatch work to threads
+    size_t itemsDispatched = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t itemsForThread = std::min(maxItemsPerThread, a_length - itemsDispatched);
+
+        SortContext<T>& sort = sortContext[i].m_sort;
+        sort.m_buffer1 = a_input + itemsDispatched;
+        sort.m_buffer2 = m_scratchBuffer + itemsDispatched;
+        sort.m_dataLength = itemsForThread;
+        sort.m_tileLength = m_tileLength;
+        sort.m_constructLength = ScratchToConstruct(itemsForThread);
+		sort.m_latch = &latch;
+        sortContext[i].m_counts = runCounts ? runCounts.get() + itemsDispatched : 0;
+        runStart[i] = itemsDispatched;
+        itemsDispatched += itemsForThread;
+
+        if(i < a_jobQueue.NumThreads())
+        {
+            Job job;
+            job.m_data = &sortContext[i];
+            job.m_function = &SortUniqueJob<T>;
+            a_jobQueue.SubmitJob(job);
+        }
+        else
+        {
+            SortUniqueJob<T>(&sortContext[i]);
+        }
+    }
+
+    // wait for all sorting to be done
+	latch.Wait(totalNumThreads);
+    FinishConstructingScratch(a_length);
+
+    size_t totalUnique = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        runEnd[i] = runStart[i] + sortContext[i].m_uniqueLength;
+        totalUnique += sortContext[i].m_uniqueLength;
+    }
+
+    // Merge the unique items of every part back into the input, each thread writing its own segment, the same way as
+    // SortMT(). The segments are cut by position in the merged result of the parts, and each one writes fewer items
+    // than that when the parts have items in common.
+	latch.Reset();
+    std::unique_ptr<UniqueMergeContext<T>[]> mergeContext(new UniqueMergeContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> splits(new size_t[(totalNumThreads + 1) * totalNumThreads]);
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        UniqueMergeContext<T>& context = mergeContext[i];
+        context.m_source = m_scratchBuffer;
+        context.m_destination = a_input;
+        context.m_runStart = runStart.get();
+        context.m_runEnd = runEnd.get();
+        context.m_runCounts = runCounts.get();
+        context.m_destinationCounts = a_counts;
+        context.m_numRuns = (int)totalNumThreads;
+        context.m_segmentStart = totalUnique * i / totalNumThreads;
+        context.m_splitStart = splits.get() + i * totalNumThreads;
+        context.m_splitEnd = splits.get() + (i + 1) * totalNumThreads;
+		context.m_latch = &latch;
+
+        // the end of the last segment comes after everything
+        splits[totalNumThreads * totalNumThreads + i] = runEnd[i] - runStart[i];
+    }
+
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+    {
+        Job job;
+        job.m_data = &mergeContext[i];
+        job.m_function = &UniqueSplitJob<T>;
+        a_jobQueue.SubmitJob(job);
+    }
+    UniqueSplitJob<T>(&mergeContext[totalNumThreads - 1]);
+	latch.Wait(totalNumThreads);
+
+	latch.Reset();
+    for(uint32_t i = 0; i + 1 < totalNumThreads; ++i)
+    {
+        Job job;
+        job.m_data = &mergeContext[i];
+        job.m_function = &UniqueMergeJob<T>;
+        a_jobQueue.SubmitJob(job);
+    }
+    UniqueMergeJob<T>(&mergeContext[totalNumThreads - 1]);
+
+    // wait for all merging to be done
+	latch.Wait(totalNumThreads);
+
+    // Close up the gaps between the segments. Each segment has no repeats of its own, but its first item may be
+    // the same as the last item of the segments before it.
+    size_t uniqueLength = 0;
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        UniqueMergeContext<T>& context = mergeContext[i];
+        T* segment = a_input + context.m_segmentStart;
+        size_t length = context.m_uniqueLength;
+        size_t skip = 0;
+        if(length > 0 && uniqueLength > 0 && !(a_input[uniqueLength - 1] < segment[0]))
+        {
+            if(a_counts != 0)
+            {
+                a_counts[uniqueLength - 1] += a_counts[context.m_segmentStart];
+            }
+            skip = 1;
+        }
+        if(uniqueLength != context.m_segmentStart + skip)
+        {
+            MoveItemsOverlapping(segment + skip, a_input + uniqueLength, length - skip);
+            if(a_counts != 0)
+            {
+                memmove(a_counts + uniqueLength, a_counts + context.m_segmentStart + skip, sizeof(size_t) * (length - skip));
+            }
+        }
+        uniqueLength += length - skip;
+    }
+    a_uniqueLength = uniqueLength;
+
+    return true;
+}
+
+
+// Returns the bucket of an item for SortSampleMT(). With splitters s0 < s1 < ..., bucket 0 holds the items less
+// than s0, bucket 1 the items equal to s0, bucket 2 the items between s0 and s1, and so on.
+template<class T>
+inline int SampleSortBucket(const T& a_item, const T* a_splitters, int a_numSplitters)
+{
+    int splitter = (int)(std::lower_bound(a_splitters, a_splitters + a_numSplitters, a_item) - a_splitters);
+    bool equal = splitter < a_numSplitters && !(a_item < a_splitters[splitter]);
+    return (splitter << 1) + (equal ? 1 : 0);
+}
+
+
+template<class T>
+void SampleSortCountJob(void* a_context)
+{
+    SampleSortContext<T>* context = (SampleSortContext<T>*) a_context;
+    int numBuckets = (context->m_numSplitters << 1) + 1;
+
+    // remember each item's bucket so the scatter doesn't have to search for it again
+    std::fill(context->m_counts, context->m_counts + numBuckets, 0);
+    for(size_t i = 0; i < context->m_length; ++i)
+    {
+        int bucket = SampleSortBucket(context->m_input[i], context->m_splitters, context->m_numSplitters);
+        context->m_bucketOf[i] = (uint16_t)bucket;
+        context->m_counts[bucket]++;
+    }
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void SampleSortScatterJob(void* a_context)
+{
+    SampleSortContext<T>* context = (SampleSortContext<T>*) a_context;
+
+    for(size_t i = 0; i < context->m_length; ++i)
+    {
+        context->m_scratchBuffer[context->m_counts[context->m_bucketOf[i]]++] = std::move(context->m_input[i]);
+    }
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void SampleSortBucketJob(void* a_context)
+{
+    BucketContext<T>* context = (BucketContext<T>*) a_context;
+
+    for(int i = context->m_firstBucket; i < context->m_endBucket; ++i)
+    {
+        size_t start = context->m_bucketStart[i];
+        size_t length = context->m_bucketStart[i + 1] - start;
+        if(length > context->m_maxLength)
+        {
+            continue;
+        }
+
+        // the odd buckets hold items that are all equal
+        T* destination = context->m_destination + start;
+        if((i & 1) == 1)
+        {
+            MoveItems(context->m_scratchBuffer + start, destination, length);
+            continue;
+        }
+        T* sorted = SortTiles(context->m_scratchBuffer + start, destination, length, context->m_tileLength, true);
+        if(sorted != destination)
+        {
+            MoveItems(sorted, destination, length);
+        }
+    }
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+bool MergeSort<T>::SortSampleMT(T* a_input, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use SortMT() when there are too few items for the sample and the buckets to pay off, or no other threads
+    const size_t minItemsPerThread = 16384;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread || a_jobQueue.NumThreads() == 0)
+    {
+        return SortMT(a_input, a_length, a_jobQueue);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    // There are a few buckets per thread so that threads with easy buckets can take more, and enough buckets that
+    // each one fits in a tile, up to the number that the bucket numbers can count.
+    const int bucketsPerThread = 4;
+    const int maxSplitters = 4096;
+    const int oversampling = 32;
+    int numSplitters = (int)std::min<size_t>(std::max<size_t>(totalNumThreads * bucketsPerThread, a_length / m_tileLength), maxSplitters);
+
+    // Take every oversampling'th item of a sorted random sample as a splitter. Equal splitters are only kept once,
+    // so the items equal to them get a bucket of their own.
+    std::vector<T> splitters(numSplitters * oversampling);
+    uint32_t random = 12345;
+    for(size_t i = 0; i < splitters.size(); ++i)
+    {
+        random = random * 1664525 + 1013904223;
+        splitters[i] = a_input[(size_t)(((uint64_t)random * a_length) >> 32)];
+    }
+    std::sort(splitters.begin(), splitters.end());
+    for(int i = 0; i < numSplitters; ++i)
+    {
+        splitters[i] = splitters[i * oversampling + oversampling - 1];
+    }
+    splitters.resize(numSplitters);
+    splitters.erase(std::unique(splitters.begin(), splitters.end(), [](const T& a_first, const T& a_second) { return !(a_first < a_second); }), splitters.end());
+    numSplitters = (int)splitters.size();
+    int numBuckets = (numSplitters << 1) + 1;
+
+    size_t maxItemsPerThread = (a_length + totalNumThreads - 1) / totalNumThreads;
+    std::unique_ptr<SampleSortContext<T>[]> sampleContext(new SampleSortContext<T>[totalNumThreads]);
+    std::unique_ptr<uint16_t[]> bucketOf(new uint16_t[a_length]);
+    std::unique_ptr<size_t[]> counts(new size_t[totalNumThreads * numBuckets]);
+
+	CountLatch latch;
+
+    // Runs a_function on every thread's context (including on this thread) and waits for them all.
+    auto runOnAllThreads = [&](void (*a_function)(void*))
+    {
+		latch.Reset();
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            if(i < a_jobQueue.NumThreads())
+            {
+                Job job;
+                job.m_data = &sampleContext[i];
+                job.m_function = a_function;
+                a_jobQueue.SubmitJob(job);
+            }
+            else
+            {
+                a_function(&sampleContext[i]);
+            }
+        }
+		latch.Wait(totalNumThreads);
+    };
+
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        size_t start = std::min(i * maxItemsPerThread, a_length);
+        SampleSortContext<T>& context = sampleContext[i];
+        context.m_input = a_input + start;
+        context.m_scratchBuffer = m_scratchBuffer;
+        context.m_length = std::min(maxItemsPerThread, a_length - start);
+        context.m_splitters = splitters.data();
+        context.m_numSplitters = numSplitters;
+        context.m_bucketOf = bucketOf.get() + start;
+        context.m_counts = counts.get() + i * numBuckets;
+		context.m_latch = &latch;
+    }
+    runOnAllThreads(&SampleSortCountJob<T>);
+
+    // Turn the counts into offsets. Within each bucket, thread 0's items go first, then thread 1's and so on.
+    std::unique_ptr<size_t[]> bucketStart(new size_t[numBuckets + 1]);
+    size_t offset = 0;
+    for(int bucket = 0; bucket < numBuckets; ++bucket)
+    {
+        bucketStart[bucket] = offset;
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            size_t& count = counts[i * numBuckets + bucket];
+            size_t threadCount = count;
+            count = offset;
+            offset += threadCount;
+        }
+    }
+    bucketStart[numBuckets] = a_length;
+
+    runOnAllThreads(&SampleSortScatterJob<T>);
+
+    // Sort the buckets back into the input, in groups of about the same number of items. A bucket with more than a
+    // thread's share of the items would hold up the others, which happens when the sample was unlucky or the input
+    // has a lot of items that are almost the same, so those are left out and sorted with all the threads after.
+    const int jobsPerThread = 4;
+    size_t maxLength = std::max<size_t>(maxItemsPerThread, m_tileLength);
+    size_t itemsPerJob = a_length / (totalNumThreads * jobsPerThread);
+    std::vector<BucketContext<T>> bucketContext;
+    int firstBucket = 0;
+    size_t itemsInJob = 0;
+    for(int i = 0; i < numBuckets; ++i)
+    {
+        itemsInJob += bucketStart[i + 1] - bucketStart[i];
+        if(itemsInJob >= itemsPerJob || i + 1 == numBuckets)
+        {
+            BucketContext<T> context;
+            context.m_scratchBuffer = m_scratchBuffer;
+            context.m_destination = a_input;
+            context.m_bucketStart = bucketStart.get();
+            context.m_firstBucket = firstBucket;
+            context.m_endBucket = i + 1;
+            context.m_tileLength = m_tileLength;
+            context.m_maxLength = maxLength;
+            context.m_latch = &latch;
+            bucketContext.push_back(context);
+            firstBucket = i + 1;
+            itemsInJob = 0;
+        }
+    }
+
+	latch.Reset();
+    for(size_t i = 0; i + 1 < bucketContext.size(); ++i)
+    {
+        Job job;
+        job.m_data = &bucketContext[i];
+        job.m_function = &SampleSortBucketJob<T>;
+        a_jobQueue.SubmitJob(job);
+    }
+    SampleSortBucketJob<T>(&bucketContext.back());
+	latch.Wait((int)bucketContext.size());
+
+    // SortMT() uses the start of the scratch buffer, so move all the big buckets back before sorting any of them
+    for(int i = 0; i < numBuckets; ++i)
+    {
+        size_t length = bucketStart[i + 1] - bucketStart[i];
+        if(length > maxLength)
+        {
+            MoveItems(m_scratchBuffer + bucketStart[i], a_input + bucketStart[i], length);
+        }
+    }
+    for(int i = 0; i < numBuckets; i += 2)
+    {
+        size_t length = bucketStart[i + 1] - bucketStart[i];
+        if(length > maxLength && !SortMT(a_input + bucketStart[i], length, a_jobQueue))
         {
             return false;
         }
-        if(m_scratchBuffer != 0)
+    }
+
+    return true;
+}
+
+
+template<class T>
+void MergeSort<T>::SetTileLength(size_t a_tileLength)
+{
+    if(a_tileLength == 0)
+    {
+        // The tile and the same amount of scratch space should fit in the cache. Use the largest power of 2
+        // so the tiles line up with the merge widths.
+        size_t cacheLength = GetSortCacheSize() / (2 * sizeof(T));
+        a_tileLength = SORT_NETWORK_LENGTH;
+        while(a_tileLength * 2 <= cacheLength)
         {
-            delete [] m_scratchBuffer;
+            a_tileLength <<= 1;
         }
-        m_scratchBuffer = new (std::nothrow) T[a_length];
-        if(m_scratchBuffer != 0)
+    }
+    m_tileLength = std::max<size_t>(a_tileLength, SORT_NETWORK_LENGTH);
+}
+
+
+template<class T>
+bool MergeSort<T>::EnsureBufferIsLargeEnough(size_t a_length, bool a_constructLater)
+{
+    WaitForAsyncSort();
+    if(m_scratchLength < a_length)
+    {
+        if(!m_autoAllocateScratch)
         {
-            m_scratchLength = a_length;
+            return false;
         }
-        else
+        FreeScratch();
+        if(!AllocateScratch(a_length))
         {
-            m_scratchLength = 0;
             return false;
         }
     }
+    if(!a_constructLater)
+    {
+        FinishConstructingScratch(0);
+    }
     return true;
 }
 
 
+template<class T>
+bool MergeSort<T>::AllocateScratch(size_t a_length)
+{
+    m_scratchBuffer = (T*)AllocateSortBuffer(sizeof(T) * a_length);
+    m_scratchLength = (m_scratchBuffer != 0) ? a_length : 0;
+    m_scratchConstructed = false;
+    return m_scratchBuffer != 0;
+}
+
+
+template<class T>
+void MergeSort<T>::WaitForAsyncSort()
+{
+    if(m_asyncSort)
+    {
+		m_asyncSort->m_done.Wait(1);
+        m_asyncSort.reset();
+    }
+}
+
+
+template<class T>
+void MergeSort<T>::FreeScratch()
+{
+    WaitForAsyncSort();
+    if(m_autoAllocateScratch && m_scratchBuffer != 0)
+    {
+        if(m_scratchConstructed)
+        {
+            DestroyScratch(std::is_trivially_copyable<T>());
+        }
+        FreeSortBuffer(m_scratchBuffer, sizeof(T) * m_scratchLength);
+    }
+    m_scratchBuffer = 0;
+    m_scratchLength = 0;
+    m_scratchConstructed = true;
+}
+
+
+// A new buffer is left unconstructed until a sort uses it, so that sorts that split it between threads can have
+// each thread construct its own part. The other sorts construct it all here, on the thread that uses it.
+template<class T>
+void MergeSort<T>::FinishConstructingScratch(size_t a_constructedLength)
+{
+    if(!m_scratchConstructed)
+    {
+        ConstructScratchItems(m_scratchBuffer + a_constructedLength, m_scratchLength - a_constructedLength);
+        m_scratchConstructed = true;
+    }
+}
+
+
+template<class T>
+void MergeSort<T>::DestroyScratch(std::false_type)
+{
+    for(size_t i = 0; i < m_scratchLength; ++i)
+    {
+        m_scratchBuffer[i].~T();
+    }
+}
+
+
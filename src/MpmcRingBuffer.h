@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A bounded lock-free queue that any number of threads can push to and pop from at the same time (Dmitry Vyukov's
+// bounded MPMC queue). Each cell has a sequence number that says whether it is free for the push of a given
+// position or holds the item for the pop of that position, so a push or pop only needs a compare and swap on the
+// tail or head to claim its position. The head and tail are on separate cache lines, because consumers change one
+// and producers the other. T must be copyable.
+template<class T>
+class MpmcRingBuffer
+{
+public:
+    // a_capacity is rounded up to a power of 2
+    MpmcRingBuffer(size_t a_capacity);
+
+    // Returns false if the buffer is full.
+    bool TryPush(const T& a_item);
+
+    // Returns false if the buffer is empty.
+    bool TryPop(T& a_item);
+
+    // Returns true if the buffer looked empty. Other threads may push or pop at the same time.
+    bool IsEmpty() const;
+
+    inline size_t Capacity() const { return m_mask + 1; }
+
+private:
+    MpmcRingBuffer(const MpmcRingBuffer&);
+    MpmcRingBuffer& operator=(const MpmcRingBuffer&);
+
+    struct Cell
+    {
+        // position when the cell is free for the push of that position, position + 1 when it holds that item
+        std::atomic<size_t> m_sequence;
+        T m_item;
+    };
+
+    char m_padding1[64];
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask; // the number of cells - 1
+    char m_padding2[64];
+    std::atomic<size_t> m_tail; // the position of the next push
+    char m_padding3[64];
+    std::atomic<size_t> m_head; // the position of the next pop
+    char m_padding4[64];
+};
+
+
+template<class T>
+MpmcRingBuffer<T>::MpmcRingBuffer(size_t a_capacity)
+    : m_tail(0)
+    , m_head(0)
+{
+    size_t capacity = 2;
+    while(capacity < a_capacity)
+    {
+        capacity <<= 1;
+    }
+    m_mask = capacity - 1;
+    m_cells.reset(new Cell[capacity]);
+    for(size_t i = 0; i < capacity; ++i)
+    {
+        m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+
+template<class T>
+bool MpmcRingBuffer<T>::TryPush(const T& a_item)
+{
+    Cell* cell;
+    size_t position = m_tail.load(std::memory_order_relaxed);
+    while(true)
+    {
+        cell = &m_cells[position & m_mask];
+        size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0)
+        {
+            // the cell is free, so try to claim the position
+            if(m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            // the cell still holds the item from a lap ago
+            return false;
+        }
+        else
+        {
+            // another producer claimed the position first
+            position = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->m_item = a_item;
+    cell->m_sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+
+template<class T>
+bool MpmcRingBuffer<T>::TryPop(T& a_item)
+{
+    Cell* cell;
+    size_t position = m_head.load(std::memory_order_relaxed);
+    while(true)
+    {
+        cell = &m_cells[position & m_mask];
+        size_t sequence = cell->m_sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0)
+        {
+            // the cell holds the item, so try to claim the position
+            if(m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            // the item hasn't been pushed yet
+            return false;
+        }
+        else
+        {
+            // another consumer claimed the position first
+            position = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    a_item = cell->m_item;
+
+    // free the cell for the push one lap later
+    cell->m_sequence.store(position + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+
+template<class T>
+bool MpmcRingBuffer<T>::IsEmpty() const
+{
+    size_t position = m_head.load(std::memory_order_relaxed);
+    const Cell& cell = m_cells[position & m_mask];
+    return cell.m_sequence.load(std::memory_order_acquire) != position + 1;
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "MergeKernels.h"
+
+
+// Returns the position that the item at a_items[a_runStart[a_run] + a_index] has in the merged result of all runs.
+// The runs are the sorted arrays [a_runStart[i], a_runEnd[i]) of a_items. Equal items are ordered by run,
+// so every item has a different position and the merge is stable. Items are compared with a_less, as in
+// MergePathSplit(), and the same goes for everything else in this file.
+template<class T, class LESS = std::less<T>>
+inline size_t MultiwayRank(const T* a_items, const size_t* a_runStart, const size_t* a_runEnd, int a_numRuns, int a_run, size_t a_index, const LESS& a_less = LESS())
+{
+    const T& item = a_items[a_runStart[a_run] + a_index];
+    size_t rank = a_index;
+    for(int i = 0; i < a_numRuns; ++i)
+    {
+        const T* start = a_items + a_runStart[i];
+        const T* end = a_items + a_runEnd[i];
+        if(i < a_run)
+        {
+            rank += std::upper_bound(start, end, item, a_less) - start;
+        }
+        else if(i > a_run)
+        {
+            rank += std::lower_bound(start, end, item, a_less) - start;
+        }
+    }
+    return rank;
+}
+
+
+// MultiwaySplit() keeps its bounds on the stack for up to this many runs, and only allocates for more.
+const int MULTIWAY_SPLIT_STACK_RUNS = 64;
+
+
+// Returns true if the item at a_firstIndex of run a_firstRun comes before the item at a_secondIndex of run
+// a_secondRun in the merged result of all runs, with equal items ordered by run as in MultiwayRank().
+template<class T, class LESS>
+inline bool MultiwayBefore(const T* a_items, const size_t* a_runStart, int a_firstRun, size_t a_firstIndex, int a_secondRun, size_t a_secondIndex, const LESS& a_less)
+{
+    const T& first = a_items[a_runStart[a_firstRun] + a_firstIndex];
+    const T& second = a_items[a_runStart[a_secondRun] + a_secondIndex];
+    return a_less(first, second) || (!a_less(second, first) && a_firstRun < a_secondRun);
+}
+
+
+// The multiway version of MergePathSplit(). The first a_rank items of the merged result of all runs consist of the
+// first a_splits[i] items of each run i, which this fills in. The runs are described as for MultiwayRank().
+// Every run has a lower and an upper bound on its split, which all close in together: each step takes the middle
+// item between the bounds of every run, and ranks the weighted median of those (weighted by the distance between
+// the bounds) against all the runs with one binary search each. If it comes before a_rank, the items before it in
+// every run do too, so the lower bounds move up to it, and otherwise the upper bounds move down to it. Either way
+// at least a quarter of the distance between all the bounds goes, so this takes O(k log n log(kn)) comparisons for
+// k runs, and every thread writing part of a merge can find its own inputs.
+template<class T, class LESS = std::less<T>>
+inline void MultiwaySplit(const T* a_items, const size_t* a_runStart, const size_t* a_runEnd, int a_numRuns, size_t a_rank, size_t* a_splits, const LESS& a_less = LESS())
+{
+    size_t stackBounds[2 * MULTIWAY_SPLIT_STACK_RUNS];
+    int stackOrder[MULTIWAY_SPLIT_STACK_RUNS];
+    std::vector<size_t> heapBounds;
+    std::vector<int> heapOrder;
+    size_t* high = stackBounds;
+    size_t* before = stackBounds + MULTIWAY_SPLIT_STACK_RUNS;
+    int* order = stackOrder;
+    if(a_numRuns > MULTIWAY_SPLIT_STACK_RUNS)
+    {
+        heapBounds.resize(2 * a_numRuns);
+        heapOrder.resize(a_numRuns);
+        high = &heapBounds[0];
+        before = &heapBounds[a_numRuns];
+        order = &heapOrder[0];
+    }
+
+    // a_splits holds the lower bounds
+    size_t* low = a_splits;
+    for(int i = 0; i < a_numRuns; ++i)
+    {
+        low[i] = 0;
+        high[i] = std::min(a_runEnd[i] - a_runStart[i], a_rank);
+    }
+
+    while(true)
+    {
+        // the runs whose bounds haven't met yet, in the order of their middle items
+        int numCandidates = 0;
+        size_t totalWeight = 0;
+        for(int i = 0; i < a_numRuns; ++i)
+        {
+            if(low[i] < high[i])
+            {
+                order[numCandidates++] = i;
+                totalWeight += high[i] - low[i];
+            }
+        }
+        if(numCandidates == 0)
+        {
+            return;
+        }
+        std::sort(order, order + numCandidates, [&](int a_first, int a_second)
+        {
+            return MultiwayBefore(a_items, a_runStart, a_first, low[a_first] + ((high[a_first] - low[a_first]) >> 1),
+                a_second, low[a_second] + ((high[a_second] - low[a_second]) >> 1), a_less);
+        });
+
+        int run = order[0];
+        size_t weight = 0;
+        for(int i = 0; i < numCandidates; ++i)
+        {
+            run = order[i];
+            weight += high[run] - low[run];
+            if(2 * weight >= totalWeight)
+            {
+                break;
+            }
+        }
+        size_t index = low[run] + ((high[run] - low[run]) >> 1);
+
+        // count the items of each run that come before the median, as MultiwayRank() does
+        const T& item = a_items[a_runStart[run] + index];
+        size_t rank = 0;
+        for(int i = 0; i < a_numRuns; ++i)
+        {
+            const T* start = a_items + a_runStart[i];
+            const T* end = a_items + a_runEnd[i];
+            if(i < run)
+            {
+                before[i] = std::upper_bound(start, end, item, a_less) - start;
+            }
+            else if(i > run)
+            {
+                before[i] = std::lower_bound(start, end, item, a_less) - start;
+            }
+            else
+            {
+                before[i] = index;
+            }
+            rank += before[i];
+        }
+
+        if(rank < a_rank)
+        {
+            // the median and everything before it is in the first a_rank items
+            for(int i = 0; i < a_numRuns; ++i)
+            {
+                low[i] = std::max(low[i], before[i]);
+            }
+            low[run] = index + 1;
+        }
+        else
+        {
+            for(int i = 0; i < a_numRuns; ++i)
+            {
+                high[i] = std::min(high[i], before[i]);
+            }
+        }
+    }
+}
+
+
+// The same for runs that follow each other, so each run ends where the next one starts, and a_runStart has one
+// more offset for the end of the last run.
+template<class T, class LESS = std::less<T>>
+inline void MultiwaySplit(const T* a_items, const size_t* a_runStart, int a_numRuns, size_t a_rank, size_t* a_splits, const LESS& a_less = LESS())
+{
+    MultiwaySplit(a_items, a_runStart, a_runStart + 1, a_numRuns, a_rank, a_splits, a_less);
+}
+
+
+// A tournament tree that finds the smallest next item of k sorted ranges with log2(k) comparisons.
+// Each internal node keeps the loser of the match played there, so when the winner's range moves on to its next
+// item only the matches on the path from that range to the root are replayed, without looking at any siblings.
+// a_current[i] and a_end[i] are the next item and the end of range i. The tree doesn't own them: the caller takes
+// the winning item, moves a_current[Winner()] on, and then calls Replay().
+template<class T, class LESS = std::less<T>>
+class LoserTree
+{
+public:
+    LoserTree(T** a_current, T** a_end, int a_numRanges, const LESS& a_less = LESS());
+
+    // Returns the range that holds the smallest next item. Ties go to the lower range.
+    inline int Winner() const { return m_nodes[0].m_range; }
+
+    // Returns true when every range is empty.
+    inline bool IsEmpty() const { return m_nodes[0].m_empty; }
+
+    // Finds the new winner after the current winner's range has changed.
+    inline void Replay()
+    {
+        Node winner = Leaf(m_nodes[0].m_range);
+        for(int node = (winner.m_range + m_numLeaves) >> 1; node > 0; node >>= 1)
+        {
+            if(Beats(m_nodes[node], winner))
+            {
+                std::swap(m_nodes[node], winner);
+            }
+        }
+        m_nodes[0] = winner;
+    }
+
+private:
+
+    struct Node
+    {
+        const T* m_item; // the next item of the range, unless it is empty
+        int m_range;
+        bool m_empty;
+    };
+
+    // Returns a node for the next item of a range. Ranges past a_numRanges are empty.
+    inline Node Leaf(int a_range) const
+    {
+        Node leaf;
+        leaf.m_range = a_range;
+        leaf.m_empty = a_range >= m_numRanges || m_current[a_range] == m_end[a_range];
+        leaf.m_item = leaf.m_empty ? 0 : m_current[a_range];
+        return leaf;
+    }
+
+    // Returns true if a_first wins the match against a_second. An empty range always loses.
+    inline bool Beats(const Node& a_first, const Node& a_second) const
+    {
+        if(a_first.m_empty)
+        {
+            return false;
+        }
+        if(a_second.m_empty)
+        {
+            return true;
+        }
+        return m_less(*a_first.m_item, *a_second.m_item)
+            || (!m_less(*a_second.m_item, *a_first.m_item) && a_first.m_range < a_second.m_range);
+    }
+
+    // Plays all the matches below a_node and returns the winner.
+    Node Build(int a_node);
+
+    T** m_current;
+    T** m_end;
+    int m_numRanges;
+    int m_numLeaves; // m_numRanges rounded up to a power of 2
+    std::vector<Node> m_nodes; // the loser of each internal node, and the overall winner in m_nodes[0]
+    LESS m_less;
+};
+
+
+template<class T, class LESS>
+LoserTree<T, LESS>::LoserTree(T** a_current, T** a_end, int a_numRanges, const LESS& a_less)
+    : m_current(a_current)
+    , m_end(a_end)
+    , m_numRanges(a_numRanges)
+    , m_numLeaves(1)
+    , m_less(a_less)
+{
+    while(m_numLeaves < a_numRanges)
+    {
+        m_numLeaves <<= 1;
+    }
+    m_nodes.resize(m_numLeaves);
+    m_nodes[0] = Build(1);
+}
+
+
+template<class T, class LESS>
+typename LoserTree<T, LESS>::Node LoserTree<T, LESS>::Build(int a_node)
+{
+    if(a_node >= m_numLeaves)
+    {
+        return Leaf(a_node - m_numLeaves);
+    }
+    Node first = Build(a_node << 1);
+    Node second = Build((a_node << 1) + 1);
+    if(Beats(second, first))
+    {
+        std::swap(first, second);
+    }
+    m_nodes[a_node] = second;
+    return first;
+}
+
+
+// Merges a_numRanges sorted ranges [a_current[i], a_end[i]) into a_destinationBuffer with a LoserTree, reading
+// and moving every item once. Equal items are taken from the lower range first. a_current is used up by the merge.
+// Two ranges are merged with MergeRanges() instead, which is faster for key types that are merged with SIMD.
+template<class T>
+inline void MultiwayMergeRanges(T** a_current, T** a_end, int a_numRanges, T* a_destinationBuffer)
+{
+    if(a_numRanges == 1)
+    {
+        MoveItems(a_current[0], a_destinationBuffer, a_end[0] - a_current[0]);
+        return;
+    }
+    if(a_numRanges == 2)
+    {
+        MergeRanges(a_current[0], a_end[0], a_current[1], a_end[1], a_destinationBuffer);
+        return;
+    }
+
+    LoserTree<T> tree(a_current, a_end, a_numRanges);
+    while(!tree.IsEmpty())
+    {
+        *a_destinationBuffer++ = std::move(*a_current[tree.Winner()]++);
+        tree.Replay();
+    }
+}
+
+
+// Merges like MultiwayMergeRanges() but only writes the first of each group of equal items, and returns the number
+// of items written. If a_currentCount isn't 0, a_currentCount[i] points to the count of the current item of range i,
+// and moves along with it. The counts of equal items are added up and written to a_destinationCounts.
+template<class T>
+inline size_t MultiwayMergeUnique(T** a_current, T** a_end, size_t** a_currentCount, int a_numRanges, T* a_destinationBuffer, size_t* a_destinationCounts)
+{
+    T* destination = a_destinationBuffer;
+    LoserTree<T> tree(a_current, a_end, a_numRanges);
+    while(!tree.IsEmpty())
+    {
+        int range = tree.Winner();
+        if(destination != a_destinationBuffer && !(destination[-1] < *a_current[range]))
+        {
+            if(a_currentCount != 0)
+            {
+                a_destinationCounts[destination - a_destinationBuffer - 1] += *a_currentCount[range]++;
+            }
+        }
+        else
+        {
+            if(a_currentCount != 0)
+            {
+                a_destinationCounts[destination - a_destinationBuffer] = *a_currentCount[range]++;
+            }
+            *destination++ = std::move(*a_current[range]);
+        }
+        ++a_current[range];
+        tree.Replay();
+    }
+    return destination - a_destinationBuffer;
+}
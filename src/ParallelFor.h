@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+
+
+// Without a grain size, ranges shorter than twice this run on the calling thread, and no piece of a loop gets
+// fewer indices than this, so that a cheap body is never split up more finely than it is worth.
+const size_t PARALLEL_MIN_GRAIN_SIZE = 1024;
+
+// Without a grain size, each thread gets at least this many grains of the range, so that threads that finish
+// early can take work from the others.
+const size_t PARALLEL_GRAINS_PER_THREAD = 16;
+
+// A loop is split into at most this many pieces per thread, which bounds the memory for them.
+const size_t PARALLEL_MAX_PIECES_PER_THREAD = 64;
+
+
+// Runs a_body(piece, begin, end) over a range of indices with lazy binary splitting. A piece of the range works
+// through its indices a grain at a time. Before each grain, if the jobs its thread submitted have all been taken
+// by other threads, it hands the back half of what it has left to a new piece. So the range is only split when
+// threads are actually short of work, and how evenly it spreads doesn't depend on guessing the cost of the body.
+// Each piece ends up doing one contiguous part of the range, that starts at PieceBegin().
+template<class Body>
+class ParallelLoop
+{
+public:
+    ParallelLoop(const Body& a_body, size_t a_begin, size_t a_end, size_t a_grainSize, size_t a_maxPieces, JobQueue& a_jobQueue);
+
+    // Does the first piece on this thread, and waits for the pieces that were split off from it.
+    void Run();
+
+    inline size_t NumPieces() const { return std::min(m_numPieces.load(std::memory_order_relaxed), m_maxPieces); }
+    inline size_t PieceBegin(size_t a_piece) const { return m_pieces[a_piece].m_begin; }
+
+private:
+    ParallelLoop(const ParallelLoop&);
+    ParallelLoop& operator=(const ParallelLoop&);
+
+    struct Piece
+    {
+        ParallelLoop* m_loop;
+        size_t m_index;
+        size_t m_begin;
+        size_t m_end;
+    };
+
+    static void PieceJob(void* a_piece);
+
+    void RunPiece(size_t a_piece);
+
+    const Body& m_body;
+    JobQueue& m_jobQueue;
+    size_t m_grainSize;
+    size_t m_maxPieces;
+    std::unique_ptr<Piece[]> m_pieces;
+    std::atomic<size_t> m_numPieces;
+    std::atomic<size_t> m_remaining; // indices that no piece has finished yet
+    CountLatch m_latch; // notified by the piece that finishes the last index
+};
+
+
+template<class Body>
+ParallelLoop<Body>::ParallelLoop(const Body& a_body, size_t a_begin, size_t a_end, size_t a_grainSize, size_t a_maxPieces, JobQueue& a_jobQueue)
+    : m_body(a_body)
+    , m_jobQueue(a_jobQueue)
+    , m_grainSize(a_grainSize)
+    , m_maxPieces(a_maxPieces)
+    , m_pieces(new Piece[a_maxPieces])
+    , m_numPieces(1)
+    , m_remaining(a_end - a_begin)
+{
+    assert(a_begin < a_end && a_grainSize > 0 && a_maxPieces > 0);
+    m_pieces[0].m_loop = this;
+    m_pieces[0].m_index = 0;
+    m_pieces[0].m_begin = a_begin;
+    m_pieces[0].m_end = a_end;
+}
+
+
+template<class Body>
+void ParallelLoop<Body>::Run()
+{
+    RunPiece(0);
+	m_latch.Wait(1);
+}
+
+
+template<class Body>
+void ParallelLoop<Body>::PieceJob(void* a_piece)
+{
+    Piece* piece = (Piece*) a_piece;
+    piece->m_loop->RunPiece(piece->m_index);
+}
+
+
+template<class Body>
+void ParallelLoop<Body>::RunPiece(size_t a_piece)
+{
+    Piece& piece = m_pieces[a_piece];
+    size_t begin = piece.m_begin;
+    size_t end = piece.m_end;
+    while(begin < end)
+    {
+        // Split while there is enough left for two grains and other threads have taken everything this one gave them.
+        if(end - begin >= 2 * m_grainSize && m_numPieces.load(std::memory_order_relaxed) < m_maxPieces && !m_jobQueue.HasQueuedJobs())
+        {
+            size_t index = m_numPieces.fetch_add(1, std::memory_order_relaxed);
+            if(index < m_maxPieces)
+            {
+                size_t middle = begin + ((end - begin) >> 1);
+                Piece& newPiece = m_pieces[index];
+                newPiece.m_loop = this;
+                newPiece.m_index = index;
+                newPiece.m_begin = middle;
+                newPiece.m_end = end;
+                end = middle;
+
+                Job job;
+                job.m_data = &newPiece;
+                job.m_function = &PieceJob;
+                m_jobQueue.SubmitJob(job);
+                continue;
+            }
+        }
+
+        size_t grainEnd = std::min(begin + m_grainSize, end);
+        m_body(a_piece, begin, grainEnd);
+        begin = grainEnd;
+    }
+
+    // Nothing of the loop may be touched after the last index is counted, because Run() can return.
+    size_t done = end - piece.m_begin;
+    if(m_remaining.fetch_sub(done, std::memory_order_acq_rel) == done)
+    {
+		m_latch.Notify();
+    }
+}
+
+
+// Returns a_grainSize, or if it is 0, a grain size that gives each thread PARALLEL_GRAINS_PER_THREAD grains.
+inline size_t ParallelGrainSize(size_t a_length, size_t a_grainSize, const JobQueue& a_jobQueue)
+{
+    if(a_grainSize > 0)
+    {
+        return a_grainSize;
+    }
+    size_t totalNumThreads = a_jobQueue.NumThreads() + 1; // including this thread
+    return std::max(PARALLEL_MIN_GRAIN_SIZE, a_length / (totalNumThreads * PARALLEL_GRAINS_PER_THREAD));
+}
+
+
+// Enough pieces for every grain of the range, up to PARALLEL_MAX_PIECES_PER_THREAD for each thread.
+inline size_t ParallelMaxPieces(size_t a_length, size_t a_grainSize, const JobQueue& a_jobQueue)
+{
+    size_t totalNumThreads = a_jobQueue.NumThreads() + 1; // including this thread
+    return std::min(a_length / a_grainSize + 1, totalNumThreads * PARALLEL_MAX_PIECES_PER_THREAD);
+}
+
+
+template<class Body>
+struct ParallelForBody
+{
+    const Body& m_body;
+
+    inline void operator()(size_t, size_t a_begin, size_t a_end) const
+    {
+        m_body(a_begin, a_end);
+    }
+};
+
+
+// Calls a_body(begin, end) on this thread and the workers of a_jobQueue, for ranges that between them cover every
+// index from a_begin to a_end once, and returns when they are all done. a_body may be a lambda, and is called
+// from several threads at once. With no a_grainSize, the range is split into grains of at least
+// PARALLEL_MIN_GRAIN_SIZE indices; give a smaller one for a body that does a lot of work for each index.
+// It must not be called from inside a job, because it waits for the jobs it submits.
+template<class Body>
+void ParallelFor(size_t a_begin, size_t a_end, const Body& a_body, JobQueue& a_jobQueue, size_t a_grainSize = 0)
+{
+    if(a_begin >= a_end)
+    {
+        return;
+    }
+
+    size_t length = a_end - a_begin;
+    size_t grainSize = ParallelGrainSize(length, a_grainSize, a_jobQueue);
+    if(a_jobQueue.NumThreads() == 0 || length < 2 * grainSize)
+    {
+        a_body(a_begin, a_end);
+        return;
+    }
+
+    ParallelForBody<Body> body = { a_body };
+    ParallelLoop<ParallelForBody<Body>> loop(body, a_begin, a_end, grainSize, ParallelMaxPieces(length, grainSize, a_jobQueue), a_jobQueue);
+    loop.Run();
+}
+
+
+template<class T, class Body>
+struct ParallelReduceBody
+{
+    const Body& m_body;
+    T* m_results; // one for each piece
+
+    inline void operator()(size_t a_piece, size_t a_begin, size_t a_end) const
+    {
+        m_results[a_piece] = m_body(a_begin, a_end, m_results[a_piece]);
+    }
+};
+
+
+// Reduces the range of indices from a_begin to a_end to one value. a_body(begin, end, value) returns value with the
+// indices from begin to end added in, and a_combine(left, right) returns the combination of the values of two
+// neighbouring ranges. Each piece of the range starts from a_identity, and the pieces are combined in the order of
+// the range, so a_combine has to be associative but doesn't have to be commutative. T must be default constructible
+// and copyable. The range is split up as for ParallelFor().
+template<class T, class Body, class Combine>
+T ParallelReduce(size_t a_begin, size_t a_end, const T& a_identity, const Body& a_body, const Combine& a_combine, JobQueue& a_jobQueue, size_t a_grainSize = 0)
+{
+    if(a_begin >= a_end)
+    {
+        return a_identity;
+    }
+
+    size_t length = a_end - a_begin;
+    size_t grainSize = ParallelGrainSize(length, a_grainSize, a_jobQueue);
+    if(a_jobQueue.NumThreads() == 0 || length < 2 * grainSize)
+    {
+        return a_body(a_begin, a_end, a_identity);
+    }
+
+    size_t maxPieces = ParallelMaxPieces(length, grainSize, a_jobQueue);
+    std::unique_ptr<T[]> results(new T[maxPieces]);
+    std::fill(results.get(), results.get() + maxPieces, a_identity);
+
+    ParallelReduceBody<T, Body> body = { a_body, results.get() };
+    ParallelLoop<ParallelReduceBody<T, Body>> loop(body, a_begin, a_end, grainSize, maxPieces, a_jobQueue);
+    loop.Run();
+
+    // combine the pieces in the order of the range
+    size_t numPieces = loop.NumPieces();
+    std::vector<size_t> order(numPieces);
+    for(size_t i = 0; i < numPieces; ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&loop](size_t a_left, size_t a_right) { return loop.PieceBegin(a_left) < loop.PieceBegin(a_right); });
+
+    T result = results[order[0]];
+    for(size_t i = 1; i < numPieces; ++i)
+    {
+        result = a_combine(result, results[order[i]]);
+    }
+    return result;
+}
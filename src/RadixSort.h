@@ -0,0 +1,430 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <type_traits>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+#include "MergeSort.h"
+
+
+// Keys are sorted one byte (digit) at a time, starting from the least significant.
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+
+// Maps a key to an unsigned integer with the same ordering, so that the digits can be sorted as unsigned values.
+// Signed integers have their sign bit flipped so negative keys come first.
+template<class T, bool IS_FLOAT = std::is_floating_point<T>::value>
+struct RadixTraits
+{
+    typedef typename std::make_unsigned<T>::type Bits;
+
+    static inline Bits ToBits(T a_key)
+    {
+        const Bits signBit = std::is_signed<T>::value ? (Bits)((Bits)1 << (sizeof(T) * 8 - 1)) : (Bits)0;
+        return (Bits)a_key ^ signBit;
+    }
+};
+
+
+// IEEE floats: negative keys have all their bits flipped so that larger magnitudes come first,
+// and positive keys have their sign bit flipped so they come after all the negative keys.
+template<class T>
+struct RadixTraits<T, true>
+{
+    typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type Bits;
+
+    static inline Bits ToBits(T a_key)
+    {
+        Bits bits;
+        memcpy(&bits, &a_key, sizeof(T));
+        const int signShift = sizeof(T) * 8 - 1;
+        Bits mask = (Bits)(0 - (bits >> signShift)) | ((Bits)1 << signShift);
+        return bits ^ mask;
+    }
+};
+
+
+template<class T>
+inline uint32_t RadixDigit(T a_key, int a_digit)
+{
+    return (uint32_t)(RadixTraits<T>::ToBits(a_key) >> (a_digit * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+
+// Counts the items in each bucket for every digit at once. a_counts holds RADIX_BUCKETS counts per digit.
+template<class T>
+inline void RadixCountAllDigits(const T* a_items, size_t a_length, size_t* a_counts)
+{
+    memset(a_counts, 0, sizeof(size_t) * RADIX_BUCKETS * sizeof(T));
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        typename RadixTraits<T>::Bits bits = RadixTraits<T>::ToBits(a_items[i]);
+        for(int digit = 0; digit < (int)sizeof(T); ++digit)
+        {
+            a_counts[digit * RADIX_BUCKETS + ((bits >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1))]++;
+        }
+    }
+}
+
+
+// Counts the items in each bucket for a single digit.
+template<class T>
+inline void RadixCountDigit(const T* a_items, size_t a_length, int a_digit, size_t* a_counts)
+{
+    memset(a_counts, 0, sizeof(size_t) * RADIX_BUCKETS);
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        a_counts[RadixDigit(a_items[i], a_digit)]++;
+    }
+}
+
+
+// Moves each item to the next position of its bucket. a_offsets holds the next position for each bucket, and is
+// advanced as items are moved. The order of items within a bucket is kept, which is what makes LSD radix sort work.
+template<class T>
+inline void RadixScatter(const T* a_source, T* a_destination, size_t a_length, int a_digit, size_t* a_offsets)
+{
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        a_destination[a_offsets[RadixDigit(a_source[i], a_digit)]++] = a_source[i];
+    }
+}
+
+
+// The part of a radix sort that one thread works on.
+template<class T>
+struct RadixContext
+{
+    const T* m_source; // source buffer
+    T* m_destination; // dest buffer
+    size_t m_start; // offset to the first item this thread handles
+    size_t m_end; // offset to the end of the items this thread handles
+    int m_digit; // digit of the current pass
+    size_t* m_counts; // bucket counts for each digit (RADIX_BUCKETS * sizeof(T)), then the offsets to scatter to
+	CountLatch* m_latch;
+};
+
+
+template<class T>
+void RadixCountAllDigitsJob(void* a_context)
+{
+    RadixContext<T>* context = (RadixContext<T>*) a_context;
+
+    RadixCountAllDigits(context->m_source + context->m_start, context->m_end - context->m_start, context->m_counts);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void RadixCountDigitJob(void* a_context)
+{
+    RadixContext<T>* context = (RadixContext<T>*) a_context;
+
+    RadixCountDigit(context->m_source + context->m_start, context->m_end - context->m_start, context->m_digit, context->m_counts + context->m_digit * RADIX_BUCKETS);
+
+	context->m_latch->Notify();
+}
+
+
+template<class T>
+void RadixScatterJob(void* a_context)
+{
+    RadixContext<T>* context = (RadixContext<T>*) a_context;
+
+    RadixScatter(context->m_source + context->m_start, context->m_destination, context->m_end - context->m_start, context->m_digit, context->m_counts + context->m_digit * RADIX_BUCKETS);
+
+	context->m_latch->Notify();
+}
+
+
+// LSD radix sort for integer and floating point keys, one byte per pass.
+// Passes where every key has the same digit are skipped. Owns its scratch buffer in the same way as MergeSort.
+template<class T>
+class RadixSort
+{
+public:
+    // Automatically allocate scratch buffer as needed
+    RadixSort();
+
+    // Pre-allocate scratch buffer to the given number of T items, and then auto allocate more if needed.
+    RadixSort(size_t a_scratchLength);
+
+    // Use the pre-allocated scratch buffer which can contain the given number of T items.
+    // Sorting may fail if the given buffer is too small.
+    RadixSort(T* a_scratchBuffer, size_t a_scratchLength);
+
+    ~RadixSort();
+
+    // Sorts the input buffer, which contains the given number of T items.
+    // Returns false if the scratch buffer was not big enough.
+    bool Sort(T* a_input, size_t a_length);
+
+    // The same as Sort() but is multithreaded. Each thread counts and scatters its own part of the input, and the
+    // counts are combined so that every thread scatters to its own positions within each bucket.
+    bool SortMT(T* a_input, size_t a_length, JobQueue& a_jobQueue);
+
+private:
+    RadixSort(const RadixSort&);
+    RadixSort& operator=(const RadixSort&);
+
+    // Returns false if a large enough buffer cannot be allocated.
+    bool EnsureBufferIsLargeEnough(size_t a_length);
+
+    // The scratch buffer comes from AllocateSortBuffer(), as for MergeSort. Returns false if it can't be allocated.
+    bool AllocateScratch(size_t a_length);
+
+    void FreeScratch();
+
+    T* m_scratchBuffer;
+    size_t m_scratchLength; // number of T items that the buffer can contain
+    bool m_autoAllocateScratch;
+};
+
+
+template<class T>
+RadixSort<T>::RadixSort()
+    : m_scratchBuffer(0)
+    , m_scratchLength(0)
+    , m_autoAllocateScratch(true)
+{
+}
+
+
+template<class T>
+RadixSort<T>::RadixSort(size_t a_scratchLength)
+    : m_scratchBuffer(0)
+    , m_scratchLength(0)
+    , m_autoAllocateScratch(true)
+{
+    AllocateScratch(a_scratchLength);
+}
+
+
+template<class T>
+RadixSort<T>::RadixSort(T* a_scratchBuffer, size_t a_scratchLength)
+    : m_scratchBuffer(a_scratchBuffer)
+    , m_scratchLength(a_scratchLength)
+    , m_autoAllocateScratch(false)
+{
+}
+
+
+template<class T>
+RadixSort<T>::~RadixSort()
+{
+    FreeScratch();
+}
+
+
+template<class T>
+bool RadixSort<T>::Sort(T* a_input, size_t a_length)
+{
+    // skip the trivial case
+    if(a_length < 2)
+    {
+        return true;
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    // count every digit in one pass
+    size_t counts[sizeof(T) * RADIX_BUCKETS];
+    RadixCountAllDigits(a_input, a_length, counts);
+
+    // These pointers are swapped for each pass to avoid copying.
+    T* buffer1 = a_input;
+    T* buffer2 = m_scratchBuffer;
+
+    for(int digit = 0; digit < (int)sizeof(T); ++digit)
+    {
+        size_t* digitCounts = counts + digit * RADIX_BUCKETS;
+
+        // skip the pass if every key has the same digit
+        if(digitCounts[RadixDigit(buffer1[0], digit)] == a_length)
+        {
+            continue;
+        }
+
+        // turn the counts into the offset of each bucket
+        size_t offset = 0;
+        for(int bucket = 0; bucket < RADIX_BUCKETS; ++bucket)
+        {
+            size_t count = digitCounts[bucket];
+            digitCounts[bucket] = offset;
+            offset += count;
+        }
+
+        RadixScatter(buffer1, buffer2, a_length, digit, digitCounts);
+        std::swap(buffer1, buffer2);
+    }
+
+    // if the results are in the scratch buffer, copy them back into the input buffer
+    if(buffer1 == m_scratchBuffer)
+    {
+        memcpy(a_input, buffer1, sizeof(T) * a_length);
+    }
+
+    return true;
+}
+
+
+template<class T>
+bool RadixSort<T>::SortMT(T* a_input, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use a single thread for small sorts, where the bucket counts would cost more than the items
+    const size_t minItemsPerThread = 16 * RADIX_BUCKETS;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread)
+    {
+        return Sort(a_input, a_length);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    // These pointers are swapped for each pass to avoid copying.
+    T* buffer1 = a_input;
+    T* buffer2 = m_scratchBuffer;
+
+    // each thread works on the same part of the buffers in every pass
+    size_t maxItemsPerThread = (a_length - 1) / totalNumThreads + 1;
+    std::unique_ptr<RadixContext<T>[]> context(new RadixContext<T>[totalNumThreads]);
+    std::unique_ptr<size_t[]> counts(new size_t[totalNumThreads * sizeof(T) * RADIX_BUCKETS]);
+
+	CountLatch latch;
+
+    for(uint32_t i = 0; i < totalNumThreads; ++i)
+    {
+        context[i].m_start = std::min((size_t)i * maxItemsPerThread, a_length);
+        context[i].m_end = std::min((size_t)(i + 1) * maxItemsPerThread, a_length);
+        context[i].m_digit = 0;
+        context[i].m_counts = counts.get() + i * sizeof(T) * RADIX_BUCKETS;
+		context[i].m_latch = &latch;
+    }
+
+    // Runs a_function on every thread's context (including on this thread) and waits for them all.
+    auto runOnAllThreads = [&](void (*a_function)(void*))
+    {
+		latch.Reset();
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            context[i].m_source = buffer1;
+            context[i].m_destination = buffer2;
+            if(i < a_jobQueue.NumThreads())
+            {
+                Job job;
+                job.m_data = &context[i];
+                job.m_function = a_function;
+                a_jobQueue.SubmitJob(job);
+            }
+            else
+            {
+                a_function(&context[i]);
+            }
+        }
+		latch.Wait(totalNumThreads);
+    };
+
+    // Count every digit in one pass. These counts are still right for the first pass that isn't skipped,
+    // and the totals tell us which passes can be skipped.
+    runOnAllThreads(&RadixCountAllDigitsJob<T>);
+    bool countsAreCurrent = true;
+
+    for(int digit = 0; digit < (int)sizeof(T); ++digit)
+    {
+        // skip the pass if every key has the same digit
+        uint32_t firstBucket = RadixDigit(buffer1[0], digit);
+        size_t total = 0;
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            total += context[i].m_counts[digit * RADIX_BUCKETS + firstBucket];
+        }
+        if(total == a_length)
+        {
+            continue;
+        }
+
+        // after the first pass each thread's part of the buffer has different items, so count them again
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            context[i].m_digit = digit;
+        }
+        if(!countsAreCurrent)
+        {
+            runOnAllThreads(&RadixCountDigitJob<T>);
+        }
+        countsAreCurrent = false;
+
+        // Turn the counts into offsets. Within each bucket, thread 0's items go first, then thread 1's and so on,
+        // which keeps the items in order.
+        size_t offset = 0;
+        for(int bucket = 0; bucket < RADIX_BUCKETS; ++bucket)
+        {
+            for(uint32_t i = 0; i < totalNumThreads; ++i)
+            {
+                size_t& count = context[i].m_counts[digit * RADIX_BUCKETS + bucket];
+                size_t threadCount = count;
+                count = offset;
+                offset += threadCount;
+            }
+        }
+
+        runOnAllThreads(&RadixScatterJob<T>);
+        std::swap(buffer1, buffer2);
+    }
+
+    // if the results are in the scratch buffer, copy them back into the input buffer
+    if(buffer1 == m_scratchBuffer)
+    {
+        memcpy(a_input, buffer1, sizeof(T) * a_length);
+    }
+
+    return true;
+}
+
+
+template<class T>
+bool RadixSort<T>::EnsureBufferIsLargeEnough(size_t a_length)
+{
+    if(m_scratchLength < a_length)
+    {
+        if(!m_autoAllocateScratch)
+        {
+            return false;
+        }
+        FreeScratch();
+        return AllocateScratch(a_length);
+    }
+    return true;
+}
+
+
+template<class T>
+bool RadixSort<T>::AllocateScratch(size_t a_length)
+{
+    m_scratchBuffer = (T*)AllocateSortBuffer(sizeof(T) * a_length);
+    m_scratchLength = (m_scratchBuffer != 0) ? a_length : 0;
+    return m_scratchBuffer != 0;
+}
+
+
+template<class T>
+void RadixSort<T>::FreeScratch()
+{
+    if(m_autoAllocateScratch && m_scratchBuffer != 0)
+    {
+        FreeSortBuffer(m_scratchBuffer, sizeof(T) * m_scratchLength);
+    }
+    m_scratchBuffer = 0;
+    m_scratchLength = 0;
+}
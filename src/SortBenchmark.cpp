@@ -0,0 +1,344 @@
+#include "stdafx.h"
+
+#include "SortBenchmark.h"
+
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "JobQueue.h"
+#include "MergeSort.h"
+#include "Timer.h"
+
+
+enum SortDistribution
+{
+    DISTRIBUTION_UNIFORM_32, // random 32 bit keys
+    DISTRIBUTION_UNIFORM_64, // random 64 bit keys, only for items with 64 bit keys
+    DISTRIBUTION_SORTED,
+    DISTRIBUTION_REVERSED,
+    DISTRIBUTION_SAWTOOTH, // SAWTOOTH_TEETH sorted runs one after another
+    DISTRIBUTION_FEW_UNIQUE, // FEW_UNIQUE_KEYS different random keys
+    DISTRIBUTION_ZIPF, // the key of rank k comes up about 1 / k times as often as the most common one
+    DISTRIBUTION_NEARLY_SORTED, // sorted, then 1 in NEARLY_SORTED_SWAP_RATIO items swapped with random items
+    NUM_SORT_DISTRIBUTIONS
+};
+
+static const char* const DISTRIBUTION_NAMES[NUM_SORT_DISTRIBUTIONS] =
+{
+    "uniform32",
+    "uniform64",
+    "sorted",
+    "reversed",
+    "sawtooth",
+    "few_unique",
+    "zipf",
+    "nearly_sorted",
+};
+
+static const size_t SAWTOOTH_TEETH = 32;
+static const uint64_t FEW_UNIQUE_KEYS = 16;
+static const size_t NEARLY_SORTED_SWAP_RATIO = 100;
+
+
+enum SortVariant
+{
+    SORT_STD,
+    SORT_UNROLLED_MEMCPY,
+    SORT_SIMPLE_UNROLLED,
+    SORT_SIMPLE,
+    SORT_MT,
+    SORT_MT_ASYNC,
+    SORT_SAMPLE_MT,
+    SORT_ADAPTIVE,
+    SORT_ADAPTIVE_MT,
+    SORT_LOW_MEMORY,
+    SORT_LOW_MEMORY_MT,
+    NUM_SORT_VARIANTS
+};
+
+static const char* const VARIANT_NAMES[NUM_SORT_VARIANTS] =
+{
+    "std::sort",
+    "SortUnrolledMemcpy",
+    "SortSimpleUnrolled",
+    "SortSimple",
+    "SortMT",
+    "SortMTAsync",
+    "SortSampleMT",
+    "SortAdaptive",
+    "SortAdaptiveMT",
+    "SortLowMemory",
+    "SortLowMemoryMT",
+};
+
+
+// An item that is sorted by a 64 bit key and carries a payload, so that it is BYTES bytes wide.
+template<size_t BYTES>
+struct BenchmarkRecord
+{
+    uint64_t m_key;
+    char m_payload[BYTES - sizeof(uint64_t)];
+
+    bool operator<(const BenchmarkRecord& a_other) const { return m_key < a_other.m_key; }
+};
+
+
+inline void SetBenchmarkKey(uint32_t& a_item, uint64_t a_key)
+{
+    a_item = (uint32_t)a_key;
+}
+
+
+inline void SetBenchmarkKey(uint64_t& a_item, uint64_t a_key)
+{
+    a_item = a_key;
+}
+
+
+template<size_t BYTES>
+inline void SetBenchmarkKey(BenchmarkRecord<BYTES>& a_item, uint64_t a_key)
+{
+    a_item.m_key = a_key;
+}
+
+
+// SplitMix64, which is fast and, unlike rand(), gives all 64 bits on every platform.
+static inline uint64_t NextRandom(uint64_t& a_state)
+{
+    uint64_t z = (a_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+
+// Spreads out small numbers over the 32 bit keys, so that the most common keys aren't also the smallest.
+static inline uint64_t ScrambleKey(uint64_t a_number)
+{
+    return (uint32_t)(a_number * 2654435761u);
+}
+
+
+// Sets the keys of the items to the given distribution. The same seed always gives the same keys.
+template<class T>
+static void GenerateKeys(SortDistribution a_distribution, T* a_items, size_t a_length, uint64_t a_seed)
+{
+    uint64_t state = a_seed;
+    switch(a_distribution)
+    {
+    case DISTRIBUTION_UNIFORM_32:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], NextRandom(state) & 0xFFFFFFFFull);
+        }
+        break;
+
+    case DISTRIBUTION_UNIFORM_64:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], NextRandom(state));
+        }
+        break;
+
+    case DISTRIBUTION_SORTED:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], i);
+        }
+        break;
+
+    case DISTRIBUTION_REVERSED:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], a_length - 1 - i);
+        }
+        break;
+
+    case DISTRIBUTION_SAWTOOTH:
+        {
+            size_t toothLength = std::max<size_t>(a_length / SAWTOOTH_TEETH, 1);
+            for(size_t i = 0; i < a_length; ++i)
+            {
+                SetBenchmarkKey(a_items[i], i % toothLength);
+            }
+        }
+        break;
+
+    case DISTRIBUTION_FEW_UNIQUE:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], ScrambleKey(NextRandom(state) % FEW_UNIQUE_KEYS));
+        }
+        break;
+
+    case DISTRIBUTION_ZIPF:
+        {
+            // The inverse of the continuous approximation of the Zipf CDF with an exponent of 1 over a_length
+            // ranks, where rank k < K has a probability of about log(K + 1) / log(a_length + 1).
+            double lengthPlusOne = (double)a_length + 1.0;
+            for(size_t i = 0; i < a_length; ++i)
+            {
+                double uniform = (double)(NextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+                uint64_t rank = (uint64_t)pow(lengthPlusOne, uniform) - 1;
+                SetBenchmarkKey(a_items[i], ScrambleKey(rank));
+            }
+        }
+        break;
+
+    case DISTRIBUTION_NEARLY_SORTED:
+        for(size_t i = 0; i < a_length; ++i)
+        {
+            SetBenchmarkKey(a_items[i], i);
+        }
+        for(size_t i = 0; i < a_length / NEARLY_SORTED_SWAP_RATIO; ++i)
+        {
+            std::swap(a_items[NextRandom(state) % a_length], a_items[NextRandom(state) % a_length]);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+// Sorts the items with one variant. Returns false if the sort failed to allocate its scratch buffer.
+template<class T>
+static bool RunSort(SortVariant a_variant, MergeSort<T>& a_sorter, T* a_items, size_t a_length, JobQueue& a_jobQueue)
+{
+    switch(a_variant)
+    {
+    case SORT_STD:
+        std::sort(a_items, a_items + a_length);
+        return true;
+    case SORT_UNROLLED_MEMCPY:
+        return a_sorter.SortUnrolledMemcpy(a_items, a_length);
+    case SORT_SIMPLE_UNROLLED:
+        return a_sorter.SortSimpleUnrolled(a_items, a_length);
+    case SORT_SIMPLE:
+        return a_sorter.SortSimple(a_items, a_length);
+    case SORT_MT:
+        return a_sorter.SortMT(a_items, a_length, a_jobQueue);
+    case SORT_MT_ASYNC:
+        {
+            SortFuture<T> future;
+            if(!a_sorter.SortMTAsync(a_items, a_length, a_jobQueue, future))
+            {
+                return false;
+            }
+            future.Wait();
+            return true;
+        }
+    case SORT_SAMPLE_MT:
+        return a_sorter.SortSampleMT(a_items, a_length, a_jobQueue);
+    case SORT_ADAPTIVE:
+        return a_sorter.SortAdaptive(a_items, a_length);
+    case SORT_ADAPTIVE_MT:
+        return a_sorter.SortAdaptiveMT(a_items, a_length, a_jobQueue);
+    case SORT_LOW_MEMORY:
+        return a_sorter.SortLowMemory(a_items, a_length);
+    case SORT_LOW_MEMORY_MT:
+        return a_sorter.SortLowMemoryMT(a_items, a_length, a_jobQueue);
+    default:
+        return false;
+    }
+}
+
+
+// Runs every variant on every distribution and length for items of type T, and prints a row of the table for each.
+template<class T>
+static void BenchmarkItemType(const SortBenchmarkOptions& a_options, bool a_wideKeys, JobQueue& a_jobQueue)
+{
+    Timer timer;
+    int repeats = std::max(a_options.m_repeats, 1);
+    std::vector<float> times(repeats);
+
+    for(size_t length = a_options.m_minLength; length <= a_options.m_maxLength; length *= a_options.m_lengthMultiplier)
+    {
+        // the input, the copy that is sorted and the scratch buffer
+        if(length > a_options.m_memoryBudget / (3 * sizeof(T)))
+        {
+            printf("%-20s skipping %d byte items from %llu items, which need more than the memory budget\n", "",
+                (int)sizeof(T), (unsigned long long)length);
+            break;
+        }
+
+        std::unique_ptr<T[]> input(new (std::nothrow) T[length]());
+        std::unique_ptr<T[]> items(new (std::nothrow) T[length]);
+        MergeSort<T> sorter(length);
+        if(!input || !items)
+        {
+            printf("%-20s failed to allocate %d byte items for %llu items\n", "", (int)sizeof(T), (unsigned long long)length);
+            break;
+        }
+
+        for(int distribution = 0; distribution < NUM_SORT_DISTRIBUTIONS; ++distribution)
+        {
+            if(distribution == DISTRIBUTION_UNIFORM_64 && !a_wideKeys)
+            {
+                continue;
+            }
+            GenerateKeys((SortDistribution)distribution, input.get(), length, length * NUM_SORT_DISTRIBUTIONS + distribution);
+
+            for(int variant = 0; variant < NUM_SORT_VARIANTS; ++variant)
+            {
+                // every result is checked, outside of the time, since a sort could go wrong on any run
+                bool success = true;
+                for(int i = 0; i < repeats; ++i)
+                {
+                    memcpy(items.get(), input.get(), sizeof(T) * length);
+                    timer.Reset();
+                    success = RunSort((SortVariant)variant, sorter, items.get(), length, a_jobQueue) && success;
+                    times[i] = timer.Time();
+                    success = success && std::is_sorted(items.get(), items.get() + length);
+                }
+
+                std::sort(times.begin(), times.end());
+                float median = times[repeats / 2];
+                float p95 = times[std::min(repeats - 1, (int)ceil(0.95 * repeats) - 1)];
+                double itemsPerSecond = (median > 0.0f) ? (double)length / median : 0.0;
+                printf("%-20s %-14s %5d %11llu %12.3f %12.3f %12.2f %s\n", VARIANT_NAMES[variant], DISTRIBUTION_NAMES[distribution],
+                    (int)sizeof(T), (unsigned long long)length, 1000.0f * median, 1000.0f * p95, itemsPerSecond / 1000000.0,
+                    (success ? "" : "FAIL"));
+            }
+        }
+
+        if(length > a_options.m_maxLength / a_options.m_lengthMultiplier)
+        {
+            break;
+        }
+    }
+}
+
+
+SortBenchmarkOptions::SortBenchmarkOptions()
+    : m_minLength(1 << 10)
+    , m_maxLength(1 << 30)
+    , m_lengthMultiplier(32)
+    , m_repeats(9)
+    , m_memoryBudget((size_t)1 << ((sizeof(size_t) > 4) ? 34 : 30))
+    , m_numThreads(std::max((int)std::thread::hardware_concurrency(), 1))
+{
+}
+
+
+void RunSortBenchmarks(const SortBenchmarkOptions& a_options)
+{
+    JobQueue jobQueue(std::max(a_options.m_numThreads - 1, 0));
+    SortBenchmarkOptions options = a_options;
+    options.m_minLength = std::max<size_t>(options.m_minLength, 1);
+    options.m_lengthMultiplier = std::max<size_t>(options.m_lengthMultiplier, 2);
+
+    printf("Sort benchmarks (%d threads for the MT sorts, median and 95th percentile of %d runs)\n", options.m_numThreads, options.m_repeats);
+    printf("%-20s %-14s %5s %11s %12s %12s %12s\n", "sort", "distribution", "bytes", "items", "median ms", "p95 ms", "M items/s");
+
+    BenchmarkItemType<uint32_t>(options, false, jobQueue);
+    BenchmarkItemType<uint64_t>(options, true, jobQueue);
+    BenchmarkItemType<BenchmarkRecord<16>>(options, true, jobQueue);
+    BenchmarkItemType<BenchmarkRecord<32>>(options, true, jobQueue);
+    BenchmarkItemType<BenchmarkRecord<64>>(options, true, jobQueue);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Settings for RunSortBenchmarks().
+struct SortBenchmarkOptions
+{
+    size_t m_minLength; // number of items in the smallest sorts
+    size_t m_maxLength; // number of items in the largest sorts
+    size_t m_lengthMultiplier; // each length is this many times the one before
+    int m_repeats; // number of times each sort is timed
+    size_t m_memoryBudget; // lengths where the data and scratch buffers would need more bytes than this are skipped
+    int m_numThreads; // number of threads for the multithreaded sorts, including the calling thread
+
+    // 1K to 1G items in steps of 32 times, 9 repeats, a 16GB budget and a thread per hardware thread.
+    SortBenchmarkOptions();
+};
+
+
+// Times every MergeSort variant (and std::sort for comparison) for each length, on items of 4, 8, 16, 32 and 64
+// bytes with each of these distributions of keys: uniform 32 and 64 bit, sorted, reversed, sawtooth, few unique,
+// Zipf and nearly sorted. The random keys come from a 64 bit generator, not rand(). Each sort is repeated on a fresh
+// copy of the same input, and the median and 95th percentile times and the items sorted per second are printed
+// as a table. Sorts whose result is out of order are reported as FAIL.
+void RunSortBenchmarks(const SortBenchmarkOptions& a_options);
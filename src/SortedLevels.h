@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+#include "MergeSort.h"
+#include "MultiwayMerge.h"
+
+
+// Compactions of fewer items than this are done straight away on the inserting thread, because they take less time
+// than handing them to another thread.
+const size_t SORTED_LEVELS_BACKGROUND_LENGTH = 65536;
+
+
+// A compaction of neighbouring levels of a SortedLevels into one.
+template<class T>
+struct LevelCompactionContext
+{
+    size_t m_firstLevel; // the levels from m_firstLevel up to m_endLevel are merged
+    size_t m_endLevel;
+    std::vector<const T*> m_levelItems; // the items of each level that is merged
+    std::vector<size_t> m_levelStart; // offset of each level in the buffers, followed by the total length
+    std::unique_ptr<T[]> m_buffer1; // holds the merged level when the compaction has finished
+    std::unique_ptr<T[]> m_buffer2;
+	CountLatch m_latch;
+};
+
+
+// A sorted collection of items that new batches of items are inserted into, for when re-sorting everything for each
+// batch would be wasteful. Each batch is sorted on its own and becomes a new level, and neighbouring levels are
+// merged with MergeMemcpy() so that each level stays at least a_sizeRatio times as large as the levels after it.
+// Larger ratios mean fewer levels for queries to search, but more merging. Queries search every level.
+// InsertMT() merges large levels on the job queue, and queries keep reading the old levels until the merge is done.
+// Only one thread may use it at a time. T must be safe to copy with memcpy, and is compared with operator<.
+template<class T>
+class SortedLevels
+{
+    static_assert(std::is_trivially_copyable<T>::value, "levels are copied while they are still being read");
+
+public:
+    SortedLevels(size_t a_sizeRatio = 4);
+
+    // Waits for any compaction on the job queue to finish.
+    ~SortedLevels();
+
+    // Sorts a copy of the a_length items and adds them, merging levels as needed before returning.
+    // Returns false if memory could not be allocated, in which case the items were not added.
+    bool Insert(const T* a_items, size_t a_length);
+
+    // The same as Insert() but sorts the batch with SortMT(), and large merges are done on the job queue while this
+    // carries on. Merges of levels inserted in the meantime are done straight away. a_jobQueue must outlive the
+    // merge, which is finished by the next call that inserts, or WaitForCompaction().
+    bool InsertMT(const T* a_items, size_t a_length, JobQueue& a_jobQueue);
+
+    // Waits for any merge on the job queue to finish, and does any merges that were waiting for it.
+    // Returns false if memory could not be allocated for those merges.
+    bool WaitForCompaction();
+
+    // Returns the number of items that are less than a_key, which is where a_key would go in the sorted items.
+    size_t LowerBound(const T& a_key) const;
+
+    // Returns true if an item equal to a_key has been inserted.
+    bool Contains(const T& a_key) const;
+
+    // Returns the number of items that are not less than a_low and less than a_high.
+    size_t CountRange(const T& a_low, const T& a_high) const;
+
+    // Writes the items that are not less than a_low and less than a_high to a_output in order, and returns how many
+    // there are. The part of each level in the range is found with a binary search and the parts are merged.
+    size_t CopyRange(const T& a_low, const T& a_high, T* a_output) const;
+
+    inline size_t Size() const { return m_size; }
+    inline size_t NumLevels() const { return m_levels.size(); }
+
+private:
+
+    // A sorted array of items. The levels are kept in the order they were made, so the oldest and largest is first.
+    struct Level
+    {
+        std::unique_ptr<T[]> m_items;
+        size_t m_length;
+    };
+
+    // Sorts a copy of the items into a new level, using SortMT() if a_jobQueue isn't 0, and then merges levels.
+    bool AddLevel(const T* a_items, size_t a_length, JobQueue* a_jobQueue);
+
+    // Merges levels until they keep to the size ratio. Merges are only started on the job queue if a_jobQueue isn't
+    // 0 and there isn't one already running, and the levels that one is merging are left alone.
+    // Returns false if memory could not be allocated.
+    bool Compact(JobQueue* a_jobQueue);
+
+    // Returns a compaction of the levels from a_firstLevel up to a_endLevel, or 0 if its buffers couldn't be allocated.
+    std::unique_ptr<LevelCompactionContext<T>> PrepareCompaction(size_t a_firstLevel, size_t a_endLevel);
+
+    // Replaces the levels of a finished compaction with the merged level.
+    void FinishCompaction(LevelCompactionContext<T>& a_compaction);
+
+    std::vector<Level> m_levels;
+    size_t m_size; // number of items in all the levels
+    size_t m_sizeRatio;
+    std::unique_ptr<LevelCompactionContext<T>> m_compaction; // the merge running on the job queue, if there is one
+    MergeSort<T> m_sorter;
+};
+
+
+// Merges the levels of a compaction into m_buffer1. The levels are merged from the newest, so the smallest levels
+// are merged first. Each merge goes from one buffer to the other, and each level is first copied into the buffer
+// that the merge it is part of reads from, next to the items it is merged with.
+template<class T>
+void MergeLevels(LevelCompactionContext<T>& a_compaction)
+{
+    size_t numLevels = a_compaction.m_levelItems.size();
+    const size_t* levelStart = a_compaction.m_levelStart.data();
+    T* buffers[2] = { a_compaction.m_buffer1.get(), a_compaction.m_buffer2.get() };
+
+    // choose where the newest two levels go so that the last merge writes to m_buffer1
+    size_t firstBuffer = (numLevels - 1) & 1;
+    for(size_t i = 0; i < numLevels; ++i)
+    {
+        size_t newer = numLevels - 1 - i; // the number of levels that are newer than this one
+        T* buffer = buffers[(newer <= 1) ? firstBuffer : ((firstBuffer + newer - 1) & 1)];
+        memcpy(buffer + levelStart[i], a_compaction.m_levelItems[i], sizeof(T) * (levelStart[i + 1] - levelStart[i]));
+    }
+
+    size_t source = firstBuffer;
+    for(size_t i = numLevels - 1; i-- > 0; source ^= 1)
+    {
+        MergeMemcpy(buffers[source], buffers[source ^ 1], levelStart[i], levelStart[i + 1], levelStart[numLevels]);
+    }
+}
+
+
+template<class T>
+void CompactLevelsJob(void* a_context)
+{
+    LevelCompactionContext<T>* context = (LevelCompactionContext<T>*) a_context;
+
+    MergeLevels(*context);
+
+	context->m_latch.Notify();
+}
+
+
+template<class T>
+SortedLevels<T>::SortedLevels(size_t a_sizeRatio)
+    : m_size(0)
+    , m_sizeRatio(std::max<size_t>(a_sizeRatio, 1))
+{
+}
+
+
+template<class T>
+SortedLevels<T>::~SortedLevels()
+{
+    if(m_compaction)
+    {
+		m_compaction->m_latch.Wait(1);
+    }
+}
+
+
+template<class T>
+bool SortedLevels<T>::Insert(const T* a_items, size_t a_length)
+{
+    return AddLevel(a_items, a_length, 0);
+}
+
+
+template<class T>
+bool SortedLevels<T>::InsertMT(const T* a_items, size_t a_length, JobQueue& a_jobQueue)
+{
+    return AddLevel(a_items, a_length, &a_jobQueue);
+}
+
+
+template<class T>
+bool SortedLevels<T>::WaitForCompaction()
+{
+    if(m_compaction)
+    {
+		m_compaction->m_latch.Wait(1);
+    }
+    return Compact(0);
+}
+
+
+template<class T>
+size_t SortedLevels<T>::LowerBound(const T& a_key) const
+{
+    size_t count = 0;
+    for(size_t i = 0; i < m_levels.size(); ++i)
+    {
+        const T* items = m_levels[i].m_items.get();
+        count += std::lower_bound(items, items + m_levels[i].m_length, a_key) - items;
+    }
+    return count;
+}
+
+
+template<class T>
+bool SortedLevels<T>::Contains(const T& a_key) const
+{
+    for(size_t i = 0; i < m_levels.size(); ++i)
+    {
+        const T* items = m_levels[i].m_items.get();
+        const T* end = items + m_levels[i].m_length;
+        const T* found = std::lower_bound(items, end, a_key);
+        if(found != end && !(a_key < *found))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+template<class T>
+size_t SortedLevels<T>::CountRange(const T& a_low, const T& a_high) const
+{
+    if(!(a_low < a_high))
+    {
+        return 0;
+    }
+    return LowerBound(a_high) - LowerBound(a_low);
+}
+
+
+template<class T>
+size_t SortedLevels<T>::CopyRange(const T& a_low, const T& a_high, T* a_output) const
+{
+    if(!(a_low < a_high))
+    {
+        return 0;
+    }
+
+    // The merge only copies the items, because they are trivially copyable, so the levels aren't changed.
+    std::vector<T*> current;
+    std::vector<T*> end;
+    size_t count = 0;
+    for(size_t i = 0; i < m_levels.size(); ++i)
+    {
+        T* items = m_levels[i].m_items.get();
+        T* low = std::lower_bound(items, items + m_levels[i].m_length, a_low);
+        T* high = std::lower_bound(low, items + m_levels[i].m_length, a_high);
+        if(low != high)
+        {
+            current.push_back(low);
+            end.push_back(high);
+            count += high - low;
+        }
+    }
+
+    if(!current.empty())
+    {
+        MultiwayMergeRanges(current.data(), end.data(), (int)current.size(), a_output);
+    }
+    return count;
+}
+
+
+template<class T>
+bool SortedLevels<T>::AddLevel(const T* a_items, size_t a_length, JobQueue* a_jobQueue)
+{
+    if(a_length == 0)
+    {
+        return true;
+    }
+
+    Level level;
+    level.m_items.reset(new (std::nothrow) T[a_length]);
+    level.m_length = a_length;
+    if(!level.m_items)
+    {
+        return false;
+    }
+    memcpy(level.m_items.get(), a_items, sizeof(T) * a_length);
+
+    bool sorted = (a_jobQueue != 0) ? m_sorter.SortMT(level.m_items.get(), a_length, *a_jobQueue)
+        : m_sorter.SortUnrolledMemcpy(level.m_items.get(), a_length);
+    if(!sorted)
+    {
+        return false;
+    }
+
+    m_levels.push_back(std::move(level));
+    m_size += a_length;
+    return Compact(a_jobQueue);
+}
+
+
+template<class T>
+bool SortedLevels<T>::Compact(JobQueue* a_jobQueue)
+{
+    if(m_compaction && m_compaction->m_latch.TryWait(1))
+    {
+        FinishCompaction(*m_compaction);
+        m_compaction.reset();
+    }
+
+    // the levels a running compaction is merging can't take part in another one
+    size_t firstLevel = m_compaction ? m_compaction->m_endLevel : 0;
+    while(m_levels.size() > firstLevel + 1)
+    {
+        // take in older levels while they are less than m_sizeRatio times as large as the newer ones put together
+        size_t endLevel = m_levels.size();
+        size_t level = endLevel - 1;
+        size_t length = m_levels[level].m_length;
+        while(level > firstLevel && m_levels[level - 1].m_length < m_sizeRatio * length)
+        {
+            --level;
+            length += m_levels[level].m_length;
+        }
+        if(level + 1 == endLevel)
+        {
+            return true;
+        }
+
+        std::unique_ptr<LevelCompactionContext<T>> compaction = PrepareCompaction(level, endLevel);
+        if(!compaction)
+        {
+            return false;
+        }
+
+        if(a_jobQueue != 0 && a_jobQueue->NumThreads() > 0 && !m_compaction && length >= SORTED_LEVELS_BACKGROUND_LENGTH)
+        {
+            m_compaction = std::move(compaction);
+            Job job;
+            job.m_data = m_compaction.get();
+            job.m_function = &CompactLevelsJob<T>;
+            a_jobQueue->SubmitJob(job);
+            return true;
+        }
+
+        MergeLevels(*compaction);
+        FinishCompaction(*compaction);
+    }
+    return true;
+}
+
+
+template<class T>
+std::unique_ptr<LevelCompactionContext<T>> SortedLevels<T>::PrepareCompaction(size_t a_firstLevel, size_t a_endLevel)
+{
+    std::unique_ptr<LevelCompactionContext<T>> compaction(new LevelCompactionContext<T>);
+    compaction->m_firstLevel = a_firstLevel;
+    compaction->m_endLevel = a_endLevel;
+    size_t length = 0;
+    for(size_t i = a_firstLevel; i < a_endLevel; ++i)
+    {
+        compaction->m_levelItems.push_back(m_levels[i].m_items.get());
+        compaction->m_levelStart.push_back(length);
+        length += m_levels[i].m_length;
+    }
+    compaction->m_levelStart.push_back(length);
+
+    compaction->m_buffer1.reset(new (std::nothrow) T[length]);
+    compaction->m_buffer2.reset(new (std::nothrow) T[length]);
+    if(!compaction->m_buffer1 || !compaction->m_buffer2)
+    {
+        compaction.reset();
+    }
+    return compaction;
+}
+
+
+template<class T>
+void SortedLevels<T>::FinishCompaction(LevelCompactionContext<T>& a_compaction)
+{
+    Level merged;
+    merged.m_items = std::move(a_compaction.m_buffer1);
+    merged.m_length = a_compaction.m_levelStart.back();
+    m_levels.erase(m_levels.begin() + a_compaction.m_firstLevel, m_levels.begin() + a_compaction.m_endLevel);
+    m_levels.insert(m_levels.begin() + a_compaction.m_firstLevel, std::move(merged));
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+#include "MergeKernels.h"
+
+
+// Number of items in each block sorted by SortNetworkBlocks() before merging starts.
+const int SORT_NETWORK_LENGTH = 16;
+
+
+// Puts the smaller of the two items first.
+// Arithmetic types use a conditional select so the compiler can avoid branches.
+template<class T>
+inline void CompareExchange(T& a_first, T& a_second, std::true_type)
+{
+    T first = a_first;
+    T second = a_second;
+    bool swap = second < first;
+    a_first = swap ? second : first;
+    a_second = swap ? first : second;
+}
+
+
+template<class T>
+inline void CompareExchange(T& a_first, T& a_second, std::false_type)
+{
+    if(a_second < a_first)
+    {
+        std::swap(a_first, a_second);
+    }
+}
+
+
+template<class T>
+inline void CompareExchange(T& a_first, T& a_second)
+{
+    CompareExchange(a_first, a_second, std::is_arithmetic<T>());
+}
+
+
+// Batcher's odd-even merge of the items LO, LO + R, LO + 2R ... before LO + N, where the first and second
+// halves of those items are already sorted. The whole network is generated at compile time.
+template<int LO, int N, int R, bool RECURSE = (R * 2 < N)>
+struct OddEvenMerge
+{
+    template<class T>
+    static inline void Apply(T* a_items)
+    {
+        // merge the even and the odd subsequences, then fix up neighbours
+        OddEvenMerge<LO, N, R * 2>::Apply(a_items);
+        OddEvenMerge<LO + R, N, R * 2>::Apply(a_items);
+        for(int i = LO + R; i + R < LO + N; i += R * 2)
+        {
+            CompareExchange(a_items[i], a_items[i + R]);
+        }
+    }
+};
+
+
+template<int LO, int N, int R>
+struct OddEvenMerge<LO, N, R, false>
+{
+    template<class T>
+    static inline void Apply(T* a_items)
+    {
+        CompareExchange(a_items[LO], a_items[LO + R]);
+    }
+};
+
+
+// Batcher's odd-even merge sort of the N items starting at LO. N must be a power of 2.
+template<int LO, int N, bool RECURSE = (N > 1)>
+struct OddEvenMergeSort
+{
+    template<class T>
+    static inline void Apply(T* a_items)
+    {
+        OddEvenMergeSort<LO, N / 2>::Apply(a_items);
+        OddEvenMergeSort<LO + N / 2, N / 2>::Apply(a_items);
+        OddEvenMerge<LO, N, 1>::Apply(a_items);
+    }
+};
+
+
+template<int LO, int N>
+struct OddEvenMergeSort<LO, N, false>
+{
+    template<class T>
+    static inline void Apply(T*)
+    {
+    }
+};
+
+
+// Sorts SORT_NETWORK_LENGTH items from a_source into a_destination.
+// Primitive key types sort the 4 columns of a 4x4 matrix of vectors, transpose them into 4 sorted rows, and then
+// merge the rows with bitonic networks. All 16 keys stay in registers. Traits::Min() and Traits::Max() pick each
+// lane from one of their inputs, so float and double keys that compare equal (-0.0 and +0.0) or NaNs are moved
+// like any other key instead of being copied over each other.
+template<class T>
+inline void SortNetworkBlock(const T* a_source, T* a_destination, std::true_type)
+{
+    typedef SimdMergeTraits<T> Traits;
+    typedef typename Traits::Vector Vector;
+
+    Vector v0 = Traits::Load(a_source);
+    Vector v1 = Traits::Load(a_source + 4);
+    Vector v2 = Traits::Load(a_source + 8);
+    Vector v3 = Traits::Load(a_source + 12);
+
+    // sort the columns with a 4 item network
+    Vector t;
+    t = Traits::Min(v0, v1); v1 = Traits::Max(v0, v1); v0 = t;
+    t = Traits::Min(v2, v3); v3 = Traits::Max(v2, v3); v2 = t;
+    t = Traits::Min(v0, v2); v2 = Traits::Max(v0, v2); v0 = t;
+    t = Traits::Min(v1, v3); v3 = Traits::Max(v1, v3); v1 = t;
+    t = Traits::Min(v1, v2); v2 = Traits::Max(v1, v2); v1 = t;
+
+    Traits::Transpose4(v0, v1, v2, v3);
+
+    // merge the rows into 2 sorted lists of 8
+    BitonicMerge4<Traits>(v0, v1);
+    BitonicMerge4<Traits>(v2, v3);
+
+    // Merge the 2 lists of 8. The first list followed by the second reversed is bitonic, so compare items 8 apart,
+    // then 4 apart within each half, and then finish each half of 4 with BitonicSortHalves4().
+    Vector r0 = Traits::Reverse(v3);
+    Vector r1 = Traits::Reverse(v2);
+    Vector low0 = Traits::Min(v0, r0);
+    Vector low1 = Traits::Min(v1, r1);
+    Vector high0 = Traits::Max(v0, r0);
+    Vector high1 = Traits::Max(v1, r1);
+    v0 = Traits::Min(low0, low1);
+    v1 = Traits::Max(low0, low1);
+    v2 = Traits::Min(high0, high1);
+    v3 = Traits::Max(high0, high1);
+    BitonicSortHalves4<Traits>(v0, v1);
+    BitonicSortHalves4<Traits>(v2, v3);
+
+    Traits::Store(a_destination, v0);
+    Traits::Store(a_destination + 4, v1);
+    Traits::Store(a_destination + 8, v2);
+    Traits::Store(a_destination + 12, v3);
+}
+
+
+// Other types are copied into a local array so the compiler can keep them in registers where possible.
+template<class T>
+inline void SortNetworkBlock(T* a_source, T* a_destination, std::false_type)
+{
+    T block[SORT_NETWORK_LENGTH];
+    for(int i = 0; i < SORT_NETWORK_LENGTH; ++i)
+    {
+        block[i] = std::move(a_source[i]);
+    }
+    OddEvenMergeSort<0, SORT_NETWORK_LENGTH>::Apply(block);
+    for(int i = 0; i < SORT_NETWORK_LENGTH; ++i)
+    {
+        a_destination[i] = std::move(block[i]);
+    }
+}
+
+
+// Moves a_length items from a_source to a_destination so that each block of SORT_NETWORK_LENGTH items is sorted.
+// The last block may be shorter and is sorted with an insertion sort.
+// Merging can then start with a width of SORT_NETWORK_LENGTH instead of 1, which saves several passes over memory.
+template<class T>
+inline void SortNetworkBlocks(T* a_source, T* a_destination, size_t a_length)
+{
+    size_t i = 0;
+    for(; i + SORT_NETWORK_LENGTH <= a_length; i += SORT_NETWORK_LENGTH)
+    {
+        SortNetworkBlock(a_source + i, a_destination + i, SimdMergeTag<T>());
+    }
+
+    for(size_t j = i; j < a_length; ++j)
+    {
+        T item = std::move(a_source[j]);
+        size_t k = j;
+        while(k > i && item < a_destination[k - 1])
+        {
+            a_destination[k] = std::move(a_destination[k - 1]);
+            --k;
+        }
+        a_destination[k] = std::move(item);
+    }
+}
@@ -0,0 +1,430 @@
+#include "stdafx.h"
+
+#include "StringSort.h"
+
+#include "MergeSort.h"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+
+// Groups of fewer strings than this are sorted with an insertion sort.
+static const size_t STRING_INSERTION_SORT_LENGTH = 16;
+
+// Groups of fewer strings than this are sorted with a multikey quicksort, because clearing and walking the radix
+// counts would cost more than the strings.
+static const size_t STRING_QUICKSORT_LENGTH = 512;
+
+
+// Returns the character of a string at a_depth as an unsigned value, like strcmp() compares them.
+static inline uint8_t CharAt(const char* a_string, size_t a_depth)
+{
+    return (uint8_t)a_string[a_depth];
+}
+
+
+// Sorts strings that all have the same first a_depth characters with an insertion sort, comparing from a_depth on.
+static void StringInsertionSort(const char** a_strings, size_t a_length, size_t a_depth)
+{
+    for(size_t i = 1; i < a_length; ++i)
+    {
+        const char* string = a_strings[i];
+        size_t j = i;
+        while(j > 0 && strcmp(string + a_depth, a_strings[j - 1] + a_depth) < 0)
+        {
+            a_strings[j] = a_strings[j - 1];
+            --j;
+        }
+        a_strings[j] = string;
+    }
+}
+
+
+// Bentley and Sedgewick's multikey quicksort. The strings are split three ways by their character at a_depth,
+// and only the strings that have the pivot character go on to the next character.
+static void MultikeyQuicksort(const char** a_strings, size_t a_length, size_t a_depth)
+{
+    while(a_length >= STRING_INSERTION_SORT_LENGTH)
+    {
+        // the median of 3 characters for the pivot
+        uint8_t first = CharAt(a_strings[0], a_depth);
+        uint8_t middle = CharAt(a_strings[a_length >> 1], a_depth);
+        uint8_t last = CharAt(a_strings[a_length - 1], a_depth);
+        uint8_t pivot = std::max(std::min(first, middle), std::min(std::max(first, middle), last));
+
+        // [0, less) have a smaller character, [less, i) the same, and [greater, a_length) a bigger one
+        size_t less = 0;
+        size_t i = 0;
+        size_t greater = a_length;
+        while(i < greater)
+        {
+            uint8_t c = CharAt(a_strings[i], a_depth);
+            if(c < pivot)
+            {
+                std::swap(a_strings[less++], a_strings[i++]);
+            }
+            else if(c > pivot)
+            {
+                std::swap(a_strings[--greater], a_strings[i]);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        MultikeyQuicksort(a_strings, less, a_depth);
+        MultikeyQuicksort(a_strings + greater, a_length - greater, a_depth);
+
+        // the strings that ended at a_depth are all equal
+        if(pivot == 0)
+        {
+            return;
+        }
+        a_strings += less;
+        a_length = greater - less;
+        ++a_depth;
+    }
+
+    StringInsertionSort(a_strings, a_length, a_depth);
+}
+
+
+// Reads the character at a_depth of each string into a_cache and counts them.
+static void CountStringChars(const char** a_strings, uint8_t* a_cache, size_t a_length, size_t a_depth, size_t* a_counts)
+{
+    std::fill(a_counts, a_counts + STRING_RADIX_BUCKETS, 0);
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        uint8_t c = CharAt(a_strings[i], a_depth);
+        a_cache[i] = c;
+        a_counts[c]++;
+    }
+}
+
+
+// Moves each string to the next position of its bucket, using the cached characters. a_offsets holds the next
+// position for each bucket, and is advanced as strings are moved.
+static void MoveStringsToBuckets(const char** a_strings, const char** a_destination, const uint8_t* a_cache, size_t a_length, size_t* a_offsets)
+{
+    for(size_t i = 0; i < a_length; ++i)
+    {
+        a_destination[a_offsets[a_cache[i]]++] = a_strings[i];
+    }
+}
+
+
+void SortStringRange(const char** a_strings, const char** a_temp, uint8_t* a_cache, const StringRange& a_range)
+{
+    // Each radix pass leaves a range for each character other than the end of the strings. Work through them with a
+    // stack rather than recursion, because the strings could have long prefixes in common.
+    std::vector<StringRange> stack(1, a_range);
+    while(!stack.empty())
+    {
+        StringRange range = stack.back();
+        stack.pop_back();
+        const char** strings = a_strings + range.m_start;
+        if(range.m_length < STRING_QUICKSORT_LENGTH)
+        {
+            MultikeyQuicksort(strings, range.m_length, range.m_depth);
+            continue;
+        }
+
+        size_t counts[STRING_RADIX_BUCKETS];
+        uint8_t* cache = a_cache + range.m_start;
+        CountStringChars(strings, cache, range.m_length, range.m_depth, counts);
+
+        size_t bucketStart[STRING_RADIX_BUCKETS];
+        size_t offset = 0;
+        for(int bucket = 0; bucket < STRING_RADIX_BUCKETS; ++bucket)
+        {
+            bucketStart[bucket] = offset;
+            offset += counts[bucket];
+        }
+
+        // skip the move if every string has the same character, which is common in long shared prefixes
+        if(counts[cache[0]] != range.m_length)
+        {
+            size_t offsets[STRING_RADIX_BUCKETS];
+            memcpy(offsets, bucketStart, sizeof(offsets));
+            const char** temp = a_temp + range.m_start;
+            MoveStringsToBuckets(strings, temp, cache, range.m_length, offsets);
+            memcpy(strings, temp, sizeof(const char*) * range.m_length);
+        }
+
+        // the strings that ended are all equal, and every other bucket goes on to the next character
+        for(int bucket = 1; bucket < STRING_RADIX_BUCKETS; ++bucket)
+        {
+            if(counts[bucket] > 1)
+            {
+                StringRange next;
+                next.m_start = range.m_start + bucketStart[bucket];
+                next.m_length = counts[bucket];
+                next.m_depth = range.m_depth + 1;
+                stack.push_back(next);
+            }
+        }
+    }
+}
+
+
+static void CountStringCharsJob(void* a_context)
+{
+    StringRadixContext* context = (StringRadixContext*) a_context;
+
+    CountStringChars(context->m_strings, context->m_cache, context->m_length, context->m_depth, context->m_counts);
+
+	context->m_latch->Notify();
+}
+
+
+static void MoveStringsToBucketsJob(void* a_context)
+{
+    StringRadixContext* context = (StringRadixContext*) a_context;
+
+    MoveStringsToBuckets(context->m_strings, context->m_tempRange, context->m_cache, context->m_length, context->m_counts);
+
+	context->m_latch->Notify();
+}
+
+
+static void CopyStringsBackJob(void* a_context)
+{
+    StringRadixContext* context = (StringRadixContext*) a_context;
+
+    memcpy(context->m_strings, context->m_temp, sizeof(const char*) * context->m_length);
+
+	context->m_latch->Notify();
+}
+
+
+static void SortStringRangesJob(void* a_context)
+{
+    StringRangesContext* context = (StringRangesContext*) a_context;
+
+    for(size_t i = 0; i < context->m_numRanges; ++i)
+    {
+        SortStringRange(context->m_strings, context->m_temp, context->m_cache, context->m_ranges[i]);
+    }
+
+	context->m_latch->Notify();
+}
+
+
+StringSort::StringSort()
+    : m_scratchBuffer(0)
+    , m_scratchLength(0)
+{
+}
+
+
+StringSort::StringSort(size_t a_scratchLength)
+    : m_scratchBuffer(0)
+    , m_scratchLength(0)
+{
+    EnsureBufferIsLargeEnough(a_scratchLength);
+}
+
+
+StringSort::~StringSort()
+{
+    FreeScratch();
+}
+
+
+bool StringSort::Sort(const char** a_strings, size_t a_length)
+{
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    StringRange range;
+    range.m_start = 0;
+    range.m_length = a_length;
+    range.m_depth = 0;
+    SortStringRange(a_strings, Temp(), Cache(), range);
+    return true;
+}
+
+
+bool StringSort::SortMT(const char** a_strings, size_t a_length, JobQueue& a_jobQueue)
+{
+    // use a single thread for small sorts, or when there are no other threads
+    const size_t minItemsPerThread = 4096;
+    uint32_t totalNumThreads = (uint32_t)a_jobQueue.NumThreads() + 1; // including this thread
+    if(a_length < totalNumThreads * minItemsPerThread || a_jobQueue.NumThreads() == 0)
+    {
+        return Sort(a_strings, a_length);
+    }
+
+    if(!EnsureBufferIsLargeEnough(a_length))
+    {
+        return false;
+    }
+
+    const char** temp = Temp();
+    uint8_t* cache = Cache();
+    std::unique_ptr<StringRadixContext[]> radixContext(new StringRadixContext[totalNumThreads]);
+
+	CountLatch latch;
+
+    // Runs a_function on every thread's context (including on this thread) and waits for them all.
+    auto runOnAllThreads = [&](void (*a_function)(void*))
+    {
+		latch.Reset();
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            if(i < a_jobQueue.NumThreads())
+            {
+                Job job;
+                job.m_data = &radixContext[i];
+                job.m_function = a_function;
+                a_jobQueue.SubmitJob(job);
+            }
+            else
+            {
+                a_function(&radixContext[i]);
+            }
+        }
+		latch.Wait(totalNumThreads);
+    };
+
+    // Ranges with more than a thread's share of the strings get a radix pass by all the threads, and the ranges that
+    // pass leaves are looked at again. The rest are kept to share out as jobs.
+    size_t maxJobLength = a_length / totalNumThreads;
+    std::vector<StringRange> bigRanges;
+    std::vector<StringRange> smallRanges;
+    StringRange all;
+    all.m_start = 0;
+    all.m_length = a_length;
+    all.m_depth = 0;
+    bigRanges.push_back(all);
+
+    while(!bigRanges.empty())
+    {
+        StringRange range = bigRanges.back();
+        bigRanges.pop_back();
+
+        size_t maxItemsPerThread = (range.m_length + totalNumThreads - 1) / totalNumThreads;
+        for(uint32_t i = 0; i < totalNumThreads; ++i)
+        {
+            size_t start = std::min(i * maxItemsPerThread, range.m_length);
+            StringRadixContext& context = radixContext[i];
+            context.m_strings = a_strings + range.m_start + start;
+            context.m_temp = temp + range.m_start + start;
+            context.m_tempRange = temp + range.m_start;
+            context.m_cache = cache + range.m_start + start;
+            context.m_length = std::min(maxItemsPerThread, range.m_length - start);
+            context.m_depth = range.m_depth;
+			context.m_latch = &latch;
+        }
+        runOnAllThreads(&CountStringCharsJob);
+
+        // Turn the counts into offsets. Within each bucket, thread 0's strings go first, then thread 1's and so on.
+        size_t bucketStart[STRING_RADIX_BUCKETS + 1];
+        size_t offset = 0;
+        for(int bucket = 0; bucket < STRING_RADIX_BUCKETS; ++bucket)
+        {
+            bucketStart[bucket] = offset;
+            for(uint32_t i = 0; i < totalNumThreads; ++i)
+            {
+                size_t count = radixContext[i].m_counts[bucket];
+                radixContext[i].m_counts[bucket] = offset;
+                offset += count;
+            }
+        }
+        bucketStart[STRING_RADIX_BUCKETS] = range.m_length;
+
+        // skip the move if every string has the same character
+        if(bucketStart[CharAt(a_strings[range.m_start], range.m_depth) + 1] - bucketStart[CharAt(a_strings[range.m_start], range.m_depth)] != range.m_length)
+        {
+            runOnAllThreads(&MoveStringsToBucketsJob);
+            runOnAllThreads(&CopyStringsBackJob);
+        }
+
+        // the strings that ended are all equal, and every other bucket goes on to the next character
+        for(int bucket = 1; bucket < STRING_RADIX_BUCKETS; ++bucket)
+        {
+            StringRange next;
+            next.m_start = range.m_start + bucketStart[bucket];
+            next.m_length = bucketStart[bucket + 1] - bucketStart[bucket];
+            next.m_depth = range.m_depth + 1;
+            if(next.m_length > maxJobLength)
+            {
+                bigRanges.push_back(next);
+            }
+            else if(next.m_length > 1)
+            {
+                smallRanges.push_back(next);
+            }
+        }
+    }
+
+    // Group the small ranges into jobs with about the same number of strings. There are a few jobs per thread, so
+    // threads that get groups which sort faster than the others take more of them.
+    const size_t jobsPerThread = 4;
+    size_t stringsPerJob = a_length / (totalNumThreads * jobsPerThread);
+    std::vector<StringRangesContext> rangesContext;
+    size_t firstRange = 0;
+    size_t stringsInJob = 0;
+    for(size_t i = 0; i < smallRanges.size(); ++i)
+    {
+        stringsInJob += smallRanges[i].m_length;
+        if(stringsInJob >= stringsPerJob || i + 1 == smallRanges.size())
+        {
+            StringRangesContext context;
+            context.m_strings = a_strings;
+            context.m_temp = temp;
+            context.m_cache = cache;
+            context.m_ranges = smallRanges.data() + firstRange;
+            context.m_numRanges = i + 1 - firstRange;
+            context.m_latch = &latch;
+            rangesContext.push_back(context);
+            firstRange = i + 1;
+            stringsInJob = 0;
+        }
+    }
+
+	latch.Reset();
+    for(size_t i = 0; i + 1 < rangesContext.size(); ++i)
+    {
+        Job job;
+        job.m_data = &rangesContext[i];
+        job.m_function = &SortStringRangesJob;
+        a_jobQueue.SubmitJob(job);
+    }
+    if(!rangesContext.empty())
+    {
+        SortStringRangesJob(&rangesContext.back());
+    }
+	latch.Wait((int)rangesContext.size());
+
+    return true;
+}
+
+
+bool StringSort::EnsureBufferIsLargeEnough(size_t a_length)
+{
+    if(m_scratchLength < a_length)
+    {
+        FreeScratch();
+        m_scratchBuffer = AllocateSortBuffer((sizeof(const char*) + 1) * a_length);
+        m_scratchLength = (m_scratchBuffer != 0) ? a_length : 0;
+        return m_scratchBuffer != 0;
+    }
+    return true;
+}
+
+
+void StringSort::FreeScratch()
+{
+    if(m_scratchBuffer != 0)
+    {
+        FreeSortBuffer(m_scratchBuffer, (sizeof(const char*) + 1) * m_scratchLength);
+        m_scratchBuffer = 0;
+        m_scratchLength = 0;
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "CountLatch.h"
+#include "JobQueue.h"
+
+
+// Strings are sorted one character (byte) at a time, starting from the first.
+const int STRING_RADIX_BUCKETS = 256;
+
+
+// A range of the string array whose strings all have the same first a_depth characters, and still needs sorting.
+struct StringRange
+{
+    size_t m_start; // offset of the first string in the array
+    size_t m_length; // number of strings
+    size_t m_depth; // number of characters that all the strings have in common
+};
+
+
+// The part of a parallel radix pass over a StringRange that one thread works on.
+struct StringRadixContext
+{
+    const char** m_strings; // the thread's part of the strings
+    const char** m_temp; // the same part of the temp array
+    const char** m_tempRange; // the start of the range in the temp array, which the strings are moved to
+    uint8_t* m_cache; // the character of each of the thread's strings at m_depth
+    size_t m_length; // number of strings in the thread's part
+    size_t m_depth;
+    size_t m_counts[STRING_RADIX_BUCKETS]; // number of the thread's strings with each character, then where they go
+	CountLatch* m_latch;
+};
+
+
+// A group of StringRanges that one job sorts one after another.
+struct StringRangesContext
+{
+    const char** m_strings; // the whole string array
+    const char** m_temp; // the whole temp array
+    uint8_t* m_cache; // the whole character cache
+    const StringRange* m_ranges;
+    size_t m_numRanges;
+	CountLatch* m_latch;
+};
+
+
+// Sorts arrays of null terminated strings (by pointer, so the strings themselves don't move), comparing the bytes as
+// unsigned characters like strcmp(). Only the characters that are needed to tell strings apart are ever looked at.
+// Large groups of strings are sorted with an MSD radix sort: one pass reads the character of every string at the
+// current depth into a cache, which the count and the move both use, and each bucket then carries on one
+// character deeper. Smaller groups use a multikey quicksort, and the smallest an insertion sort.
+// std::string keys can be sorted through their c_str() pointers.
+// Owns its temp arrays in the same way as MergeSort, in a buffer from AllocateSortBuffer().
+class StringSort
+{
+public:
+    StringSort();
+
+    // Pre-allocate temp arrays for the given number of strings, and then auto allocate more if needed.
+    StringSort(size_t a_scratchLength);
+
+    ~StringSort();
+
+    // Sorts the array of a_length string pointers.
+    // Returns false if the temp arrays could not be allocated.
+    bool Sort(const char** a_strings, size_t a_length);
+
+    // The same as Sort() but is multithreaded. Radix passes over groups with more than a thread's share of the
+    // strings are done by all the threads, each counting and moving its own part of the group. That carries on, one
+    // character deeper each time, until the groups are small enough, and then they are shared out as jobs.
+    bool SortMT(const char** a_strings, size_t a_length, JobQueue& a_jobQueue);
+
+private:
+
+    // Returns false if large enough arrays cannot be allocated.
+    bool EnsureBufferIsLargeEnough(size_t a_length);
+
+    void FreeScratch();
+
+    // the temp array of string pointers, followed by the character cache
+    void* m_scratchBuffer;
+    size_t m_scratchLength; // number of strings the temp arrays can hold
+
+    const char** Temp() { return (const char**)m_scratchBuffer; }
+    uint8_t* Cache() { return (uint8_t*)m_scratchBuffer + sizeof(const char*) * m_scratchLength; }
+};
+
+
+// Sorts a range of the string array on this thread, where all the strings have the same first a_range.m_depth
+// characters. a_temp and a_cache are the whole temp array and character cache, which are used at the same offsets.
+void SortStringRange(const char** a_strings, const char** a_temp, uint8_t* a_cache, const StringRange& a_range);
@@ -0,0 +1,110 @@
+#include "stdafx.h"
+
+#include "WorkStealingDeque.h"
+
+
+WorkStealingDeque::WorkStealingDeque(size_t a_capacity)
+    : m_top(0)
+    , m_bottom(0)
+{
+    size_t capacity = 2;
+    while(capacity < a_capacity)
+    {
+        capacity <<= 1;
+    }
+    m_array.store(NewArray(capacity), std::memory_order_relaxed);
+}
+
+
+void WorkStealingDeque::Push(const Job& a_job)
+{
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+    int64_t top = m_top.load(std::memory_order_acquire);
+    Array* array = m_array.load(std::memory_order_relaxed);
+    if(bottom - top > (int64_t)array->m_mask)
+    {
+        array = Grow(array, top, bottom);
+    }
+    array->Put(bottom, a_job);
+
+    // the job has to be written before thieves can see the new bottom
+    m_bottom.store(bottom + 1, std::memory_order_release);
+}
+
+
+bool WorkStealingDeque::Pop(Job& a_job)
+{
+    // Claim the newest job by moving bottom down past it, and then check that a thief didn't take it first. The fence makes
+    // sure thieves see the new bottom before this reads top.
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+    Array* array = m_array.load(std::memory_order_relaxed);
+    m_bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = m_top.load(std::memory_order_relaxed);
+
+    if(top > bottom)
+    {
+        // it was empty
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    array->Get(bottom, a_job);
+    if(top == bottom)
+    {
+        // the last job, which thieves can also take, so race them for it
+        bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+
+bool WorkStealingDeque::Steal(Job& a_job)
+{
+    int64_t top = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = m_bottom.load(std::memory_order_acquire);
+    if(top >= bottom)
+    {
+        return false;
+    }
+
+    // read the job before claiming it, because once top moves on the owner may write over the slot
+    Array* array = m_array.load(std::memory_order_acquire);
+    array->Get(top, a_job);
+    return m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+
+bool WorkStealingDeque::IsEmpty() const
+{
+    int64_t top = m_top.load(std::memory_order_relaxed);
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+    return top >= bottom;
+}
+
+
+WorkStealingDeque::Array* WorkStealingDeque::Grow(Array* a_array, int64_t a_top, int64_t a_bottom)
+{
+    Array* array = NewArray((a_array->m_mask + 1) << 1);
+    for(int64_t i = a_top; i < a_bottom; ++i)
+    {
+        Job job;
+        a_array->Get(i, job);
+        array->Put(i, job);
+    }
+    m_array.store(array, std::memory_order_release);
+    return array;
+}
+
+
+WorkStealingDeque::Array* WorkStealingDeque::NewArray(size_t a_capacity)
+{
+    std::unique_ptr<Array> array(new Array);
+    array->m_mask = a_capacity - 1;
+    array->m_slots.reset(new Slot[a_capacity]);
+    m_arrays.push_back(std::move(array));
+    return m_arrays.back().get();
+}
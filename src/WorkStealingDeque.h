@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "JobQueue.h"
+
+
+// A Chase-Lev work stealing deque of jobs (in the form for weak memory models by Le, Pop, Cohen and Zappa Nardelli).
+// One thread owns the deque, and pushes and pops jobs at the bottom without taking a lock, and without any atomic
+// read-modify-write unless there is only one job left. Any other thread can steal the oldest job from the top.
+// The array grows when it is full. Old arrays are kept until the deque is destroyed, because a thief could still
+// be reading one.
+class WorkStealingDeque
+{
+public:
+    // a_capacity is rounded up to a power of 2
+    WorkStealingDeque(size_t a_capacity = 1024);
+
+    // Only the owning thread may call these.
+    void Push(const Job& a_job);
+    bool Pop(Job& a_job);
+
+    // Any thread may call this. Returns false if the deque was empty, or another thread took the job first.
+    bool Steal(Job& a_job);
+
+    // Returns true if the deque looked empty. Other threads may push or take jobs at the same time.
+    bool IsEmpty() const;
+
+private:
+    WorkStealingDeque(const WorkStealingDeque&);
+    WorkStealingDeque& operator=(const WorkStealingDeque&);
+
+    // The fields of a job are atomic so that a thief can read a slot while the owner writes it. The thief then fails
+    // to take the job, so it doesn't matter that it may read half of each.
+    struct Slot
+    {
+        std::atomic<void*> m_data;
+        std::atomic<void (*)(void*)> m_function;
+    };
+
+    struct Array
+    {
+        size_t m_mask; // the number of slots - 1
+        std::unique_ptr<Slot[]> m_slots;
+
+        inline void Put(int64_t a_index, const Job& a_job)
+        {
+            Slot& slot = m_slots[(size_t)a_index & m_mask];
+            slot.m_data.store(a_job.m_data, std::memory_order_relaxed);
+            slot.m_function.store(a_job.m_function, std::memory_order_relaxed);
+        }
+
+        inline void Get(int64_t a_index, Job& a_job) const
+        {
+            const Slot& slot = m_slots[(size_t)a_index & m_mask];
+            a_job.m_data = slot.m_data.load(std::memory_order_relaxed);
+            a_job.m_function = slot.m_function.load(std::memory_order_relaxed);
+        }
+    };
+
+    // Replaces the array with one twice the size holding the same jobs. Returns the new array.
+    Array* Grow(Array* a_array, int64_t a_top, int64_t a_bottom);
+
+    Array* NewArray(size_t a_capacity);
+
+    // top and bottom are on separate cache lines, because thieves change top and the owner changes bottom
+    std::atomic<int64_t> m_top; // index of the oldest job
+    char m_padding1[64];
+    std::atomic<int64_t> m_bottom; // index after the newest job
+    std::atomic<Array*> m_array;
+    std::vector<std::unique_ptr<Array>> m_arrays; // the current array and all the old ones
+    char m_padding2[64];
+};